@@ -0,0 +1,834 @@
+/*
+Author: Rajnandini Thopte
+
+backend.cpp
+
+This code is for a backend server. Each backend server is one shard of the user base: it has access to all the usernames and
+their availabilities that are present in its data file. It stores and parses the information, sends usernames to the main server
+and also finds the common time availability for users present in its database and sends it to the main server for further processing.
+The shard ID, UDP port and data file are given on the command line:
+
+    ./backend -i <shard id> -p <port> -f <data file> [-b <domain end>] [-s <snapshot file>] [-V] [-w <workers>] [-q]
+
+After loading the data file the backend server writes a binary snapshot of it, <data file>.snap unless -s names another
+file. As long as the data file does not change, a restart maps the snapshot instead of parsing the text again; -V checks
+the checksums of the whole snapshot first.
+
+The data file is watched while the server runs. When it changes, a new table is built in the background and swapped in
+atomically: queries never wait for a reload and a query that started on the old table finishes on it. The users that were
+added, removed or changed are then sent to Main Server, which updates its directory and cache to match.
+
+With -b every user whose availability lies within [0, domain end) also gets a bitmap, and each query uses the bitmaps or the
+interval lists, whichever is cheaper for the users involved.
+
+Queries are answered by -w worker threads, one per core by default, all reading the same user table. Each worker has its
+own socket bound to the backend port with SO_REUSEPORT and the kernel hands every query to one of them by its request ID.
+A worker takes all the queries queued on its socket with one recvmmsg and sends their results with one sendmmsg. A batch
+query carries the usernames of many groups, and its results go back in as few datagrams as they fit in.
+
+serverA and serverB are this program built with the defaults of shard A (port 21463, a.txt) and shard B (port 22463, b.txt).
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <linux/filter.h>
+#include <poll.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+#include "protocol.h"
+#include "intervals.h"
+#include "bitmap.h"
+#include "usertable.h"
+#include "snapshot.h"
+#include "datagrams.h"
+#include "query.h"
+
+// Shard served when no options are given, set by the Makefile for serverA and serverB
+#ifndef DEFAULT_SHARD_ID
+#define DEFAULT_SHARD_ID ""
+#endif
+#ifndef DEFAULT_PORT
+#define DEFAULT_PORT 0
+#endif
+#ifndef DEFAULT_DATA_FILE
+#define DEFAULT_DATA_FILE ""
+#endif
+
+#define SERVER_M 23463
+#define LOCALHOST "127.0.0.1"
+#define FAIL -1
+#define USERLIST_CHUNK_SIZE 8192     // max bytes of usernames per Phase 1 or delta datagram
+#define USERLIST_WINDOW 8            // chunks sent ahead of the last acknowledgement
+#define RELOAD_SETTLE_MS 200         // quiet time after the last change to the data file before it is reloaded
+#define REGISTRATION_TIMEOUT_MS 100  // wait for an acknowledgement before sending the unacknowledged chunks again
+#define WORKER_IDLE_MS 100           // an idle worker wakes up this often to let go of data a reload replaced
+
+using namespace std;
+
+string shardId = DEFAULT_SHARD_ID;
+int backendPort = DEFAULT_PORT;
+string dataFile = DEFAULT_DATA_FILE;
+string snapshotFile; // <data file>.snap by default
+bool verifySnapshot = false;
+int bitmapDomain = 0; // 0: no bitmaps
+int workerCount = 0;  // 0: one per core
+bool quiet = false;
+
+int backend_sockfd;
+struct sockaddr_in my_addr;
+struct sockaddr_in serverM_addr;
+
+// The workers and the reload thread share stdout, so every message is printed whole under this lock
+mutex logMutex;
+
+// Everything a query reads (query.h): the usernames and their availabilities from the data file and, with -b, their bitmaps.
+// A reload builds a new one next to the one in use and publishes it with an atomic pointer swap.
+// Only ever accessed through atomic_load and atomic_store
+shared_ptr<ShardData> currentData;
+// Bumped after every publish. Workers keep their own reference to the data and only load currentData again when this
+// changes, so the queries do not all go through the lock that guards atomic_load on a shared_ptr.
+atomic<uint64_t> dataEpoch(0);
+// Replies the socket refused to send, over every worker. They are dropped; Main Server sends their queries again.
+atomic<uint64_t> repliesDropped(0);
+
+// Deleter of the published data. The last reference to an old version is usually dropped by a worker about to answer a
+// query, so the version is freed on a thread of its own instead.
+void retireData(ShardData *data)
+{
+    thread([data]() { delete data; }).detach();
+}
+
+// Prints one message, which may span several lines, unless -q was given
+void logMessage(const string &message)
+{
+    if (quiet)
+    {
+        return;
+    }
+    lock_guard<mutex> lock(logMutex);
+    cout << message << endl;
+}
+
+// Repurposed from Beej’s socket programming tutorial
+// Creates the UDP socket for the backend server
+void create_backend_socket()
+{
+    backend_sockfd = socket(AF_INET, SOCK_DGRAM, 0); // creates a UDP socket
+    if (backend_sockfd == FAIL)
+    {
+        perror(("[ERROR] Server " + shardId + " cannot open socket.").c_str());
+        exit(1);
+    }
+    // The sockets of the other workers are bound to the same port
+    int one = 1;
+    if (setsockopt(backend_sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == FAIL)
+    {
+        perror(("[ERROR] Server " + shardId + " cannot share its port between workers").c_str());
+    }
+}
+
+// Repurposed from Beej’s socket programming tutorial
+// initializeConnection() sets the struct sockaddr_in for the backend server with appropriate parameters and its' assigned UDP port number.
+void initializeConnectionBackend()
+{
+    memset(&my_addr, 0, sizeof(my_addr));
+    my_addr.sin_family = AF_INET;
+    my_addr.sin_addr.s_addr = inet_addr(LOCALHOST);
+    my_addr.sin_port = htons(backendPort);
+}
+
+// Repurposed from Beej’s socket programming tutorial
+void initializeConnectionM()
+{
+
+    memset(&serverM_addr, 0, sizeof(serverM_addr));
+    serverM_addr.sin_family = AF_INET;
+    serverM_addr.sin_addr.s_addr = inet_addr(LOCALHOST);
+    serverM_addr.sin_port = htons(SERVER_M);
+}
+
+// Repurposed from Beej’s socket programming tutorial
+void bindSocket()
+{
+    // Bind the socket to the receive address
+    if (::bind(backend_sockfd, (sockaddr *)&my_addr, sizeof(my_addr)) == -1)
+    {
+        perror(("[ERROR] Server " + shardId + " failed to bind UDP socket.").c_str());
+        exit(1);
+    }
+    cout << "Server " << shardId << " is up and running using UDP on port " << backendPort <<"."<< endl;
+}
+
+/*
+Opens the sockets of workers 1 to n - 1 on the backend port next to backend_sockfd, which worker 0 keeps. Main Server sends
+every query from the same socket, so the kernel's usual pick by address hash would hand all of them to one worker. A classic
+BPF program attached to the group picks the socket from the request ID instead, which spreads the queries evenly. If the
+sockets or the program cannot be set up, all workers share backend_sockfd and the kernel wakes one of them per query.
+*/
+vector<int> openWorkerSockets(int workers)
+{
+    vector<int> sockets = {backend_sockfd};
+    int one = 1;
+    for (int i = 1; i < workers; i++)
+    {
+        int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sockfd == FAIL || setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == FAIL ||
+            ::bind(sockfd, (sockaddr *)&my_addr, sizeof(my_addr)) == FAIL)
+        {
+            perror(("Server " + shardId + " cannot open a socket per worker, the workers share one").c_str());
+            if (sockfd != FAIL)
+            {
+                close(sockfd);
+            }
+            break;
+        }
+        sockets.push_back(sockfd);
+    }
+
+    bool steered = (int)sockets.size() == workers;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    // The socket of a query is its request ID, the first word of the UDP payload, modulo the number of sockets
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)sockets.size()),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog program = {sizeof(code) / sizeof(code[0]), code};
+    if (steered && workers > 1 && setsockopt(backend_sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof program) == FAIL)
+    {
+        perror(("Server " + shardId + " cannot spread queries over the worker sockets, the workers share one").c_str());
+        steered = false;
+    }
+#else
+    steered = workers == 1;
+#endif
+    if (!steered)
+    {
+        for (size_t i = 1; i < sockets.size(); i++)
+        {
+            close(sockets[i]);
+        }
+        sockets.assign(workers, backend_sockfd);
+    }
+
+    struct timeval idle;
+    idle.tv_sec = 0;
+    idle.tv_usec = WORKER_IDLE_MS * 1000;
+    for (int sockfd : sockets)
+    {
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof idle);
+    }
+    return sockets;
+}
+
+// The data version of a data file is a hash of its modification time and size, so every replica of a shard that loads the
+// same file agrees on it, whenever it was started, and a changed file gets a different one.
+uint32_t fileVersion(const struct stat &source)
+{
+    int64_t identity[3] = {(int64_t)source.st_mtim.tv_sec, (int64_t)source.st_mtim.tv_nsec, (int64_t)source.st_size};
+    uint64_t hash = hashName((const char *)identity, sizeof identity);
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+//This function loads the user table of the shard: straight from the snapshot if it is up to date with the data file,
+//otherwise by parsing the data file on every core and writing a new snapshot of it. It then builds the free index of reverse
+//queries, and with -b the bitmaps.
+bool readInput(ShardData &data)
+{
+    UserTable &database = data.database;
+    if (stat(dataFile.c_str(), &data.source) == FAIL)
+    {
+        cerr << "Error: Could not open the input file" << endl;
+        return false;
+    }
+    data.version = fileVersion(data.source);
+    string reason;
+    if (openSnapshot(snapshotFile, data.source, database, verifySnapshot, reason))
+    {
+        logMessage("Server " + shardId + " loaded " + to_string(database.size()) + " users from snapshot " + snapshotFile + ".");
+    }
+    else if (!loadUserTable(dataFile, database))
+    {
+        cerr << "Error: Could not open the input file" << endl;
+        return false;
+    }
+    else if (writeSnapshot(database, snapshotFile, data.source))
+    {
+        logMessage("Server " + shardId + " wrote snapshot " + snapshotFile + " (" + reason + ").");
+    }
+    else
+    {
+        perror(("Server " + shardId + " failed to write snapshot " + snapshotFile).c_str());
+    }
+
+    data.freeIndex.build(database);
+    logMessage("Server " + shardId + " built the free index over " + to_string(data.freeIndex.size()) + " intervals of " + to_string(database.size()) +
+               " users.");
+
+    if (bitmapDomain > 0)
+    {
+        size_t built = buildBitmaps(data, bitmapDomain);
+        logMessage("Server " + shardId + " built bitmaps over [0, " + to_string(bitmapDomain) + ") for " + to_string(built) + " of " +
+                   to_string(database.size()) + " users.");
+    }
+    return true;
+}
+
+// Adds one comma terminated item to a list that is sent in chunks. Every chunk starts with the shard ID so Main Server
+// knows which shard it is from.
+void appendToChunks(vector<string> &chunks, string_view item)
+{
+    string prefix = shardId + ":";
+    if (chunks.empty() || (chunks.back().size() > prefix.size() && chunks.back().size() + item.size() + 1 > USERLIST_CHUNK_SIZE))
+    {
+        chunks.push_back(prefix);
+    }
+    chunks.back() += item;
+    chunks.back() += ',';
+}
+
+/*
+Sends a list to Main Server in numbered chunks that each fit in one datagram; the last one carries FLAG_LAST_CHUNK.
+Main Server acknowledges every chunk with the number of chunks of this version it has received in order, so up to
+USERLIST_WINDOW chunks are kept in flight. After a timeout, or three acknowledgements that repeat the same count because a
+chunk got lost, everything from the first unacknowledged chunk is sent again. This also covers a Main Server that is not up yet.
+*/
+void sendChunks(int sockfd, const struct sockaddr_in &destination, uint16_t opcode, uint16_t ack_opcode, uint32_t version, const vector<string> &chunks)
+{
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = REGISTRATION_TIMEOUT_MS * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) == FAIL)
+    {
+        perror("setsockopt");
+        exit(1);
+    }
+
+    vector<char> userlist_msg;
+    char ack_buffer[MAX_DATAGRAM_SIZE];
+    uint32_t acked = 0;
+    uint32_t sent = 0;
+    int duplicates = 0;
+    uint32_t recover = 0; // chunks sent when they were last sent again; repeated counts up to it come from those copies
+    while (acked < chunks.size())
+    {
+        while (sent < chunks.size() && sent < acked + USERLIST_WINDOW)
+        {
+            uint16_t flags = (sent + 1 == chunks.size()) ? FLAG_LAST_CHUNK : 0;
+            userlist_msg.resize(HEADER_SIZE + chunks[sent].size());
+            size_t userlist_len = packMessage(userlist_msg.data(), sent, opcode, flags, chunks[sent].data(), chunks[sent].size(), version);
+            if (sendto(sockfd, userlist_msg.data(), userlist_len, 0, (struct sockaddr *)&destination, sizeof(destination)) == FAIL)
+            {
+                perror(("Server " + shardId + " failed to send usernames to Server M").c_str());
+                exit(1);
+            }
+            sent++;
+        }
+
+        int bytes_received = recvfrom(sockfd, ack_buffer, MAX_DATAGRAM_SIZE, 0, NULL, NULL);
+        if (bytes_received == FAIL)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                recover = sent;
+                sent = acked; // go back to the first chunk that was not acknowledged
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror(("Server " + shardId + " failed to receive from Server M").c_str());
+            exit(1);
+        }
+        MessageHeader ack;
+        if (!unpackHeader(ack_buffer, bytes_received, ack) || ack.opcode != ack_opcode || ack.version != version)
+        {
+            continue;
+        }
+        if (ack.request_id > acked)
+        {
+            acked = min<uint32_t>(ack.request_id, chunks.size());
+            sent = max(sent, acked);
+            duplicates = 0;
+        }
+        else if (ack.request_id == acked && acked > recover && ++duplicates == 3)
+        {
+            recover = sent;
+            sent = acked; // a later chunk arrived before the one Main Server is waiting for
+        }
+    }
+
+    // Queries are waited for without a timeout
+    timeout.tv_usec = 0;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+}
+
+/*
+PHASE 1
+Sends the usernames of the data file to Main Server.
+*/
+void Phase1_sendUsernames(const ShardData &data)
+{
+    vector<string> chunks;
+    for (uint32_t user = 0; user < data.database.size(); user++)
+    {
+        appendToChunks(chunks, data.database.name(user));
+    }
+    if (chunks.empty())
+    {
+        chunks.push_back(shardId + ":");
+    }
+    sendChunks(backend_sockfd, serverM_addr, OP_USERLIST, OP_USERLIST_ACK, data.version, chunks);
+}
+
+// Lists the users that differ between two versions of the data as "+name" (added), "-name" (removed) and "~name" (changed)
+vector<string> listChanges(const UserTable &before, const UserTable &after, size_t &added, size_t &removed, size_t &changed)
+{
+    vector<string> chunks;
+    string item;
+    added = removed = changed = 0;
+    for (uint32_t user = 0; user < after.size(); user++)
+    {
+        string_view username = after.name(user);
+        uint32_t previous = before.find(username.data(), username.size());
+        char change;
+        if (previous == NOT_FOUND)
+        {
+            change = '+';
+            added++;
+        }
+        else
+        {
+            IntervalSpan old_intervals = before.availability(previous);
+            IntervalSpan new_intervals = after.availability(user);
+            if (old_intervals.size == new_intervals.size && equal(new_intervals.data, new_intervals.data + new_intervals.size, old_intervals.data))
+            {
+                continue;
+            }
+            change = '~';
+            changed++;
+        }
+        item.assign(1, change);
+        item += username;
+        appendToChunks(chunks, item);
+    }
+    for (uint32_t user = 0; user < before.size(); user++)
+    {
+        string_view username = before.name(user);
+        if (after.find(username.data(), username.size()) == NOT_FOUND)
+        {
+            item.assign(1, '-');
+            item += username;
+            appendToChunks(chunks, item);
+            removed++;
+        }
+    }
+    return chunks;
+}
+
+/*
+Builds a new version of the data from the changed data file, publishes it and sends the changes to Main Server.
+Runs on the watcher thread, so the queries served meanwhile only ever see a complete table, the old or the new one.
+*/
+void reloadData(int sockfd, const struct sockaddr_in &destination)
+{
+    shared_ptr<ShardData> old_data = atomic_load(&currentData);
+    struct stat source;
+    if (stat(dataFile.c_str(), &source) == FAIL ||
+        (source.st_size == old_data->source.st_size && source.st_mtim.tv_sec == old_data->source.st_mtim.tv_sec && source.st_mtim.tv_nsec == old_data->source.st_mtim.tv_nsec))
+    {
+        return;
+    }
+
+    shared_ptr<ShardData> new_data(new ShardData(), retireData);
+    if (!readInput(*new_data))
+    {
+        return;
+    }
+    size_t added, removed, changed;
+    vector<string> chunks = listChanges(old_data->database, new_data->database, added, removed, changed);
+    // Main Server still moves to the new version when no user changed, or it would never cache results of this version
+    if (chunks.empty())
+    {
+        chunks.push_back(shardId + ":");
+    }
+    atomic_store(&currentData, new_data);
+    dataEpoch.fetch_add(1, memory_order_release);
+    logMessage("Server " + shardId + " reloaded " + dataFile + " (version " + to_string(new_data->version) + "): " + to_string(added) +
+               " added, " + to_string(removed) + " removed, " + to_string(changed) + " changed.");
+
+    sendChunks(sockfd, destination, OP_DELTA, OP_DELTA_ACK, new_data->version, chunks);
+    logMessage("Server " + shardId + " finished sending the changes to Main Server.");
+}
+
+// Watches the directory of the data file, so that editors that replace the file instead of writing it are noticed too
+void watchDataFile(struct sockaddr_in destination)
+{
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd == FAIL)
+    {
+        perror(("Server " + shardId + " cannot watch its data file").c_str());
+        return;
+    }
+    size_t slash = dataFile.rfind('/');
+    string directory = (slash == string::npos) ? "." : dataFile.substr(0, slash + 1);
+    string file_name = (slash == string::npos) ? dataFile : dataFile.substr(slash + 1);
+    if (inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == FAIL)
+    {
+        perror(("Server " + shardId + " cannot watch its data file").c_str());
+        close(inotify_fd);
+        return;
+    }
+    // The changes go out on their own socket so that their acknowledgements do not mix with the queries
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd == FAIL)
+    {
+        perror(("Server " + shardId + " cannot open socket.").c_str());
+        close(inotify_fd);
+        return;
+    }
+
+    alignas(struct inotify_event) char events[4096];
+    while (true)
+    {
+        ssize_t length = read(inotify_fd, events, sizeof(events));
+        if (length <= 0)
+        {
+            if (length == FAIL && errno == EINTR)
+            {
+                continue;
+            }
+            perror(("Server " + shardId + " stopped watching its data file").c_str());
+            return;
+        }
+        bool touched = false;
+        for (char *p = events; p < events + length;)
+        {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && file_name == event->name)
+            {
+                touched = true;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+        if (!touched)
+        {
+            continue;
+        }
+        // A file is often written in several steps; wait until it has been quiet for a moment
+        struct pollfd pending = {inotify_fd, POLLIN, 0};
+        while (poll(&pending, 1, RELOAD_SETTLE_MS) > 0)
+        {
+            if (read(inotify_fd, events, sizeof(events)) <= 0)
+            {
+                break;
+            }
+        }
+        reloadData(sockfd, destination);
+    }
+}
+
+/*
+PHASE 2 & 3
+A worker: answers the queries that arrive on sockfd until the program exits. Every wakeup takes all the queries that are
+queued, up to DATAGRAM_BATCH, with one recvmmsg and sends all their results with one sendmmsg. Every worker keeps its own
+buffers and its own reference to the current data, so the workers share nothing but the read-only user table and stdout.
+*/
+void serveQueries(int sockfd)
+{
+    // Reused by every request so that, once they have grown, the query path does not allocate
+    DatagramBatch queries;
+    DatagramBatch replies;
+    QueryArena arena;
+    string log; // messages of the current batch, printed once its results are sent
+
+    shared_ptr<ShardData> data;
+    uint64_t data_epoch = UINT64_MAX;
+
+    // A batch query can have more results than fit in one datagram, so the send batch can fill up before the whole batch
+    // of queries is answered. Replies that cannot be sent are dropped, the worker keeps serving.
+    auto flush_replies = [&]()
+    {
+        if (replies.count == 0)
+        {
+            return;
+        }
+        size_t failed = replies.flush(sockfd);
+        if (failed > 0)
+        {
+            int error = errno;
+            uint64_t dropped = repliesDropped.fetch_add(failed, memory_order_relaxed) + failed;
+            cerr << "Error: Server " << shardId << " could not send " << failed << " replies (" << strerror(error) << "), " << dropped
+                 << " dropped so far" << endl;
+        }
+    };
+    auto reply_buffer = [&]()
+    {
+        if (replies.full())
+        {
+            flush_replies();
+        }
+        return replies.next();
+    };
+
+    //while loop for continuous requests
+    while (true)
+    {
+        //Receiving usernames from Main server for which we need to find common time intersection.
+        int received = queries.receive(sockfd, MSG_WAITFORONE);
+
+        // Take the data a reload published since the last batch; this also runs when the socket has been idle for
+        // WORKER_IDLE_MS, so the old data is not kept alive by a worker that gets no queries.
+        // A batch is answered from the data taken here even if a reload publishes a new version meanwhile.
+        uint64_t epoch = dataEpoch.load(memory_order_acquire);
+        if (epoch != data_epoch)
+        {
+            data = atomic_load(&currentData);
+            data_epoch = epoch;
+        }
+
+        if (received == FAIL)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                continue;
+            }
+            perror(("Server " + shardId + " did not receieve usernames from Main Server").c_str());
+            exit(1);
+        }
+
+        const UserTable &database = data->database;
+
+        for (size_t q = 0; q < queries.count; q++)
+        {
+            const char *buffer_phase2 = queries.buffer(q);
+
+            // Every query carries a request ID that has to be echoed in the reply
+            MessageHeader query_header;
+            if (!unpackHeader(buffer_phase2, queries.length(q), query_header))
+            {
+                cerr << "Error: Server " << shardId << " received a malformed message from Main Server" << endl;
+                continue;
+            }
+            // Main Server probes the health of every replica of a shard; the answer is sent with the results of the batch
+            if (query_header.opcode == OP_PING)
+            {
+                packHeader(reply_buffer(), query_header.request_id, OP_PONG, 0, 0, data->version);
+                replies.queue(HEADER_SIZE, queries.address(q));
+                continue;
+            }
+            // The subgroups of a batch query are answered one after the other, their results packed into as few datagrams
+            // as they fit in
+            if (query_header.opcode == OP_BATCH_QUERY)
+            {
+                size_t oversized;
+                size_t subgroups = answerBatch(*data, query_header, buffer_phase2 + HEADER_SIZE, arena, reply_buffer(),
+                                               [&](size_t size)
+                                               {
+                                                   replies.queue(size, queries.address(q));
+                                                   return reply_buffer();
+                                               },
+                                               oversized);
+                if (oversized > 0)
+                {
+                    cerr << "Error: Server " << shardId << " found " << oversized << " intersection results of a batch query that do not fit in one datagram and reported them as too large" << endl;
+                }
+                if (!quiet)
+                {
+                    log += "Server " + shardId + " received a batch of " + to_string(subgroups) + " groups of usernames from Main Server using UDP over port " +
+                           to_string(backendPort) + ".\n";
+                    log += "Server " + shardId + " finished sending the responses to Main Server.\n\n\n";
+                }
+                continue;
+            }
+            // A reverse query is answered from the free index, or from the candidates' own availability, and its usernames
+            // go back in as many chunks as they need
+            if (query_header.opcode == OP_FREE_QUERY)
+            {
+                size_t found = answerFree(*data, query_header, buffer_phase2 + HEADER_SIZE, arena, reply_buffer(),
+                                          [&](size_t size)
+                                          {
+                                              replies.queue(size, queries.address(q));
+                                              return reply_buffer();
+                                          });
+                if (!quiet)
+                {
+                    log += "Server " + shardId + " received a free query from Main Server using UDP over port " + to_string(backendPort) + ".\n";
+                    log += "Server " + shardId + " found " + to_string(found) + " users free and finished sending them to Main Server.\n\n\n";
+                }
+                continue;
+            }
+            if (query_header.opcode != OP_QUERY)
+            {
+                continue; // e.g. a late acknowledgement of the username list
+            }
+
+            //Finding the common time intersection of the usernames, and queueing it for Main server, tagged with the request
+            //ID of the query, straight into the send batch
+            char *reply = reply_buffer();
+            size_t size = answerQuery(*data, query_header, buffer_phase2 + HEADER_SIZE, arena, reply);
+            for (string_view missing_name : arena.missing)
+            {
+                cerr << "Error: No data found for user " << missing_name << endl;
+            }
+            if (size == 0)
+            {
+                // Main Server is told so right away rather than left to retry a query that fails the same way every time
+                cerr << "Error: Server " << shardId << " found an intersection result of " << arena.intersection.size()
+                     << " intervals, which does not fit in one datagram, and reported it as too large" << endl;
+                packHeader(reply, query_header.request_id, OP_RESULT, FLAG_TOO_LARGE, 0, data->version);
+                replies.queue(HEADER_SIZE, queries.address(q));
+                continue;
+            }
+            replies.queue(size, queries.address(q));
+
+            if (quiet)
+            {
+                continue;
+            }
+
+            //Formatting print statement
+            log += "Server " + shardId + " received the usernames from Main Server using UDP over port " + to_string(backendPort) + ".\n";
+            log += "Found intersection result ";
+            if (arena.intersection.empty())
+            {
+                log += "[] ";
+            }
+            // Loop through each interval and add its string representation to the result string
+            for (const auto &interval : arena.intersection)
+            {
+                log += "[" + to_string(interval.first) + ", " + to_string(interval.second) + "] ";
+            }
+
+            // Add the names of the selected users to the result string
+            log += "for ";
+            for (size_t i = 0; i < arena.users.size(); i++)
+            {
+                log += database.name(arena.users[i]);
+                // If this is not the last selected user, add a comma and space
+                if (i < arena.users.size() - 1)
+                {
+                    log += ",";
+                }
+            }
+            log += ".\n";
+            log += "Server " + shardId + " finished sending the response to Main Server.\n\n\n";
+        }
+
+        //Sending the intersection results of the whole batch to Main server
+        flush_replies();
+
+        // Print the messages of the batch at once so that the lines of concurrent workers do not interleave
+        if (!log.empty())
+        {
+            lock_guard<mutex> lock(logMutex);
+            cout << log << flush;
+            log.clear();
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "i:p:f:b:s:Vw:q")) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            shardId = optarg;
+            break;
+        case 'p':
+            backendPort = atoi(optarg);
+            break;
+        case 'f':
+            dataFile = optarg;
+            break;
+        case 'b':
+            bitmapDomain = atoi(optarg);
+            break;
+        case 's':
+            snapshotFile = optarg;
+            break;
+        case 'V':
+            verifySnapshot = true;
+            break;
+        case 'w':
+            workerCount = atoi(optarg);
+            break;
+        case 'q':
+            // Without a buffer every log line is a no-op; errors still go to cerr
+            quiet = true;
+            cout.rdbuf(NULL);
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " -i <shard id> -p <port> -f <data file> [-b <domain end>] [-s <snapshot file>] [-V] [-w <workers>] [-q]" << endl;
+            return 1;
+        }
+    }
+    if (shardId.empty() || backendPort <= 0 || dataFile.empty() || workerCount < 0)
+    {
+        cerr << "Usage: " << argv[0] << " -i <shard id> -p <port> -f <data file> [-b <domain end>] [-s <snapshot file>] [-V] [-w <workers>] [-q]" << endl;
+        return 1;
+    }
+    if (workerCount == 0)
+    {
+        workerCount = max(1u, thread::hardware_concurrency());
+    }
+    if (snapshotFile.empty())
+    {
+        snapshotFile = dataFile + ".snap";
+    }
+
+    // Create UDP socket for the backend server
+    create_backend_socket();
+    // Create sockaddr_in struct
+    initializeConnectionBackend();
+    initializeConnectionM();
+    bindSocket();
+
+    // Reading input file
+    shared_ptr<ShardData> initial(new ShardData(), retireData);
+    readInput(*initial);
+    atomic_store(&currentData, initial);
+    //Sending usernames of the data file to server M
+    Phase1_sendUsernames(*initial);
+    initial.reset();
+
+    cout << "Server " << shardId << " finished sending a list of usernames to Main Server." << endl;
+    cout << endl;
+    cout << endl;
+
+    vector<int> sockets = openWorkerSockets(workerCount);
+    cout << "Server " << shardId << " is answering queries with " << workerCount << " workers." << endl;
+
+    // Pick up changes to the data file from now on
+    thread(watchDataFile, serverM_addr).detach();
+    for (int i = 1; i < workerCount; i++)
+    {
+        thread(serveQueries, sockets[i]).detach();
+    }
+    serveQueries(sockets[0]);
+    return 0;
+}
@@ -0,0 +1,831 @@
+/*
+Author: Rajnandini Thopte
+
+bench.cpp
+
+Microbenchmarks of the kernels the servers spend their time in, on synthetic data (synthetic.h):
+
+    intersect/...  the k-way sweep (intervals.h) and the bitmap AND (bitmap.h) over groups of k users with n intervals each
+                   covering a fraction c of a week, as the backend servers and Main Server intersect them; the checks
+                   compare the sweep with the pairwise intersection it replaced, and the bitmap path with the sweep, on
+                   random groups and filters
+    codec/...      the binary and text forms of an intersection result (protocol.h)
+    load/...       parsing data file lines, loading a whole data file and opening its snapshot (usertable.h, snapshot.h)
+    directory/...  username lookups in the shard directory (directory.h)
+    query/...      the whole query path of a backend server, from the datagram to the reply, for single and batch queries (query.h)
+    free/...       who is free for a window: the free index (freeindex.h) against a scan of every user, and the whole
+                   reverse query path (query.h)
+
+Every benchmark is repeated until it has run for at least BENCH_MIN_SECONDS and reports the time, the number of heap
+allocations and the bytes allocated per operation; operator new is replaced to count them. The query path must not allocate
+once it has warmed up: if any query benchmark does, bench says so and exits with status 1. The checks among them compare a
+fast kernel with a plain reference on the same inputs, and a mismatch fails the run the same way. Run ./bench [filter] to
+run only the benchmarks and checks whose name contains filter.
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "directory.h"
+#include "intervals.h"
+#include "bitmap.h"
+#include "usertable.h"
+#include "snapshot.h"
+#include "synthetic.h"
+#include "query.h"
+
+#define BENCH_MIN_SECONDS 0.2
+#define BENCH_DOMAIN 10080 // minutes in a week
+#define BENCH_POOL 1024     // users generated per intersection dataset; groups are drawn from them
+#define BENCH_GROUPS 256    // groups cycled through per intersection benchmark
+#define CHECK_DOMAIN 1000   // domain of the checks: a few bitmap blocks, small enough for endpoints to meet often
+#define CHECK_CASES 20000   // random groups per check
+
+using namespace std;
+
+// Heap allocations since the start, counted by the operator new below
+atomic<uint64_t> allocCount(0);
+atomic<uint64_t> allocBytes(0);
+
+void *operator new(size_t size)
+{
+    allocCount.fetch_add(1, memory_order_relaxed);
+    allocBytes.fetch_add(size, memory_order_relaxed);
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+    {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+// Every form of operator delete frees what operator new above allocated. They are kept out of line, or GCC sees free
+// called on a pointer from operator new once both are inlined into a container and warns with -Wmismatched-new-delete.
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+string filter;
+int failures = 0; // benchmarks that allocated although they must not, and checks that found a mismatch
+
+// Keeps the compiler from optimising away a result nobody reads
+template <typename T>
+inline void keep(const T &value)
+{
+    asm volatile("" : : "r"(&value) : "memory");
+}
+
+// True if the filter leaves out the benchmark or check of this name
+bool skipped(const string &name)
+{
+    return !filter.empty() && name.find(filter) == string::npos;
+}
+
+/*
+Runs check on cases 0 to cases - 1; each returns false if the kernel disagrees with its reference on that case. The first
+mismatch is reported and fails the run.
+*/
+template <typename Check>
+void runCheck(const string &name, size_t cases, Check check)
+{
+    if (skipped(name))
+    {
+        return;
+    }
+    for (size_t i = 0; i < cases; i++)
+    {
+        if (!check(i))
+        {
+            fprintf(stderr, "FAIL: %s differs from its reference in case %zu\n", name.c_str(), i);
+            failures++;
+            return;
+        }
+    }
+    printf("%-52s %12zu cases ok\n", name.c_str(), cases);
+    fflush(stdout);
+}
+
+/*
+Runs op, which performs ops_per_call operations, until BENCH_MIN_SECONDS have passed, doubling the number of calls each
+round, and prints the figures of the last round. Returns the allocations per operation, or 0 if the filter skipped it.
+*/
+template <typename Op>
+double runBenchmark(const string &name, double ops_per_call, Op op)
+{
+    if (skipped(name))
+    {
+        return 0;
+    }
+    op(); // warm up caches and let the reusable buffers reach their size
+    uint64_t calls = 1;
+    while (true)
+    {
+        uint64_t count_before = allocCount.load();
+        uint64_t bytes_before = allocBytes.load();
+        auto start = chrono::steady_clock::now();
+        for (uint64_t i = 0; i < calls; i++)
+        {
+            op();
+        }
+        double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (elapsed >= BENCH_MIN_SECONDS || calls >= (1ull << 40))
+        {
+            double ops = calls * ops_per_call;
+            double allocs = (allocCount.load() - count_before) / ops;
+            printf("%-52s %12.1f ns/op %10.2f allocs/op %12.1f bytes/op\n", name.c_str(), elapsed * 1e9 / ops,
+                   allocs, (allocBytes.load() - bytes_before) / ops);
+            fflush(stdout);
+            return allocs;
+        }
+        calls *= 2;
+    }
+}
+
+// Availability of BENCH_POOL users with n intervals each covering about c of the domain
+vector<vector<pair<int, int>>> makeUsers(mt19937_64 &rng, size_t n, double c)
+{
+    vector<vector<pair<int, int>>> users(BENCH_POOL);
+    for (auto &user : users)
+    {
+        randomAvailability(rng, BENCH_DOMAIN, n, c, user);
+    }
+    return users;
+}
+
+void benchIntersect()
+{
+    mt19937_64 rng(1);
+    for (size_t n : {10, 100, 1000})
+    {
+        for (double c : {0.2, 0.5, 0.9})
+        {
+            vector<vector<pair<int, int>>> users = makeUsers(rng, n, c);
+            BitmapSet bitmaps;
+            bitmaps.init(BENCH_DOMAIN);
+            vector<uint32_t> rows;
+            for (const auto &user : users)
+            {
+                rows.push_back(bitmaps.add(spanOf(user)));
+            }
+            for (size_t k : {2, 5, 10})
+            {
+                // The groups to cycle through, as the backend sees them: spans into the stored lists
+                vector<vector<uint32_t>> groups(BENCH_GROUPS);
+                for (auto &group : groups)
+                {
+                    for (size_t i = 0; i < k; i++)
+                    {
+                        group.push_back(uniform_int_distribution<uint32_t>(0, BENCH_POOL - 1)(rng));
+                    }
+                }
+                string suffix = "/k=" + to_string(k) + "/n=" + to_string(n) + "/c=" + to_string(c).substr(0, 3);
+
+                vector<IntervalSpan> spans;
+                vector<pair<int, int>> out;
+                size_t next = 0;
+                runBenchmark("intersect/sweep" + suffix, BENCH_GROUPS, [&]() {
+                    for (size_t g = 0; g < BENCH_GROUPS; g++)
+                    {
+                        spans.clear();
+                        for (uint32_t user : groups[(next + g) % BENCH_GROUPS])
+                        {
+                            spans.push_back(spanOf(users[user]));
+                        }
+                        intersectIntervals(spans.data(), spans.size(), out);
+                        keep(out);
+                    }
+                    next++;
+                });
+
+                vector<const uint64_t *> selected;
+                vector<uint64_t> common(bitmaps.words);
+                runBenchmark("intersect/bitmap" + suffix, BENCH_GROUPS, [&]() {
+                    for (size_t g = 0; g < BENCH_GROUPS; g++)
+                    {
+                        selected.clear();
+                        for (uint32_t user : groups[(next + g) % BENCH_GROUPS])
+                        {
+                            selected.push_back(bitmaps.row(rows[user]));
+                        }
+                        andBitmaps(selected.data(), selected.size(), bitmaps.words, common.data());
+                        bitmapToIntervals(common.data(), bitmaps.words, out);
+                        keep(out);
+                    }
+                    next++;
+                });
+            }
+        }
+    }
+}
+
+// A random earliest-slot filter for the checks, with any of its options left out, and windows that reach past [0, domain)
+SlotFilter randomFilter(mt19937_64 &rng, int domain)
+{
+    SlotFilter filter;
+    uniform_int_distribution<int> coin(0, 1);
+    uniform_int_distribution<int> time(-domain / 20, domain + domain / 20);
+    if (coin(rng))
+    {
+        filter.minDuration = uniform_int_distribution<int>(1, domain / 20)(rng);
+    }
+    if (coin(rng))
+    {
+        filter.from = time(rng);
+    }
+    if (coin(rng))
+    {
+        filter.horizon = time(rng);
+    }
+    if (coin(rng))
+    {
+        filter.limit = uniform_int_distribution<uint32_t>(1, 4)(rng);
+    }
+    return filter;
+}
+
+// A random group of up to max_size members from users, some of which may have no intervals at all
+vector<uint32_t> randomGroup(mt19937_64 &rng, size_t users, size_t max_size)
+{
+    vector<uint32_t> group(uniform_int_distribution<size_t>(1, max_size)(rng));
+    for (uint32_t &member : group)
+    {
+        member = uniform_int_distribution<uint32_t>(0, users - 1)(rng);
+    }
+    return group;
+}
+
+// Users for the checks over [0, domain): from no interval at all to a few dozen, covering anything from little to most of it
+vector<vector<pair<int, int>>> makeCheckUsers(mt19937_64 &rng, int domain)
+{
+    vector<vector<pair<int, int>>> users(64);
+    for (auto &user : users)
+    {
+        size_t count = uniform_int_distribution<size_t>(0, 40)(rng);
+        randomAvailability(rng, domain, count, uniform_real_distribution<double>(0.05, 0.95)(rng), user);
+    }
+    return users;
+}
+
+// The intersection of two lists as the servers computed it before the k-way sweep, the reference of checkIntersect
+vector<pair<int, int>> pairwiseIntersection(const vector<pair<int, int>> &intervals1, const vector<pair<int, int>> &intervals2)
+{
+    vector<pair<int, int>> common;
+    size_t i = 0, j = 0;
+    while (i < intervals1.size() && j < intervals2.size())
+    {
+        if (intervals1[i].second < intervals2[j].first)
+        {
+            i++;
+        }
+        else if (intervals2[j].second < intervals1[i].first)
+        {
+            j++;
+        }
+        else
+        {
+            int start = max(intervals1[i].first, intervals2[j].first);
+            int end = min(intervals1[i].second, intervals2[j].second);
+            if (start < end)
+            {
+                common.emplace_back(start, end);
+            }
+            if (intervals1[i].second < intervals2[j].second)
+            {
+                i++;
+            }
+            else
+            {
+                j++;
+            }
+        }
+    }
+    return common;
+}
+
+/*
+The k-way sweep has to find what folding the group two lists at a time finds, then cutting the slots to the filter. The
+users live in a domain of 60, so the intervals of different users often touch at an endpoint, and groups of up to 20 reach
+the positions kept in scratch rather than on the stack.
+*/
+void checkIntersect()
+{
+    mt19937_64 rng(8);
+    vector<vector<pair<int, int>>> users = makeCheckUsers(rng, 60);
+    vector<IntervalSpan> spans;
+    vector<size_t> scratch;
+    vector<pair<int, int>> expected, out;
+    for (bool filtered : {false, true})
+    {
+        runCheck(string("intersect/check sweep=pairwise") + (filtered ? " filter" : ""), CHECK_CASES, [&](size_t) {
+            vector<uint32_t> group = randomGroup(rng, users.size(), 20);
+            SlotFilter filter = filtered ? randomFilter(rng, 60) : SlotFilter();
+            vector<pair<int, int>> folded = users[group[0]];
+            spans.clear();
+            for (size_t i = 0; i < group.size(); i++)
+            {
+                if (i > 0)
+                {
+                    folded = pairwiseIntersection(folded, users[group[i]]);
+                }
+                spans.push_back(spanOf(users[group[i]]));
+            }
+            expected.clear();
+            for (pair<int, int> slot : folded)
+            {
+                if (filter.limit > 0 && expected.size() == filter.limit)
+                {
+                    break;
+                }
+                int start = max(slot.first, filter.from);
+                int end = min(slot.second, filter.horizon);
+                if (start < end && end - start >= filter.minDuration)
+                {
+                    expected.emplace_back(start, end);
+                }
+            }
+            intersectIntervals(spans.data(), spans.size(), out, &scratch, filter);
+            return out == expected;
+        });
+    }
+}
+
+/*
+The bitmap path has to find exactly the slots the sweep finds, with and without a filter. The window of the filter is
+applied as the backend servers apply it (query.h): only the blocks of words from the one holding filter.from up to the one
+holding filter.horizon are ANDed and scanned. The AVX2 AND is also checked against the scalar one.
+*/
+void checkBitmap()
+{
+    mt19937_64 rng(7);
+    vector<vector<pair<int, int>>> users = makeCheckUsers(rng, CHECK_DOMAIN);
+    BitmapSet bitmaps;
+    bitmaps.init(CHECK_DOMAIN);
+    vector<uint32_t> rows;
+    for (const auto &user : users)
+    {
+        rows.push_back(bitmaps.add(spanOf(user)));
+    }
+
+    vector<IntervalSpan> spans;
+    vector<const uint64_t *> selected;
+    vector<uint64_t> common(bitmaps.words), scalar(bitmaps.words);
+    vector<pair<int, int>> expected, out;
+    for (bool filtered : {false, true})
+    {
+        runCheck(string("intersect/check bitmap=sweep") + (filtered ? " filter" : ""), CHECK_CASES, [&](size_t) {
+            vector<uint32_t> group = randomGroup(rng, users.size(), 6);
+            SlotFilter filter = filtered ? randomFilter(rng, CHECK_DOMAIN) : SlotFilter();
+            const size_t block_bits = 64 * BITMAP_BLOCK_WORDS;
+            size_t words = bitmaps.words;
+            size_t first = 0;
+            if (filter.horizon != INT_MAX)
+            {
+                words = min(words, filter.horizon <= 0 ? 0 : ((size_t)filter.horizon + block_bits - 1) / block_bits * BITMAP_BLOCK_WORDS);
+            }
+            if (filter.from > 0)
+            {
+                first = min(words, (size_t)filter.from / block_bits * BITMAP_BLOCK_WORDS);
+            }
+
+            spans.clear();
+            selected.clear();
+            for (uint32_t user : group)
+            {
+                spans.push_back(spanOf(users[user]));
+                selected.push_back(bitmaps.row(rows[user]) + first);
+            }
+            intersectIntervals(spans.data(), spans.size(), expected, nullptr, filter);
+            andBitmaps(selected.data(), selected.size(), words - first, common.data() + first);
+            andBitmapsScalar(selected.data(), selected.size(), words - first, scalar.data() + first);
+            bitmapToIntervals(common.data(), words, out, filter, first);
+            return out == expected && equal(common.begin() + first, common.begin() + words, scalar.begin() + first);
+        });
+    }
+}
+
+void benchCodec()
+{
+    mt19937_64 rng(2);
+    for (size_t n : {10, 100, 1000})
+    {
+        vector<pair<int, int>> intervals;
+        randomAvailability(rng, BENCH_DOMAIN * 10, n, 0.5, intervals);
+        string suffix = "/n=" + to_string(n);
+
+        vector<char> binary(encodedIntervalsSize(n));
+        runBenchmark("codec/encode" + suffix, 1, [&]() { keep(encodeIntervals(intervals, binary.data())); });
+        vector<pair<int, int>> decoded;
+        runBenchmark("codec/decode" + suffix, 1, [&]() {
+            decodeIntervals(binary.data(), binary.size(), decoded);
+            keep(decoded);
+        });
+        runBenchmark("codec/formatIntervals" + suffix, 1, [&]() { keep(formatIntervals(intervals)); });
+        string text = formatIntervals(intervals);
+        runBenchmark("codec/ParseIntervals" + suffix, 1, [&]() { keep(ParseIntervals(text.data(), text.size())); });
+    }
+}
+
+// Writes users lines of n intervals each in the data file format
+string makeDataFile(mt19937_64 &rng, size_t users, size_t n)
+{
+    string text;
+    vector<pair<int, int>> availability;
+    for (size_t i = 0; i < users; i++)
+    {
+        randomAvailability(rng, BENCH_DOMAIN, n, 0.5, availability);
+        text += "user" + to_string(i) + ";[";
+        for (size_t j = 0; j < availability.size(); j++)
+        {
+            text += (j == 0 ? "[" : ",[") + to_string(availability[j].first) + "," + to_string(availability[j].second) + "]";
+        }
+        text += "]\n";
+    }
+    return text;
+}
+
+void benchLoad()
+{
+    mt19937_64 rng(3);
+    for (size_t n : {1, 10, 100})
+    {
+        size_t users = 1000000 / n;
+        string text = makeDataFile(rng, users, n);
+        string suffix = "/users=" + to_string(users) + "/n=" + to_string(n);
+
+        runBenchmark("load/parsePiece" + suffix + " (per user)", users, [&]() {
+            ParsedPiece piece;
+            piece.begin = text.data();
+            piece.end = text.data() + text.size();
+            parsePiece(piece);
+            keep(piece.users);
+        });
+
+        char path[] = "/tmp/bench_dataXXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0 || !writeAll(fd, text.data(), text.size()) || close(fd) != 0)
+        {
+            perror("Error writing the benchmark data file");
+            exit(1);
+        }
+        runBenchmark("load/loadUserTable" + suffix + " (per user)", users, [&]() {
+            UserTable table;
+            loadUserTable(path, table);
+            keep(table.users);
+        });
+
+        struct stat source;
+        stat(path, &source);
+        string snapshot = string(path) + ".snap";
+        UserTable loaded;
+        loadUserTable(path, loaded);
+        writeSnapshot(loaded, snapshot, source);
+        string reason;
+        runBenchmark("load/openSnapshot" + suffix, 1, [&]() {
+            UserTable table;
+            keep(openSnapshot(snapshot, source, table, false, reason));
+        });
+        runBenchmark("load/openSnapshot -V" + suffix, 1, [&]() {
+            UserTable table;
+            keep(openSnapshot(snapshot, source, table, true, reason));
+        });
+
+        // The snapshot has to give back every user of the table it was written from
+        UserTable opened;
+        bool open_ok = openSnapshot(snapshot, source, opened, true, reason);
+        runCheck("load/check snapshot=table" + suffix, users, [&](size_t user) {
+            IntervalSpan expected = loaded.availability(user);
+            IntervalSpan got = opened.availability(user);
+            string_view name = loaded.name(user);
+            return open_ok && opened.size() == loaded.size() && opened.name(user) == name &&
+                   opened.find(name.data(), name.size()) == user && got.size == expected.size &&
+                   equal(got.data, got.data + got.size, expected.data);
+        });
+
+        // A slice that points past the intervals, in a snapshot whose header and sizes are still right, is refused even
+        // without -V
+        runCheck("load/check damaged snapshot refused" + suffix, 1, [&](size_t) {
+            SnapshotHeader header;
+            SnapshotSection sections[SECTION_COUNT];
+            UserSlice damaged = {0, 1, 0};
+            int snapshot_fd = open(snapshot.c_str(), O_RDWR);
+            bool damaged_ok = snapshot_fd >= 0 && pread(snapshot_fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) &&
+                              pread(snapshot_fd, sections, sizeof(sections), sizeof(header)) == (ssize_t)sizeof(sections);
+            damaged.first = header.intervals;
+            damaged_ok = damaged_ok && pwrite(snapshot_fd, &damaged, sizeof(damaged), sections[SECTION_SLICES].offset) == (ssize_t)sizeof(damaged);
+            if (snapshot_fd >= 0)
+            {
+                close(snapshot_fd);
+            }
+            UserTable table;
+            return damaged_ok && !openSnapshot(snapshot, source, table, false, reason);
+        });
+        unlink(snapshot.c_str());
+        unlink(path);
+    }
+}
+
+void benchDirectory()
+{
+    for (size_t users : {1000, 1000000})
+    {
+        NameDirectory directory;
+        vector<string> names;
+        for (size_t i = 0; i < users; i++)
+        {
+            names.push_back("user" + to_string(i));
+            directory.insert(names.back().data(), names.back().size(), i % 2);
+        }
+        vector<string> missing;
+        for (size_t i = 0; i < 1024; i++)
+        {
+            missing.push_back("nobody" + to_string(i));
+        }
+        string suffix = "/users=" + to_string(users);
+        mt19937_64 rng(4);
+        vector<uint32_t> order(4096);
+        for (uint32_t &i : order)
+        {
+            i = uniform_int_distribution<uint32_t>(0, users - 1)(rng);
+        }
+        runBenchmark("directory/find hit" + suffix, order.size(), [&]() {
+            for (uint32_t i : order)
+            {
+                keep(directory.find(names[i].data(), names[i].size()));
+            }
+        });
+        runBenchmark("directory/find miss" + suffix, missing.size(), [&]() {
+            for (const string &name : missing)
+            {
+                keep(directory.find(name.data(), name.size()));
+            }
+        });
+    }
+}
+
+// The backend query path for groups of k users, each query also naming one user that does not exist
+void benchQuery()
+{
+    mt19937_64 rng(5);
+    for (size_t n : {10, 200})
+    {
+        // 200 intervals per user make the bitmaps cheaper than the sweep, 10 do not
+        size_t users = 20000;
+        string text = makeDataFile(rng, users, n);
+        char path[] = "/tmp/bench_queryXXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0 || !writeAll(fd, text.data(), text.size()) || close(fd) != 0)
+        {
+            perror("Error writing the benchmark data file");
+            exit(1);
+        }
+        ShardData data;
+        loadUserTable(path, data.database);
+        unlink(path);
+        buildBitmaps(data, BENCH_DOMAIN);
+
+        for (size_t k : {1, 2, 5, 20})
+        {
+            // The same queries in every form Main Server sends them: asking for binary or text results, for the first slot of
+            // at least 30 minutes and for the slots of one day of the week
+            struct Variant
+            {
+                string name;
+                uint16_t flags;
+                SlotFilter filter;
+            };
+            vector<Variant> variants = {{"binary", FLAG_BINARY_INTERVALS, SlotFilter()}, {"text", 0, SlotFilter()},
+                                        {"first slot", FLAG_BINARY_INTERVALS | FLAG_SLOT_FILTER, SlotFilter()},
+                                        {"one day", FLAG_BINARY_INTERVALS | FLAG_SLOT_FILTER, SlotFilter()}};
+            variants[2].filter.minDuration = 30;
+            variants[2].filter.limit = 1;
+            variants[3].filter.from = 3 * BENCH_DOMAIN / 7;
+            variants[3].filter.horizon = 4 * BENCH_DOMAIN / 7;
+            vector<string> groups(BENCH_GROUPS);
+            for (size_t g = 0; g < BENCH_GROUPS; g++)
+            {
+                groups[g] = "nobody ";
+                for (size_t i = 0; i < k; i++)
+                {
+                    groups[g] += "user" + to_string(uniform_int_distribution<size_t>(0, users - 1)(rng)) + " ";
+                }
+            }
+            string suffix = "/k=" + to_string(k) + "/n=" + to_string(n);
+
+            QueryArena arena;
+            vector<char> reply(MAX_DATAGRAM_SIZE);
+            for (const Variant &variant : variants)
+            {
+                vector<vector<char>> queries(BENCH_GROUPS);
+                vector<MessageHeader> headers(BENCH_GROUPS);
+                for (size_t g = 0; g < BENCH_GROUPS; g++)
+                {
+                    string payload;
+                    if (variant.flags & FLAG_SLOT_FILTER)
+                    {
+                        payload.resize(SLOT_FILTER_SIZE);
+                        encodeSlotFilter(variant.filter, &payload[0]);
+                    }
+                    payload += groups[g];
+                    queries[g].resize(HEADER_SIZE + payload.size());
+                    packMessage(queries[g].data(), g, OP_QUERY, variant.flags, payload.data(), payload.size());
+                    unpackHeader(queries[g].data(), queries[g].size(), headers[g]);
+                }
+                string name = "query/answer " + variant.name + suffix;
+                size_t next = 0;
+                double allocs = runBenchmark(name, BENCH_GROUPS, [&]() {
+                    for (size_t g = 0; g < BENCH_GROUPS; g++)
+                    {
+                        size_t q = (next + g) % BENCH_GROUPS;
+                        keep(answerQuery(data, headers[q], queries[q].data() + HEADER_SIZE, arena, reply.data()));
+                    }
+                    next++;
+                });
+                if (allocs > 0)
+                {
+                    fprintf(stderr, "FAIL: %s allocates on the heap\n", name.c_str());
+                    failures++;
+                }
+            }
+
+            // All of the groups as the subgroups of one batch query, timed per group
+            string batch;
+            for (const string &group : groups)
+            {
+                batch += group + BATCH_SEPARATOR;
+            }
+            vector<char> batch_query(HEADER_SIZE + batch.size());
+            MessageHeader batch_header;
+            packMessage(batch_query.data(), 0, OP_BATCH_QUERY, FLAG_BINARY_INTERVALS, batch.data(), batch.size());
+            unpackHeader(batch_query.data(), batch_query.size(), batch_header);
+            string name = "query/batch" + suffix;
+            double allocs = runBenchmark(name, BENCH_GROUPS, [&]() {
+                size_t oversized;
+                keep(answerBatch(data, batch_header, batch_query.data() + HEADER_SIZE, arena, reply.data(),
+                                 [&](size_t size) { keep(size); return reply.data(); }, oversized));
+            });
+            if (allocs > 0)
+            {
+                fprintf(stderr, "FAIL: %s allocates on the heap\n", name.c_str());
+                failures++;
+            }
+        }
+    }
+}
+
+// Reverse queries over a shard of users with n intervals each, for windows of a minute, an hour and a day
+void benchFree()
+{
+    mt19937_64 rng(6);
+    for (size_t n : {10, 200})
+    {
+        size_t users = 2000000 / n;
+        string text = makeDataFile(rng, users, n);
+        char path[] = "/tmp/bench_freeXXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0 || !writeAll(fd, text.data(), text.size()) || close(fd) != 0)
+        {
+            perror("Error writing the benchmark data file");
+            exit(1);
+        }
+        ShardData data;
+        loadUserTable(path, data.database);
+        unlink(path);
+        string suffix = "/users=" + to_string(users) + "/n=" + to_string(n);
+        runBenchmark("free/build" + suffix, 1, [&]() {
+            FreeIndex index;
+            index.build(data.database);
+            keep(index.nodes);
+        });
+        data.freeIndex.build(data.database);
+
+        for (int length : {1, 60, 1440})
+        {
+            vector<int> starts(BENCH_GROUPS);
+            for (int &start : starts)
+            {
+                start = uniform_int_distribution<int>(0, BENCH_DOMAIN - length)(rng);
+            }
+            string window = "/window=" + to_string(length) + suffix;
+            vector<uint32_t> found;
+            size_t next = 0;
+
+            // The index has to find exactly the users a scan of every user finds
+            vector<uint32_t> expected;
+            runCheck("free/check index=scan" + window, BENCH_GROUPS, [&](size_t g) {
+                int start = starts[g];
+                expected.clear();
+                for (uint32_t user = 0; user < data.database.size(); user++)
+                {
+                    if (coversWindow(data.database.availability(user), start, start + length))
+                    {
+                        expected.push_back(user);
+                    }
+                }
+                found.clear();
+                data.freeIndex.findFree(start, start + length, found);
+                sort(found.begin(), found.end());
+                return found == expected;
+            });
+            runBenchmark("free/scan" + window, 1, [&]() {
+                int start = starts[next++ % BENCH_GROUPS];
+                found.clear();
+                for (uint32_t user = 0; user < data.database.size(); user++)
+                {
+                    if (coversWindow(data.database.availability(user), start, start + length))
+                    {
+                        found.push_back(user);
+                    }
+                }
+                keep(found);
+            });
+            runBenchmark("free/index" + window, 1, [&]() {
+                int start = starts[next++ % BENCH_GROUPS];
+                found.clear();
+                data.freeIndex.findFree(start, start + length, found);
+                keep(found);
+            });
+
+            // The whole reverse query, from the datagram to the chunks of usernames; with a limit, the lowest names are kept
+            for (uint32_t limit : {0, 10})
+            {
+                vector<vector<char>> queries(BENCH_GROUPS);
+                vector<MessageHeader> headers(BENCH_GROUPS);
+                for (size_t g = 0; g < BENCH_GROUPS; g++)
+                {
+                    char encoded[FREE_WINDOW_SIZE];
+                    FreeWindow free_window;
+                    free_window.start = starts[g];
+                    free_window.end = starts[g] + length;
+                    free_window.limit = limit;
+                    encodeFreeWindow(free_window, encoded);
+                    queries[g].resize(HEADER_SIZE + FREE_WINDOW_SIZE);
+                    packMessage(queries[g].data(), g, OP_FREE_QUERY, 0, encoded, FREE_WINDOW_SIZE);
+                    unpackHeader(queries[g].data(), queries[g].size(), headers[g]);
+                }
+                QueryArena arena;
+                vector<char> reply(MAX_DATAGRAM_SIZE);
+                string name = "free/answer" + string(limit > 0 ? " limit=10" : "") + window;
+                double allocs = runBenchmark(name, 1, [&]() {
+                    size_t q = next++ % BENCH_GROUPS;
+                    keep(answerFree(data, headers[q], queries[q].data() + HEADER_SIZE, arena, reply.data(),
+                                    [&](size_t size) { keep(size); return reply.data(); }));
+                });
+                if (allocs > 0)
+                {
+                    fprintf(stderr, "FAIL: %s allocates on the heap\n", name.c_str());
+                    failures++;
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+    {
+        filter = argv[1];
+    }
+    benchIntersect();
+    checkIntersect();
+    checkBitmap();
+    benchCodec();
+    benchLoad();
+    benchDirectory();
+    benchQuery();
+    benchFree();
+    return failures > 0 ? 1 : 0;
+}
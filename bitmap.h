@@ -0,0 +1,216 @@
+/*
+Author: Rajnandini Thopte
+
+bitmap.h
+
+Dense bitmap form of a user's availability over a bounded time domain [0, domain). Bit t stands for the unit of time
+[t, t + 1), so the common availability of a group is the bitwise AND of its members' bitmaps, and the runs of set bits in
+the result are the common intervals. The AND uses AVX2 when the CPU has it and plain 64-bit words otherwise.
+
+A bitmap merges intervals that touch and drops empty ones, so it is only built for a user whose list is sorted with a gap
+between consecutive intervals and has no empty intervals. For such lists the runs of the AND are exactly the intervals
+the sweep in intervals.h finds, and the backend can pick whichever is cheaper per query.
+*/
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "intervals.h"
+
+#define NO_BITMAP 0xFFFFFFFFu
+#define BITMAP_BLOCK_WORDS 4       // one 256-bit AVX2 register; every bitmap is padded to whole blocks
+#define SWEEP_COST_PER_INTERVAL 20 // cost of one interval in the sweep, in bitmap words ANDed (measured with AVX2)
+
+// True if the intervals can be represented as a bitmap over [0, domain) without changing any query result
+inline bool fitsBitmap(const IntervalSpan &intervals, int domain)
+{
+    int previous_end = -1;
+    for (size_t i = 0; i < intervals.size; i++)
+    {
+        const std::pair<int, int> &interval = intervals.data[i];
+        if (interval.first <= previous_end || interval.first >= interval.second || interval.second > domain)
+        {
+            return false;
+        }
+        previous_end = interval.second;
+    }
+    return true;
+}
+
+// The bitmaps of all users stored back to back in one buffer
+struct BitmapSet
+{
+    int domain = 0;
+    size_t words = 0; // 64-bit words per bitmap, a multiple of BITMAP_BLOCK_WORDS
+    std::vector<uint64_t> bits;
+
+    void init(int domain_end)
+    {
+        domain = domain_end;
+        size_t blocks = ((size_t)domain + 64 * BITMAP_BLOCK_WORDS - 1) / (64 * BITMAP_BLOCK_WORDS);
+        words = blocks * BITMAP_BLOCK_WORDS;
+        bits.clear();
+    }
+
+    // Adds the bitmap of one user. Returns its index, or NO_BITMAP if the intervals do not fit.
+    uint32_t add(const IntervalSpan &intervals)
+    {
+        if (domain <= 0 || !fitsBitmap(intervals, domain))
+        {
+            return NO_BITMAP;
+        }
+        size_t index = bits.size() / words;
+        bits.resize(bits.size() + words, 0);
+        uint64_t *row = &bits[index * words];
+        for (size_t i = 0; i < intervals.size; i++)
+        {
+            setRange(row, intervals.data[i].first, intervals.data[i].second);
+        }
+        return (uint32_t)index;
+    }
+
+    const uint64_t *row(uint32_t index) const
+    {
+        return &bits[index * words];
+    }
+
+private:
+    // Sets bits [from, to)
+    static void setRange(uint64_t *row, size_t from, size_t to)
+    {
+        size_t first = from / 64;
+        size_t last = (to - 1) / 64;
+        uint64_t head = ~0ull << (from % 64);
+        uint64_t tail = ~0ull >> (63 - (to - 1) % 64);
+        if (first == last)
+        {
+            row[first] |= head & tail;
+            return;
+        }
+        row[first] |= head;
+        for (size_t i = first + 1; i < last; i++)
+        {
+            row[i] = ~0ull;
+        }
+        row[last] |= tail;
+    }
+};
+
+// out = rows[0] & rows[1] & ... & rows[k - 1], one block at a time so each row is read once and out written once
+inline void andBitmapsScalar(const uint64_t *const *rows, size_t k, size_t words, uint64_t *out)
+{
+    for (size_t i = 0; i < words; i += BITMAP_BLOCK_WORDS)
+    {
+        uint64_t acc[BITMAP_BLOCK_WORDS];
+        for (size_t w = 0; w < BITMAP_BLOCK_WORDS; w++)
+        {
+            acc[w] = rows[0][i + w];
+        }
+        for (size_t j = 1; j < k; j++)
+        {
+            for (size_t w = 0; w < BITMAP_BLOCK_WORDS; w++)
+            {
+                acc[w] &= rows[j][i + w];
+            }
+        }
+        for (size_t w = 0; w < BITMAP_BLOCK_WORDS; w++)
+        {
+            out[i + w] = acc[w];
+        }
+    }
+}
+
+__attribute__((target("avx2"))) inline void andBitmapsAVX2(const uint64_t *const *rows, size_t k, size_t words, uint64_t *out)
+{
+    for (size_t i = 0; i < words; i += BITMAP_BLOCK_WORDS)
+    {
+        __m256i acc = _mm256_loadu_si256((const __m256i *)(rows[0] + i));
+        for (size_t j = 1; j < k; j++)
+        {
+            acc = _mm256_and_si256(acc, _mm256_loadu_si256((const __m256i *)(rows[j] + i)));
+        }
+        _mm256_storeu_si256((__m256i *)(out + i), acc);
+    }
+}
+
+inline void andBitmaps(const uint64_t *const *rows, size_t k, size_t words, uint64_t *out)
+{
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    if (has_avx2)
+    {
+        andBitmapsAVX2(rows, k, words, out);
+    }
+    else
+    {
+        andBitmapsScalar(rows, k, words, out);
+    }
+}
+
+/*
+Turns the runs of set bits into [start, end] intervals, written into out after clearing it. Works a word at a time:
+the bits still to look at are flipped whenever a run starts or ends, so every run boundary is one count-trailing-zeros,
+and a block of words that holds no boundary is skipped with one test. Like the sweep, it only writes the slots filter lets
+through and stops at its horizon or once it has found filter.limit of them. The scan starts at word first, a multiple of
+BITMAP_BLOCK_WORDS, so the words before the window of filter need not even be computed.
+*/
+inline void bitmapToIntervals(const uint64_t *bits, size_t words, std::vector<std::pair<int, int>> &out, const SlotFilter &filter = SlotFilter(),
+                              size_t first = 0)
+{
+    out.clear();
+    bool in_run = false;
+    size_t start = 0;
+    for (size_t i = first; i < words; i += BITMAP_BLOCK_WORDS)
+    {
+        // All zero outside a run or all one inside one: nothing starts or ends in this block
+        uint64_t skip = in_run ? ~0ull : 0;
+        if (bits[i] == skip && bits[i + 1] == skip && bits[i + 2] == skip && bits[i + 3] == skip)
+        {
+            continue;
+        }
+        for (size_t j = i; j < i + BITMAP_BLOCK_WORDS; j++)
+        {
+            uint64_t pending = in_run ? ~bits[j] : bits[j];
+            while (pending != 0)
+            {
+                int bit = __builtin_ctzll(pending);
+                size_t position = j * 64 + bit;
+                if (in_run)
+                {
+                    if (!addSlot(out, (int)start, (int)position, filter))
+                    {
+                        return;
+                    }
+                }
+                else if (position >= (size_t)std::max(filter.horizon, 0))
+                {
+                    return;
+                }
+                else
+                {
+                    start = position;
+                }
+                in_run = !in_run;
+                pending = ~pending & (~0ull << bit);
+            }
+        }
+    }
+    if (in_run)
+    {
+        addSlot(out, (int)start, (int)(words * 64), filter);
+    }
+}
+
+// Cost model: the AND reads k bitmaps and the scan reads one more, the sweep steps through the intervals of every list
+inline bool preferBitmap(size_t k, size_t words, size_t total_intervals)
+{
+    return (k + 1) * words < SWEEP_COST_PER_INTERVAL * total_intervals;
+}
+
+#endif
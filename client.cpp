@@ -30,15 +30,156 @@ are not present in database to console.
 #include <unistd.h>
 #include <algorithm>
 
+#include "protocol.h"
+
 #define LOCALHOST "127.0.0.1"
 #define SERVER_PORT 24463
 #define MAX_USERNAME_LENGTH 20
-#define MAXBUFFERSIZE 10000
 #define FAIL -1
 #define _OE_SOCKETS
 
 using namespace std;
 
+// Reads the sections of the reply to one group of usernames at p and prints them: the time intervals, the usernames that do
+// not exist, the usernames found, the usernames whose backend server did not answer and the usernames whose result was too
+// large to send. Returns false if the reply is malformed.
+bool printReply(const char *&p, const char *end, unsigned int portNum)
+{
+    std::string data_received, missing_names_db, final_names, unanswered_names, too_large_names;
+    if (!readSection(p, end, data_received) || !readSection(p, end, missing_names_db) || !readSection(p, end, final_names) ||
+        !readSection(p, end, unanswered_names) || !readSection(p, end, too_large_names))
+    {
+        return false;
+    }
+
+    //To print users not present in database
+    if (!missing_names_db.empty())
+    {
+        std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl << missing_names_db << " do not exist." << endl;
+    }
+
+    //To print users whose backend server did not answer in time; the time intervals below leave them out
+    if (!unanswered_names.empty())
+    {
+        std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl << unanswered_names << " could not be checked, their server did not answer." << endl;
+    }
+
+    //To print users whose intersection result was too large to be sent; the group gets no time intervals then
+    if (!too_large_names.empty())
+    {
+        std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl << "The intersection result of " << too_large_names << " is too large to send, the time intervals could not be found." << endl;
+        return true;
+    }
+
+    // Format and print the time intervals for the users present
+    if (!final_names.empty())
+    {
+        std::cout << "Client received the reply from Main Server using TCP over port " << portNum <<": " << endl << "Time intervals " << data_received << "works for " << final_names << "." << std::endl;
+    }
+    return true;
+}
+
+/*
+Sends a free request, ":free from=<start> to=<end>" or ":free at=<time>" with an optional "limit=<count>" and candidate
+usernames, and prints which users are free for the whole window; without candidates every user is checked. Returns false if
+the request could not be sent or the reply is malformed.
+*/
+bool askFree(int client_fd, const std::string &input, unsigned int portNum)
+{
+    FreeWindow window;
+    bool has_start = false, has_end = false;
+    std::string candidates;
+    std::istringstream words(input.substr(5));
+    std::string word;
+    while (words >> word)
+    {
+        if (word.compare(0, 5, "from=") == 0)
+        {
+            window.start = atoi(word.c_str() + 5);
+            has_start = true;
+        }
+        else if (word.compare(0, 3, "to=") == 0)
+        {
+            window.end = atoi(word.c_str() + 3);
+            has_end = true;
+        }
+        else if (word.compare(0, 3, "at=") == 0)
+        {
+            window.start = atoi(word.c_str() + 3);
+            window.end = window.start + 1;
+            has_start = has_end = true;
+        }
+        else if (word.compare(0, 6, "limit=") == 0)
+        {
+            window.limit = strtoul(word.c_str() + 6, NULL, 10);
+        }
+        else
+        {
+            candidates += (candidates.empty() ? "" : " ") + word;
+        }
+    }
+    if (!has_start || !has_end || window.start >= window.end)
+    {
+        std::cout << "Usage: :free from=<start> to=<end> | at=<time> [limit=<count>] [usernames]" << std::endl;
+        return true;
+    }
+
+    std::string request(FRAME_HEADER_SIZE + FREE_WINDOW_SIZE, '\0');
+    packFrameHeader(&request[0], OP_FREE_REQUEST, FREE_WINDOW_SIZE + candidates.size());
+    encodeFreeWindow(window, &request[FRAME_HEADER_SIZE]);
+    request += candidates;
+    if (send(client_fd, request.data(), request.size(), 0) == -1)
+    {
+        std::cerr << "Error sending data to server" << std::endl;
+        return false;
+    }
+    std::cout << "Client finished sending the free request to Main Server." << std::endl;
+
+    char reply_header[FRAME_HEADER_SIZE];
+    FrameHeader header;
+    if (recv(client_fd, reply_header, FRAME_HEADER_SIZE, MSG_WAITALL) != (ssize_t)FRAME_HEADER_SIZE || !unpackFrameHeader(reply_header, header) ||
+        header.opcode != OP_FREE_REPLY)
+    {
+        return false;
+    }
+    std::vector<char> payload(header.length);
+    if (header.length > 0 && recv(client_fd, payload.data(), header.length, MSG_WAITALL) != (ssize_t)header.length)
+    {
+        return false;
+    }
+
+    // The reply holds the users free, the candidates that do not exist, the servers that did not answer and the number of users free
+    std::string free_names, missing_names, unanswered_servers, found;
+    const char *p = payload.data();
+    const char *end = p + payload.size();
+    if (!readSection(p, end, free_names) || !readSection(p, end, missing_names) || !readSection(p, end, unanswered_servers) ||
+        !readSection(p, end, found))
+    {
+        return false;
+    }
+    if (!missing_names.empty())
+    {
+        std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl << missing_names << " do not exist." << endl;
+    }
+    if (!unanswered_servers.empty())
+    {
+        std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl << "Server " << unanswered_servers
+                  << " did not answer, the users there could not be checked." << endl;
+    }
+    // A count that reached the limit is not the total, only the users lowest in name order were kept
+    std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl;
+    if (window.limit > 0 && strtoul(found.c_str(), NULL, 10) == window.limit)
+    {
+        std::cout << "The first " << found << " users in name order that are free for [";
+    }
+    else
+    {
+        std::cout << found << " users are free for [";
+    }
+    std::cout << window.start << ", " << window.end << ")" << (free_names.empty() ? "." : ": " + free_names + ".") << std::endl;
+    return true;
+}
+
 int main()
 {
     // Repurposed from Beej’s socket programming tutorial
@@ -95,131 +236,154 @@ int main()
         char prompt[] = "Please enter the usernames to check schedule availability: ";
         std::cout << prompt << std::flush;
 
-        // Get input from user
-        char input[MAX_USERNAME_LENGTH * 10]; // Max 10 usernames, each with a length of MAX_USERNAME_LENGTH
-        std::cin.getline(input, sizeof input);
+        // Get input from user; a batch of groups can be longer than the 10 usernames of one group
+        std::string input;
+        if (!std::getline(std::cin, input))
+        {
+            break; // no more input
+        }
 
 
         //std::cout << "DEBUG:: about to send data " << endl;
 
-        // Send user input to main server
-        if (send(client_fd, input, strlen(input), 0) == -1)
+        // ":stats" asks Main Server for its counters and phase latencies instead of scheduling a meeting
+        if (input == ":stats")
         {
-            std::cerr << "Error sending data to server" << std::endl;
-            return 1;
+            char stats_request[FRAME_HEADER_SIZE];
+            packFrameHeader(stats_request, OP_STATS_REQUEST, 0);
+            if (send(client_fd, stats_request, FRAME_HEADER_SIZE, 0) == -1)
+            {
+                std::cerr << "Error sending data to server" << std::endl;
+                return 1;
+            }
+            char stats_header[FRAME_HEADER_SIZE];
+            FrameHeader header;
+            if (recv(client_fd, stats_header, FRAME_HEADER_SIZE, MSG_WAITALL) != (ssize_t)FRAME_HEADER_SIZE ||
+                !unpackFrameHeader(stats_header, header) || header.opcode != OP_STATS_REPLY)
+            {
+                std::cerr << "Error: malformed reply from Main Server" << std::endl;
+                exit(1);
+            }
+            std::vector<char> payload(header.length);
+            std::string report;
+            const char *p = payload.data();
+            if ((header.length > 0 && recv(client_fd, payload.data(), header.length, MSG_WAITALL) != (ssize_t)header.length) ||
+                !readSection(p, p + payload.size(), report))
+            {
+                std::cerr << "Error: malformed reply from Main Server" << std::endl;
+                exit(1);
+            }
+            std::cout << "Client received the stats from Main Server using TCP over port " << portNum << ":" << endl << report << std::flush;
+            std::cout << "-----Start a new request-----" << std::endl;
+            continue;
         }
-        std::cout << "Client finished sending the usernames to Main Server." << std::endl;
 
-        //Receive names not in database from server M
-        char not_in_database[MAXBUFFERSIZE];
-        std::memset(not_in_database, 0, sizeof(not_in_database));
-
-        //To print user not present in database
-        if (std::string(not_in_database) != "" && std::string(not_in_database) != "user exists")
+        // ":free" asks which users are free for a window instead of when a group is
+        if (input.compare(0, 5, ":free") == 0)
         {
-            std::cout << "Client received the reply from Main Server using TCP over port "
-                      << portNum << std::endl;
-            std::cout << not_in_database << " usernames do not exist." << std::endl;
+            if (!askFree(client_fd, input, portNum))
+            {
+                std::cerr << "Error: malformed reply from Main Server" << std::endl;
+                exit(1);
+            }
+            std::cout << "-----Start a new request-----" << std::endl;
+            continue;
         }
 
-        else
+        // "min=<duration>", "from=<time>", "to=<time>" and "limit=<count>" among the usernames ask for the earliest slots of at
+        // least that duration within the window [from, to), and at most that many of them, rather than every common slot.
+        // Groups separated by ';' go out as one batch request, answered with a reply for every group.
+        SlotFilter filter;
+        std::string usernames;
+        bool batch = input.find(BATCH_SEPARATOR) != std::string::npos;
+        std::string spaced;
+        for (char c : input)
         {
-
-            char buffer_interval[MAXBUFFERSIZE];
-            std::memset(buffer_interval, 0, sizeof(buffer_interval));
-
-            // Receive up to the newline character to get buffer_interval
-            int bytes_received = 0;
-            char *p = buffer_interval;
-
-            //std::cout << "DEBUG:: START while loop in client 1 byte at a time " << endl;
-            while (bytes_received < MAXBUFFERSIZE && recv(client_fd, p, 1, 0) == 1)
+            spaced += c == BATCH_SEPARATOR ? std::string(" ") + BATCH_SEPARATOR + " " : std::string(1, c);
+        }
+        std::istringstream words(spaced);
+        std::string word;
+        while (words >> word)
+        {
+            if (word.compare(0, 4, "min=") == 0)
             {
-                if (*p == '\n')
-                {
-                    // Found the newline character, stop receiving
-                    break;
-                }
-                p++;
-                bytes_received++;
+                filter.minDuration = atoi(word.c_str() + 4);
             }
-
-            //std::cout << "DEBUG:: END while loop in client 1 byte at a time " << endl;
-
-            // Null-terminate the received message
-            buffer_interval[bytes_received] = '\0';
-
-            // Convert the received data into a string
-            std::string data_received(buffer_interval, bytes_received);
-
-            char buffer_missing_names[MAXBUFFERSIZE];
-            std::memset(buffer_missing_names, 0, sizeof(buffer_missing_names));
-
-            // Receive up to the newline character to get buffer_missing_names
-            bytes_received = 0;
-            char *ptr = buffer_missing_names;
-
-            while (bytes_received < MAXBUFFERSIZE && recv(client_fd, ptr, 1, 0) == 1)
+            else if (word.compare(0, 5, "from=") == 0)
             {
-                if (*ptr == '\n')
-                {
-                    // Found the newline character, stop receiving
-                    break;
-                }
-                ptr++;
-                bytes_received++;
+                filter.from = atoi(word.c_str() + 5);
             }
-
-            //Receiving usernames that do not exist from Main Server
-            std::string missing_names_db(buffer_missing_names, bytes_received);
-
-            if (missing_names_db != "[]" && missing_names_db != "user exists")
+            else if (word.compare(0, 3, "to=") == 0)
             {
-                missing_names_db = missing_names_db.substr(1, missing_names_db.length() - 2);
-                std::cout << "Client received the reply from Main Server using TCP over port " << portNum << ": " << endl << missing_names_db << "do not exist." << endl;
+                filter.horizon = atoi(word.c_str() + 3);
             }
-
-            //User present and display intersection
-            char buffer_names[MAXBUFFERSIZE];
-            std::memset(buffer_names, 0, sizeof(buffer_names));
-
-            //std::cout << "DEBUG:: START names_received " << endl;
-            int names_received = recv(client_fd, buffer_names, sizeof(buffer_names), 0);
-            if (names_received < 0)
+            else if (word.compare(0, 6, "limit=") == 0)
             {
-                perror("Error receiving data from server");
-                exit(1);
+                filter.limit = strtoul(word.c_str() + 6, NULL, 10);
             }
+            else
+            {
+                usernames += (usernames.empty() || usernames.back() == BATCH_SEPARATOR || word[0] == BATCH_SEPARATOR ? "" : " ") + word;
+            }
+        }
+        if (batch && usernames.back() != BATCH_SEPARATOR)
+        {
+            usernames += BATCH_SEPARATOR;
+        }
 
-            // Null-terminate the received message
-            buffer_names[names_received] = '\0';
-            //std::cout << "DEBUG:: END names_received " << endl;
+        // Send user input to main server as one frame, the filter in front of the usernames of an earliest-slot request and of
+        // every batch request
+        bool has_filter = batch || filter.restricts();
+        size_t filter_len = has_filter ? SLOT_FILTER_SIZE : 0;
+        size_t input_len = filter_len + usernames.size();
+        std::string request(FRAME_HEADER_SIZE + filter_len, '\0');
+        packFrameHeader(&request[0], batch ? OP_BATCH_REQUEST : filter.restricts() ? OP_SLOT_REQUEST : OP_SCHEDULE_REQUEST, input_len);
+        if (has_filter)
+        {
+            encodeSlotFilter(filter, &request[FRAME_HEADER_SIZE]);
+        }
+        request += usernames;
+        if (send(client_fd, request.data(), request.size(), 0) == -1)
+        {
+            std::cerr << "Error sending data to server" << std::endl;
+            return 1;
+        }
+        std::cout << "Client finished sending the usernames to Main Server." << std::endl;
 
-            // Convert the received data into a string
-            std::string final_names(buffer_names, names_received);
-            // Create a new string variable to store the modified names
-            std::string modified_names;
+        // Receive the reply frame: the header first, then the whole payload in one read
+        char reply_header[FRAME_HEADER_SIZE];
+        if (recv(client_fd, reply_header, FRAME_HEADER_SIZE, MSG_WAITALL) != (ssize_t)FRAME_HEADER_SIZE)
+        {
+            perror("Error receiving data from server");
+            exit(1);
+        }
+        FrameHeader header;
+        if (!unpackFrameHeader(reply_header, header) || header.opcode != (batch ? OP_BATCH_REPLY : OP_SCHEDULE_REPLY))
+        {
+            std::cerr << "Error: malformed reply from Main Server" << std::endl;
+            exit(1);
+        }
+        std::vector<char> payload(header.length);
+        if (header.length > 0 && recv(client_fd, payload.data(), header.length, MSG_WAITALL) != (ssize_t)header.length)
+        {
+            perror("Error receiving data from server");
+            exit(1);
+        }
 
-            // Add a comma after every name except the last one, and append to the new string variable
-            for (std::size_t i = 0; i < final_names.size(); i++)
+        // The reply holds the time intervals, the usernames that do not exist, the usernames found and the usernames
+        // whose backend server did not answer; the reply to a batch holds them for every group in turn
+        const char *p = payload.data();
+        const char *end = p + payload.size();
+        for (int group = 1; batch ? p < end : group == 1; group++)
+        {
+            if (batch)
             {
-                if (final_names[i] == ' ')
-                {
-                    if (i < final_names.size() - 1)
-                    {
-                        modified_names += ", ";
-                    }
-                }
-                else
-                {
-                    modified_names += final_names[i];
-                }
+                std::cout << "Group " << group << ":" << std::endl;
             }
-
-            // Format and print the received data
-           if (data_received != "[]" && modified_names != "[]")
+            if (!printReply(p, end, portNum))
             {
-            std::cout << "Client received the reply from Main Server using TCP over port " << portNum <<": " << endl << "Time intervals " << data_received << "works for " << modified_names << "." << std::endl;
+                std::cerr << "Error: malformed reply from Main Server" << std::endl;
+                exit(1);
             }
         }
 
@@ -0,0 +1,144 @@
+/*
+Author: Rajnandini Thopte
+
+datagrams.h
+
+Batched UDP I/O. A DatagramBatch owns a fixed number of datagram buffers together with the message vectors recvmmsg and
+sendmmsg take, all allocated once, so a whole batch of datagrams is received or sent with one system call instead of one
+call per datagram. The backend servers receive up to DATAGRAM_BATCH queries per wakeup and send all of their results
+together; Main Server drains the results the same way and sends the queries of one event loop iteration at once.
+*/
+
+#ifndef DATAGRAMS_H
+#define DATAGRAMS_H
+
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <memory>
+#include <vector>
+
+#include "protocol.h"
+
+#define DATAGRAM_BATCH 32 // datagrams received or sent per system call
+
+struct DatagramBatch
+{
+    // capacity buffers of MAX_DATAGRAM_SIZE bytes. They are not zeroed, so the pages of buffers that are never used are
+    // never touched.
+    std::unique_ptr<char[]> buffers;
+    std::vector<struct mmsghdr> messages;
+    std::vector<struct iovec> vectors;
+    std::vector<struct sockaddr_in> addresses;
+    size_t count = 0; // datagrams received by the last receive, or queued to be sent
+
+    explicit DatagramBatch(size_t capacity = DATAGRAM_BATCH)
+        : buffers(new char[capacity * MAX_DATAGRAM_SIZE]), messages(capacity), vectors(capacity), addresses(capacity)
+    {
+        memset(messages.data(), 0, capacity * sizeof(struct mmsghdr));
+        for (size_t i = 0; i < capacity; i++)
+        {
+            vectors[i].iov_base = buffer(i);
+            vectors[i].iov_len = MAX_DATAGRAM_SIZE;
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+    }
+
+    // The message vectors point into the batch itself
+    DatagramBatch(const DatagramBatch &) = delete;
+    DatagramBatch &operator=(const DatagramBatch &) = delete;
+
+    size_t capacity() const
+    {
+        return messages.size();
+    }
+
+    bool full() const
+    {
+        return count == messages.size();
+    }
+
+    char *buffer(size_t i)
+    {
+        return buffers.get() + i * MAX_DATAGRAM_SIZE;
+    }
+
+    size_t length(size_t i) const
+    {
+        return messages[i].msg_len;
+    }
+
+    const struct sockaddr_in &address(size_t i) const
+    {
+        return addresses[i];
+    }
+
+    /*
+    Receives up to capacity datagrams with one recvmmsg. With MSG_WAITFORONE it blocks, subject to SO_RCVTIMEO, until the
+    first one arrives and then takes only what is already queued. Returns the number received, or -1 with errno set.
+    */
+    int receive(int sockfd, int flags)
+    {
+        for (size_t i = 0; i < messages.size(); i++)
+        {
+            vectors[i].iov_len = MAX_DATAGRAM_SIZE;
+            messages[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            messages[i].msg_hdr.msg_flags = 0;
+        }
+        int received = recvmmsg(sockfd, messages.data(), messages.size(), flags, NULL);
+        count = received > 0 ? received : 0;
+        return received;
+    }
+
+    // The buffer to write the next datagram to send into; it holds MAX_DATAGRAM_SIZE bytes. The batch must not be full.
+    char *next()
+    {
+        return buffer(count);
+    }
+
+    // Queues the datagram of length bytes that was written into next()
+    void queue(size_t length, const struct sockaddr_in &to)
+    {
+        vectors[count].iov_len = length;
+        addresses[count] = to;
+        messages[count].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        count++;
+    }
+
+    /*
+    Sends every queued datagram with as few sendmmsg calls as the socket allows and empties the batch. A datagram the
+    socket refuses is skipped. Returns the number of datagrams that were not sent; errno tells why the last one was not.
+    */
+    size_t flush(int sockfd)
+    {
+        size_t sent = 0;
+        size_t failed = 0;
+        while (sent < count)
+        {
+            int n = sendmmsg(sockfd, &messages[sent], count - sent, 0);
+            if (n > 0)
+            {
+                sent += n;
+            }
+            else if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            else
+            {
+                failed++;
+                sent++;
+            }
+        }
+        count = 0;
+        return failed;
+    }
+};
+
+#endif
@@ -0,0 +1,200 @@
+/*
+Author: Rajnandini Thopte
+
+directory.h
+
+Flat hash directory from username to a small integer value (the shard a user is stored in). Names are kept back to back in
+one character pool and the table is open addressing with linear probing over 8-byte slots, each holding a hash tag and the
+entry number, so a lookup touches one or two cache lines and never allocates.
+*/
+
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#define NOT_FOUND 0xFFFFFFFFu
+
+// 64-bit FNV-1a
+inline uint64_t hashName(const char *name, size_t length)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+struct DirectorySlot
+{
+    uint32_t tag;   // upper half of the name's hash
+    uint32_t entry; // entry number + 1, 0 if the slot is empty
+};
+
+/*
+Looks a name up in a directory table given as plain arrays, which is also how a backend server's snapshot stores it.
+Returns the entry number, or NOT_FOUND.
+*/
+inline uint32_t probeDirectory(const DirectorySlot *slots, uint32_t mask, const char *pool, const uint32_t *offsets, const char *name, size_t length)
+{
+    uint64_t hash = hashName(name, length);
+    uint32_t tag = (uint32_t)(hash >> 32);
+    for (uint32_t i = (uint32_t)hash & mask;; i = (i + 1) & mask)
+    {
+        const DirectorySlot &slot = slots[i];
+        if (slot.entry == 0)
+        {
+            return NOT_FOUND;
+        }
+        uint32_t entry = slot.entry - 1;
+        if (slot.tag == tag && offsets[entry + 1] - offsets[entry] == length && memcmp(pool + offsets[entry], name, length) == 0)
+        {
+            return entry;
+        }
+    }
+}
+
+struct NameDirectory
+{
+    std::vector<char> pool;        // every name back to back
+    std::vector<uint32_t> offsets; // where each entry's name starts in pool, plus one past the last name
+    std::vector<uint32_t> values;  // value of each entry
+    std::vector<DirectorySlot> slots;
+    uint32_t mask = 0;
+
+    NameDirectory()
+    {
+        offsets.push_back(0);
+        slots.assign(16, DirectorySlot{0, 0});
+        mask = 15;
+    }
+
+    size_t size() const
+    {
+        return values.size();
+    }
+
+    // Returns the value stored for the name, or NOT_FOUND
+    uint32_t find(const char *name, size_t length) const
+    {
+        uint32_t entry = probeDirectory(slots.data(), mask, pool.data(), offsets.data(), name, length);
+        return entry == NOT_FOUND ? NOT_FOUND : values[entry];
+    }
+
+    uint32_t find(const std::string &name) const
+    {
+        return find(name.data(), name.size());
+    }
+
+    // Adds the name with its value. Returns false, leaving the directory unchanged, if the name is already in it.
+    bool insert(const char *name, size_t length, uint32_t value)
+    {
+        bool inserted;
+        insertHashed(name, length, hashName(name, length), value, inserted);
+        return inserted;
+    }
+
+    // Same as insert for a name whose hashName is already known, e.g. computed by a loader thread.
+    // Returns the entry number of the name, whether it was added or already there.
+    uint32_t insertHashed(const char *name, size_t length, uint64_t hash, uint32_t value, bool &inserted)
+    {
+        // Keep the load factor under 1/2
+        if ((values.size() + 1) * 2 > slots.size())
+        {
+            grow();
+        }
+        uint32_t tag = (uint32_t)(hash >> 32);
+        uint32_t i = (uint32_t)hash & mask;
+        for (; slots[i].entry != 0; i = (i + 1) & mask)
+        {
+            if (slots[i].tag == tag && sameName(slots[i].entry - 1, name, length))
+            {
+                inserted = false;
+                return slots[i].entry - 1;
+            }
+        }
+        pool.insert(pool.end(), name, name + length);
+        offsets.push_back((uint32_t)pool.size());
+        values.push_back(value);
+        slots[i] = DirectorySlot{tag, (uint32_t)values.size()};
+        inserted = true;
+        return (uint32_t)values.size() - 1;
+    }
+
+    // Sets the value of the name, adding it if needed. Returns its previous value, or NOT_FOUND if it was not there.
+    // Storing NOT_FOUND as the value removes the name from lookups; its entry stays, ready to be set again.
+    uint32_t assign(const char *name, size_t length, uint32_t value)
+    {
+        bool inserted;
+        uint32_t entry = insertHashed(name, length, hashName(name, length), value, inserted);
+        if (inserted)
+        {
+            return NOT_FOUND;
+        }
+        uint32_t previous = values[entry];
+        values[entry] = value;
+        return previous;
+    }
+
+    // Name of an entry; entries are numbered in the order they were added
+    std::string_view name(uint32_t entry) const
+    {
+        return std::string_view(pool.data() + offsets[entry], offsets[entry + 1] - offsets[entry]);
+    }
+
+    // Sizes the table for count names up front so that loading them never rehashes
+    void reserve(size_t count)
+    {
+        size_t capacity = slots.size();
+        while (capacity < count * 2)
+        {
+            capacity *= 2;
+        }
+        if (capacity != slots.size())
+        {
+            rehash(capacity);
+        }
+        values.reserve(count);
+        offsets.reserve(count + 1);
+    }
+
+    void reservePool(size_t bytes)
+    {
+        pool.reserve(bytes);
+    }
+
+private:
+    bool sameName(uint32_t entry, const char *name, size_t length) const
+    {
+        return offsets[entry + 1] - offsets[entry] == length && memcmp(&pool[offsets[entry]], name, length) == 0;
+    }
+
+    void grow()
+    {
+        rehash(slots.size() * 2);
+    }
+
+    void rehash(size_t capacity)
+    {
+        slots.assign(capacity, DirectorySlot{0, 0});
+        mask = (uint32_t)capacity - 1;
+        for (uint32_t entry = 0; entry < values.size(); entry++)
+        {
+            uint64_t hash = hashName(&pool[offsets[entry]], offsets[entry + 1] - offsets[entry]);
+            uint32_t i = (uint32_t)hash & mask;
+            while (slots[i].entry != 0)
+            {
+                i = (i + 1) & mask;
+            }
+            slots[i] = DirectorySlot{(uint32_t)(hash >> 32), entry + 1};
+        }
+    }
+};
+
+#endif
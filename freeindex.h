@@ -0,0 +1,196 @@
+/*
+Author: Rajnandini Thopte
+
+freeindex.h
+
+Index of the availability of all users of a backend server, for reverse queries: which users are free for the whole of
+[start, end). It is a centered interval tree over every interval in the user table. Each node has a center point and
+holds the intervals that contain it, once sorted by start and once by end, latest first. The intervals that end before the
+center go to the left subtree and the ones that start after it to the right one. A query walks one path from the root, and
+at every node it reads only the entries that can cover the window: for a window starting left of the center, the
+intervals starting by its start; otherwise, the intervals ending at or after its end. A query costs O(log n) plus the
+entries it reads instead of a scan of every user.
+
+The tree is flat: its nodes and the entries of all of them live in three arrays, and a node refers to its children and
+to its entries by index, so building it allocates a few large arrays rather than one object per node. The center of a node
+is the median of the endpoints of its intervals, which keeps the depth logarithmic. Building lays out the nodes first and then
+sorts the entries of all nodes on every core, like loadUserTable parses the data file.
+*/
+
+#ifndef FREEINDEX_H
+#define FREEINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "usertable.h"
+
+#define NO_NODE 0xFFFFFFFFu
+#define FREE_INDEX_SAMPLE 1024 // entries whose endpoints pick the center of a node
+
+// One interval of one user
+struct FreeIndexEntry
+{
+    int start;
+    int end;
+    uint32_t user;
+};
+
+struct FreeIndexNode
+{
+    int center;
+    uint32_t left;  // the node of the intervals that end before center, or NO_NODE
+    uint32_t right; // the node of the intervals that start after center, or NO_NODE
+    uint32_t first; // where the intervals that contain center are in byStart and byEnd
+    uint32_t count;
+};
+
+struct FreeIndex
+{
+    std::vector<FreeIndexNode> nodes;
+    std::vector<FreeIndexEntry> byStart; // the intervals of every node, sorted by start
+    std::vector<FreeIndexEntry> byEnd;   // the same, sorted by end, latest first
+    uint32_t root = NO_NODE;
+
+    // Indexes every non-empty interval of every user in table, with the given number of threads (all cores if 0)
+    void build(const UserTable &table, unsigned threads = 0)
+    {
+        std::vector<FreeIndexEntry> entries;
+        entries.reserve(table.intervalCount);
+        for (uint32_t user = 0; user < table.size(); user++)
+        {
+            IntervalSpan intervals = table.availability(user);
+            for (size_t i = 0; i < intervals.size; i++)
+            {
+                if (intervals.data[i].first < intervals.data[i].second)
+                {
+                    entries.push_back({intervals.data[i].first, intervals.data[i].second, user});
+                }
+            }
+        }
+        nodes.clear();
+        byStart.clear();
+        byEnd.clear();
+        byStart.reserve(entries.size());
+        std::vector<int> endpoints;
+        root = buildNode(entries.data(), entries.size(), endpoints);
+        byEnd = byStart;
+
+        // Sort the entries of every node, the nodes split into runs of about as many entries per thread
+        if (threads == 0)
+        {
+            threads = std::thread::hardware_concurrency();
+        }
+        size_t per_thread = byStart.size() / std::max(1u, threads) + 1;
+        std::vector<std::thread> workers;
+        for (uint32_t first = 0, last = 0; first < nodes.size(); first = last)
+        {
+            size_t entry_count = 0;
+            while (last < nodes.size() && (last == first || entry_count + nodes[last].count <= per_thread))
+            {
+                entry_count += nodes[last++].count;
+            }
+            workers.emplace_back([this, first, last]() { sortNodes(first, last); });
+        }
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    size_t size() const
+    {
+        return byStart.size();
+    }
+
+    /*
+    Appends to users every user with an interval that covers the whole of [start, end). The intervals of a user are disjoint,
+    so none of them is appended twice.
+    */
+    void findFree(int start, int end, std::vector<uint32_t> &users) const
+    {
+        uint32_t node = root;
+        while (node != NO_NODE)
+        {
+            const FreeIndexNode &current = nodes[node];
+            const FreeIndexEntry *entry;
+            const FreeIndexEntry *last = byStart.data() + current.first + current.count;
+            if (start < current.center)
+            {
+                // Every interval here ends at or after the center, so only those starting by start can cover it, and none
+                // on the right does
+                for (entry = byStart.data() + current.first; entry < last && entry->start <= start; entry++)
+                {
+                    if (entry->end >= end)
+                    {
+                        users.push_back(entry->user);
+                    }
+                }
+                node = current.left;
+            }
+            else
+            {
+                // Every interval here starts by the center, so the ones ending at or after end cover the window, and none
+                // on the left does
+                last = byEnd.data() + current.first + current.count;
+                for (entry = byEnd.data() + current.first; entry < last && entry->end >= end; entry++)
+                {
+                    users.push_back(entry->user);
+                }
+                node = current.right;
+            }
+        }
+    }
+
+private:
+    // Builds the subtree of the count entries at entries, which it reorders, and returns its root
+    uint32_t buildNode(FreeIndexEntry *entries, size_t count, std::vector<int> &endpoints)
+    {
+        if (count == 0)
+        {
+            return NO_NODE;
+        }
+        // The median of up to FREE_INDEX_SAMPLE of the endpoints, spread evenly over the entries, is as good a center as
+        // the median of all of them and costs the same at every node
+        endpoints.clear();
+        size_t stride = (count + FREE_INDEX_SAMPLE - 1) / FREE_INDEX_SAMPLE;
+        for (size_t i = 0; i < count; i += stride)
+        {
+            endpoints.push_back(entries[i].start);
+            endpoints.push_back(entries[i].end);
+        }
+        std::nth_element(endpoints.begin(), endpoints.begin() + endpoints.size() / 2, endpoints.end());
+        int center = endpoints[endpoints.size() / 2];
+
+        FreeIndexEntry *end = entries + count;
+        FreeIndexEntry *middle = std::partition(entries, end, [center](const FreeIndexEntry &entry) { return entry.end < center; });
+        FreeIndexEntry *right = std::partition(middle, end, [center](const FreeIndexEntry &entry) { return entry.start <= center; });
+
+        uint32_t node = nodes.size();
+        nodes.push_back({center, NO_NODE, NO_NODE, (uint32_t)byStart.size(), (uint32_t)(right - middle)});
+        byStart.insert(byStart.end(), middle, right);
+
+        uint32_t left_child = buildNode(entries, middle - entries, endpoints);
+        uint32_t right_child = buildNode(right, end - right, endpoints);
+        nodes[node].left = left_child;
+        nodes[node].right = right_child;
+        return node;
+    }
+
+    // Sorts the entries of the nodes [first, last) by start in byStart and by end, latest first, in byEnd
+    void sortNodes(uint32_t first, uint32_t last)
+    {
+        for (uint32_t node = first; node < last; node++)
+        {
+            auto from = nodes[node].first;
+            auto to = from + nodes[node].count;
+            std::sort(byStart.begin() + from, byStart.begin() + to, [](const FreeIndexEntry &a, const FreeIndexEntry &b) { return a.start < b.start; });
+            std::sort(byEnd.begin() + from, byEnd.begin() + to, [](const FreeIndexEntry &a, const FreeIndexEntry &b) { return a.end > b.end; });
+        }
+    }
+};
+
+#endif
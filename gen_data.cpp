@@ -0,0 +1,142 @@
+/*
+Author: Rajnandini Thopte
+
+gen_data.cpp
+
+Generates synthetic data files for the backend servers, e.g. a.txt and b.txt, in the format they read:
+
+    user0;[[3,17],[40,52]]
+
+The users are spread over the files in turn, so no username is in two files. Every user gets between 1 and twice the
+given number of intervals within [0, domain) covering about the given fraction of it (synthetic.h). The files are written
+through one large buffer per file, so millions of users take seconds.
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <random>
+#include <utility>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "synthetic.h"
+
+#define DEFAULT_USERS 1000      // users per file
+#define DEFAULT_INTERVALS 10    // mean intervals per user
+#define DEFAULT_DOMAIN 10080    // minutes in a week
+#define DEFAULT_COVERAGE 0.5    // fraction of the domain a user is available
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+using namespace std;
+
+void appendInt(string &out, long value)
+{
+    char digits[24];
+    int n = 0;
+    bool negative = value < 0;
+    unsigned long magnitude = negative ? -(unsigned long)value : (unsigned long)value;
+    do
+    {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (negative)
+    {
+        out += '-';
+    }
+    while (n > 0)
+    {
+        out += digits[--n];
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    size_t users = DEFAULT_USERS;
+    size_t intervals = DEFAULT_INTERVALS;
+    int domain = DEFAULT_DOMAIN;
+    double coverage = DEFAULT_COVERAGE;
+    uint64_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "u:i:d:c:S:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'u':
+            users = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            intervals = strtoull(optarg, NULL, 10);
+            break;
+        case 'd':
+            domain = atoi(optarg);
+            break;
+        case 'c':
+            coverage = atof(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-u users per file] [-i mean intervals per user] [-d domain end] [-c coverage 0..1] [-S seed] [file ...]" << endl;
+            return 1;
+        }
+    }
+    vector<string> files(argv + optind, argv + argc);
+    if (files.empty())
+    {
+        files = {"a.txt", "b.txt"};
+    }
+    if (intervals < 1 || domain < 2 || coverage <= 0 || coverage >= 1)
+    {
+        cerr << "Error: need at least 1 interval, a domain of at least 2 and a coverage between 0 and 1" << endl;
+        return 1;
+    }
+
+    mt19937_64 rng(seed);
+    uniform_int_distribution<size_t> interval_count(1, 2 * intervals - 1);
+    vector<pair<int, int>> availability;
+    string buffer;
+    buffer.reserve(WRITE_BUFFER_SIZE + 4096);
+    for (size_t f = 0; f < files.size(); f++)
+    {
+        FILE *out = fopen(files[f].c_str(), "w");
+        if (out == NULL)
+        {
+            perror(files[f].c_str());
+            return 1;
+        }
+        buffer.clear();
+        for (size_t i = 0; i < users; i++)
+        {
+            randomAvailability(rng, domain, interval_count(rng), coverage, availability);
+            buffer += "user";
+            appendInt(buffer, (long)(i * files.size() + f));
+            buffer += ";[";
+            for (size_t j = 0; j < availability.size(); j++)
+            {
+                buffer += j == 0 ? "[" : ",[";
+                appendInt(buffer, availability[j].first);
+                buffer += ',';
+                appendInt(buffer, availability[j].second);
+                buffer += ']';
+            }
+            buffer += "]\n";
+            if (buffer.size() >= WRITE_BUFFER_SIZE)
+            {
+                fwrite(buffer.data(), 1, buffer.size(), out);
+                buffer.clear();
+            }
+        }
+        fwrite(buffer.data(), 1, buffer.size(), out);
+        if (fclose(out) != 0)
+        {
+            perror(files[f].c_str());
+            return 1;
+        }
+        cout << "Wrote " << users << " users to " << files[f] << "." << endl;
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+Author: Rajnandini Thopte
+
+histogram.h
+
+Latency histogram in the style of HdrHistogram: values are counted in buckets whose width grows with the value, so any
+value from 1 ns to hours is recorded in O(1) with a relative error under 1%, in a fixed array that never allocates after
+construction. Every power of two is split into HISTOGRAM_SUB_BUCKETS / 2 equal sub-buckets and values below
+HISTOGRAM_SUB_BUCKETS are exact. Histograms recorded separately, e.g. one per thread, are merged by adding their counts.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#define HISTOGRAM_PRECISION_BITS 8
+#define HISTOGRAM_SUB_BUCKETS (1u << HISTOGRAM_PRECISION_BITS)
+#define HISTOGRAM_HALF_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_PRECISION_BITS) * HISTOGRAM_HALF_BUCKETS + HISTOGRAM_SUB_BUCKETS)
+
+struct LatencyHistogram
+{
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t min = UINT64_MAX;
+    uint64_t max = 0;
+    double sum = 0;
+
+    LatencyHistogram() : counts(HISTOGRAM_BUCKETS, 0)
+    {
+    }
+
+    static size_t bucketOf(uint64_t value)
+    {
+        if (value < HISTOGRAM_SUB_BUCKETS)
+        {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - (HISTOGRAM_PRECISION_BITS - 1);
+        return shift * HISTOGRAM_HALF_BUCKETS + (value >> shift);
+    }
+
+    // Smallest and largest value counted in a bucket
+    static uint64_t lowestOf(size_t bucket)
+    {
+        if (bucket < HISTOGRAM_SUB_BUCKETS)
+        {
+            return bucket;
+        }
+        int shift = bucket / HISTOGRAM_HALF_BUCKETS - 1;
+        return (uint64_t)(bucket - shift * HISTOGRAM_HALF_BUCKETS) << shift;
+    }
+
+    static uint64_t highestOf(size_t bucket)
+    {
+        return bucket + 1 < HISTOGRAM_BUCKETS ? lowestOf(bucket + 1) - 1 : UINT64_MAX;
+    }
+
+    void record(uint64_t value)
+    {
+        counts[bucketOf(value)]++;
+        total++;
+        sum += value;
+        if (value < min)
+        {
+            min = value;
+        }
+        if (value > max)
+        {
+            max = value;
+        }
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if (other.min < min)
+        {
+            min = other.min;
+        }
+        if (other.max > max)
+        {
+            max = other.max;
+        }
+    }
+
+    void clear()
+    {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = 0;
+        min = UINT64_MAX;
+        max = 0;
+        sum = 0;
+    }
+
+    // Value at or below which the given percentage of the recorded values are, reported like HdrHistogram as the
+    // highest value of its bucket (but never above the largest value recorded)
+    uint64_t percentile(double percent) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t wanted = (uint64_t)(percent / 100.0 * total + 0.5);
+        if (wanted < 1)
+        {
+            wanted = 1;
+        }
+        uint64_t seen = 0;
+        for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            seen += counts[i];
+            if (seen >= wanted)
+            {
+                uint64_t value = highestOf(i);
+                return value < max ? value : max;
+            }
+        }
+        return max;
+    }
+
+    double mean() const
+    {
+        return total == 0 ? 0 : sum / total;
+    }
+
+    /*
+    Writes the percentile distribution in the text format of HdrHistogram's outputPercentileDistribution, with values
+    divided by scale (e.g. 1000 to print nanoseconds as microseconds), so it can be plotted with the usual HdrHistogram tools.
+    */
+    void printDistribution(FILE *out, double scale) const
+    {
+        fprintf(out, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+        if (total == 0)
+        {
+            return;
+        }
+        // Five ticks per halving of the distance to 100%, like HdrHistogram's default
+        bool done = false;
+        for (int level = 0; level < 48 && !done; level++)
+        {
+            double remaining = 100.0 / (double)(1ull << level);
+            for (int tick = 0; tick < 5 && !done; tick++)
+            {
+                uint64_t value = percentile(100.0 - remaining + tick * remaining / 10);
+                uint64_t below = 0;
+                for (size_t i = 0; i <= bucketOf(value); i++)
+                {
+                    below += counts[i];
+                }
+                done = below >= total;
+                if (!done)
+                {
+                    double fraction = (double)below / total;
+                    fprintf(out, "%12.3f %14.12f %10llu %14.2f\n", value / scale, fraction, (unsigned long long)below, 1.0 / (1.0 - fraction));
+                }
+            }
+        }
+        fprintf(out, "%12.3f %14.12f %10llu %14s\n", max / scale, 1.0, (unsigned long long)total, "inf");
+        fprintf(out, "#[Mean    = %12.3f, Max          = %12.3f]\n", mean() / scale, max / scale);
+        fprintf(out, "#[Total count    = %12llu]\n", (unsigned long long)total);
+    }
+};
+
+#endif
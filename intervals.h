@@ -0,0 +1,209 @@
+/*
+Author: Rajnandini Thopte
+
+intervals.h
+
+Common time availability of a whole group in one pass. Every user's availability is a sorted list of disjoint [start, end]
+intervals. Instead of intersecting the lists two at a time, which builds a new list per user, all of them are swept together:
+the next common interval starts at the latest start and ends at the earliest end among the current interval of every list.
+Only an interval with start < end counts, just like the two-list algorithm it replaces.
+
+An earliest-slot query narrows the result with a SlotFilter: only the common intervals of at least a minimum duration, clipped
+to a window [from, horizon), and at most a limit of them. Each list is binary-searched down to the intervals that overlap the
+window before the sweep, which stops as soon as it has found enough slots, so the cost follows the intervals in the window
+rather than the length of the calendars.
+*/
+
+#ifndef INTERVALS_H
+#define INTERVALS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// A read-only view of one sorted interval list, e.g. one user's availability
+struct IntervalSpan
+{
+    const std::pair<int, int> *data;
+    size_t size;
+};
+
+inline IntervalSpan spanOf(const std::vector<std::pair<int, int>> &intervals)
+{
+    return IntervalSpan{intervals.data(), intervals.size()};
+}
+
+// Options of an earliest-slot query. The defaults leave the result as it is.
+struct SlotFilter
+{
+    int minDuration = 0;   // a slot [start, end] qualifies if end - start is at least this
+    int horizon = INT_MAX; // end of the window: slots are cut off to end by this, the ones starting at or after it are dropped
+    uint32_t limit = 0;    // at most this many slots, the earliest ones; 0 for all of them
+    int from = INT_MIN;    // start of the window: slots are cut off to start at this, the ones ending by it are dropped
+
+    bool windowed() const
+    {
+        return from != INT_MIN || horizon != INT_MAX;
+    }
+
+    bool restricts() const
+    {
+        return minDuration > 0 || limit > 0 || windowed();
+    }
+};
+
+// Clips the slot [start, end] to the window. Returns false if what is left of it does not qualify.
+inline bool fitSlot(int &start, int &end, const SlotFilter &filter)
+{
+    start = std::max(start, filter.from);
+    end = std::min(end, filter.horizon);
+    return start < end && (long long)end - start >= filter.minDuration;
+}
+
+// Appends the slot [start, end] to out if it qualifies. Returns false once out holds filter.limit slots.
+inline bool addSlot(std::vector<std::pair<int, int>> &out, int start, int end, const SlotFilter &filter)
+{
+    if (fitSlot(start, end, filter))
+    {
+        out.emplace_back(start, end);
+    }
+    return filter.limit == 0 || out.size() < filter.limit;
+}
+
+// Returns the first position at or after pos whose interval ends after t, or list.size if there is none.
+// Gallops so that skipping far ahead in a long list costs O(log distance).
+inline size_t skipEndingBy(const IntervalSpan &list, size_t pos, int t)
+{
+    if (pos >= list.size || list.data[pos].second > t)
+    {
+        return pos;
+    }
+    size_t before = pos; // last position known to end at or before t
+    size_t step = 1;
+    while (before + step < list.size && list.data[before + step].second <= t)
+    {
+        before += step;
+        step *= 2;
+    }
+    const std::pair<int, int> *first = list.data + before + 1;
+    const std::pair<int, int> *last = list.data + std::min(before + step, list.size);
+    return std::partition_point(first, last, [t](const std::pair<int, int> &interval) { return interval.second <= t; }) - list.data;
+}
+
+// The part of a sorted list that overlaps the window of filter, found with two binary searches
+inline IntervalSpan sliceWindow(const IntervalSpan &list, const SlotFilter &filter)
+{
+    const std::pair<int, int> *begin = list.data;
+    const std::pair<int, int> *end = list.data + list.size;
+    if (filter.from != INT_MIN)
+    {
+        begin = std::partition_point(begin, end, [&filter](const std::pair<int, int> &interval) { return interval.second <= filter.from; });
+    }
+    if (filter.horizon != INT_MAX)
+    {
+        end = std::partition_point(begin, end, [&filter](const std::pair<int, int> &interval) { return interval.first < filter.horizon; });
+    }
+    return IntervalSpan{begin, (size_t)(end - begin)};
+}
+
+// True if one interval of the sorted list covers the whole of [start, end), found with a binary search
+inline bool coversWindow(const IntervalSpan &list, int start, int end)
+{
+    const std::pair<int, int> *after = std::partition_point(list.data, list.data + list.size, [start](const std::pair<int, int> &interval) {
+        return interval.first <= start;
+    });
+    return after != list.data && (after - 1)->second >= end;
+}
+
+/*
+Writes the intervals common to all k lists into out, which is cleared first so the caller can reuse its capacity.
+The lists are reordered by size: the shortest list drives the sweep and the longer ones are skipped through with
+skipEndingBy, and the sweep stops as soon as any list runs out. A caller that intersects many groups can pass scratch, which
+holds the positions of groups of more than 16 users and keeps its capacity from one call to the next. Only the slots that
+filter lets through are written: the lists are narrowed to its window first, and the sweep stops once it has found
+filter.limit slots.
+*/
+inline void intersectIntervals(IntervalSpan *lists, size_t k, std::vector<std::pair<int, int>> &out, std::vector<size_t> *scratch = nullptr,
+                               const SlotFilter &filter = SlotFilter())
+{
+    out.clear();
+    if (k == 0)
+    {
+        return;
+    }
+    if (filter.windowed())
+    {
+        for (size_t i = 0; i < k; i++)
+        {
+            lists[i] = sliceWindow(lists[i], filter);
+        }
+    }
+    std::sort(lists, lists + k, [](const IntervalSpan &a, const IntervalSpan &b) { return a.size < b.size; });
+    if (lists[0].size == 0)
+    {
+        return;
+    }
+    if (k == 1)
+    {
+        if (!filter.restricts())
+        {
+            out.assign(lists[0].data, lists[0].data + lists[0].size);
+            return;
+        }
+        for (size_t i = 0; i < lists[0].size; i++)
+        {
+            if (!addSlot(out, lists[0].data[i].first, lists[0].data[i].second, filter))
+            {
+                return;
+            }
+        }
+        return;
+    }
+
+    // Current position in every list, on the stack for any realistic group size
+    size_t stack_pos[16];
+    std::vector<size_t> heap_pos;
+    size_t *pos = stack_pos;
+    if (k > 16)
+    {
+        std::vector<size_t> &positions = scratch != nullptr ? *scratch : heap_pos;
+        positions.resize(k);
+        pos = positions.data();
+    }
+    std::fill(pos, pos + k, 0);
+
+    while (true)
+    {
+        int start = INT_MIN;
+        int end = INT_MAX;
+        size_t earliest = 0; // list whose current interval ends first
+        for (size_t i = 0; i < k; i++)
+        {
+            pos[i] = skipEndingBy(lists[i], pos[i], start);
+            if (pos[i] == lists[i].size)
+            {
+                return;
+            }
+            const std::pair<int, int> &interval = lists[i].data[pos[i]];
+            start = std::max(start, interval.first);
+            if (interval.second < end)
+            {
+                end = interval.second;
+                earliest = i;
+            }
+        }
+        if (start < end && !addSlot(out, start, end, filter))
+        {
+            return;
+        }
+        if (++pos[earliest] == lists[earliest].size)
+        {
+            return;
+        }
+    }
+}
+
+#endif
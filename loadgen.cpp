@@ -0,0 +1,636 @@
+/*
+Author: Rajnandini Thopte
+
+loadgen.cpp
+
+Load generator for the whole client -> Main Server -> backend server path. It speaks the client protocol over many TCP
+connections at once from one epoll loop and sends scheduling requests for random groups: 1 to -g users, each drawn from the
+data files of the backend servers with a Zipfian distribution, so a few users are asked for far more often than the rest.
+A group mostly takes its users from one data file, and with probability -x each user comes from another one, so the mix
+of single and multi backend requests can be set. With -m <min duration> and/or -l <limit> every request is an earliest-slot
+request for at most that many slots of at least that duration. With -b <groups> every request is a batch of that many groups,
+and the throughput is reported in groups as well.
+
+Closed loop (the default): every connection sends its next request as soon as the reply to the last one arrives.
+Open loop (-r <requests per second>): requests are issued on a fixed schedule whether or not the servers keep up. Requests
+that find no idle connection wait for one, and their latency counts from when they were due, so a stall of the servers shows
+up in the latencies instead of slowing down the load (coordinated omission).
+
+Reports the throughput and the latency percentiles from HDR-style histograms (histogram.h), separately for requests that
+involve one data file and several; -o writes the full percentile distribution in HdrHistogram's format.
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <random>
+#include <chrono>
+#include <utility>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <algorithm>
+
+#include "protocol.h"
+#include "histogram.h"
+
+#define LOCALHOST "127.0.0.1"
+#define SERVER_PORT 24463
+#define FAIL -1
+#define MAX_EVENTS 1024
+#define DEFAULT_CONNECTIONS 64
+#define DEFAULT_DURATION 10   // seconds measured
+#define DEFAULT_WARMUP 1      // seconds run before measuring
+#define DEFAULT_MAX_GROUP 10  // largest group, like the client allows
+#define DEFAULT_ZIPF 0.99     // exponent of the Zipfian distribution of users
+#define DEFAULT_CROSS 0.2     // probability that a user of a group comes from another data file than the group
+
+using namespace std;
+
+// The users of one data file, drawn by rank: rank r is drawn with probability proportional to 1 / (r + 1)^s
+struct Population
+{
+    string file;
+    vector<string> names;
+    vector<uint32_t> byRank; // the user of every rank, shuffled so the popular users are spread over the file
+    vector<double> cdf;      // probability of drawing a rank at or below each rank
+};
+
+// One TCP connection to Main Server with at most one request in flight
+struct Connection
+{
+    int fd = FAIL;
+    bool busy = false;
+    bool multi = false;                      // the request in flight involves several data files
+    chrono::steady_clock::time_point due;    // when the request in flight was due to be sent
+    string inbuf;                            // reply bytes received so far
+    string outbuf;                           // request bytes not sent yet
+};
+
+vector<Population> populations;
+vector<Connection> connections;
+int epollFD;
+mt19937_64 rng;
+
+// Options
+string host = LOCALHOST;
+int port = SERVER_PORT;
+int connectionCount = DEFAULT_CONNECTIONS;
+double duration = DEFAULT_DURATION;
+double warmup = DEFAULT_WARMUP;
+double rate = 0; // requests per second, 0 for closed loop
+int maxGroup = DEFAULT_MAX_GROUP;
+double zipfExponent = DEFAULT_ZIPF;
+double crossFraction = DEFAULT_CROSS;
+string histogramFile;
+SlotFilter slotFilter; // of every request, if it restricts anything
+int batchSize = 0;     // groups per batch request, 0 to send every group on its own
+
+// Results
+LatencyHistogram singleLatency; // nanoseconds, requests involving one data file
+LatencyHistogram multiLatency;  // nanoseconds, requests involving several
+uint64_t errors = 0;
+uint64_t incomplete = 0; // replies that left out usernames because their backend server did not answer
+size_t maxBacklog = 0;
+
+// Reads the usernames of a data file, written like the backend servers read them: up to ';' without spaces
+bool loadPopulation(const string &file, Population &population)
+{
+    ifstream in(file);
+    if (!in)
+    {
+        return false;
+    }
+    population.file = file;
+    string line;
+    while (getline(in, line))
+    {
+        size_t semicolon = line.find(';');
+        if (semicolon == string::npos)
+        {
+            continue;
+        }
+        string name = line.substr(0, semicolon);
+        name.erase(remove(name.begin(), name.end(), ' '), name.end());
+        population.names.push_back(name);
+    }
+    size_t n = population.names.size();
+    population.byRank.resize(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        population.byRank[i] = (uint32_t)i;
+    }
+    shuffle(population.byRank.begin(), population.byRank.end(), rng);
+    population.cdf.resize(n);
+    double sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += 1.0 / pow((double)(i + 1), zipfExponent);
+        population.cdf[i] = sum;
+    }
+    for (double &p : population.cdf)
+    {
+        p /= sum;
+    }
+    return n > 0;
+}
+
+const string &drawUser(const Population &population)
+{
+    double u = uniform_real_distribution<double>(0, 1)(rng);
+    size_t rank = lower_bound(population.cdf.begin(), population.cdf.end(), u) - population.cdf.begin();
+    if (rank >= population.names.size())
+    {
+        rank = population.names.size() - 1;
+    }
+    return population.names[population.byRank[rank]];
+}
+
+// Draws a group and appends its usernames to usernames. Returns true if its users come from several data files.
+bool drawGroup(string &usernames)
+{
+    size_t size = uniform_int_distribution<int>(1, maxGroup)(rng);
+    size_t home = uniform_int_distribution<size_t>(0, populations.size() - 1)(rng);
+    bool multi = false;
+    for (size_t i = 0; i < size; i++)
+    {
+        size_t from = home;
+        if (populations.size() > 1 && uniform_real_distribution<double>(0, 1)(rng) < crossFraction)
+        {
+            from = (home + uniform_int_distribution<size_t>(1, populations.size() - 1)(rng)) % populations.size();
+            multi = true;
+        }
+        if (i > 0)
+        {
+            usernames += ' ';
+        }
+        usernames += drawUser(populations[from]);
+    }
+    return multi;
+}
+
+// Draws a request, a group or a batch of them, and writes its frame into out. Returns true if the users of a group come
+// from several data files.
+bool drawRequest(string &out)
+{
+    string usernames;
+    bool multi = false;
+    for (int g = 0; g < max(batchSize, 1); g++)
+    {
+        multi = drawGroup(usernames) || multi;
+        if (batchSize > 0)
+        {
+            usernames += BATCH_SEPARATOR;
+        }
+    }
+    out.resize(FRAME_HEADER_SIZE);
+    if (batchSize > 0 || slotFilter.restricts())
+    {
+        packFrameHeader(&out[0], batchSize > 0 ? OP_BATCH_REQUEST : OP_SLOT_REQUEST, SLOT_FILTER_SIZE + usernames.size());
+        out.resize(FRAME_HEADER_SIZE + SLOT_FILTER_SIZE);
+        encodeSlotFilter(slotFilter, &out[FRAME_HEADER_SIZE]);
+    }
+    else
+    {
+        packFrameHeader(&out[0], OP_SCHEDULE_REQUEST, usernames.size());
+    }
+    out += usernames;
+    return multi;
+}
+
+// Repurposed from Beej’s socket programming tutorial
+int connectToServer()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == FAIL)
+    {
+        perror("Error creating socket");
+        exit(1);
+    }
+    struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof server_address);
+    server_address.sin_family = AF_INET;
+    server_address.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &server_address.sin_addr) <= 0)
+    {
+        cerr << "Invalid IP address format" << endl;
+        exit(1);
+    }
+    if (connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) == FAIL)
+    {
+        perror("Error connecting to server");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+void closeConnection(Connection &conn)
+{
+    errors++;
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, conn.fd, NULL);
+    close(conn.fd);
+    conn.fd = FAIL;
+    conn.busy = false;
+}
+
+// Sends what is left of the request; waits for the socket to be writable again if it does not all fit
+void flushRequest(Connection &conn, size_t index)
+{
+    while (!conn.outbuf.empty())
+    {
+        ssize_t sent = send(conn.fd, conn.outbuf.data(), conn.outbuf.size(), MSG_NOSIGNAL);
+        if (sent == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT;
+                event.data.u64 = index;
+                epoll_ctl(epollFD, EPOLL_CTL_MOD, conn.fd, &event);
+                return;
+            }
+            closeConnection(conn);
+            return;
+        }
+        conn.outbuf.erase(0, sent);
+    }
+}
+
+void sendRequest(size_t index, chrono::steady_clock::time_point due)
+{
+    Connection &conn = connections[index];
+    conn.multi = drawRequest(conn.outbuf);
+    conn.due = due;
+    conn.busy = true;
+    flushRequest(conn, index);
+}
+
+// Reads what the socket has; returns true once a whole reply frame has arrived, which is then consumed
+bool readReply(Connection &conn)
+{
+    char buffer[65536];
+    while (true)
+    {
+        ssize_t received = recv(conn.fd, buffer, sizeof buffer, 0);
+        if (received > 0)
+        {
+            conn.inbuf.append(buffer, received);
+            continue;
+        }
+        if (received == FAIL && errno == EINTR)
+        {
+            continue;
+        }
+        if (received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            closeConnection(conn);
+            return false;
+        }
+        break;
+    }
+    if (conn.inbuf.size() < FRAME_HEADER_SIZE)
+    {
+        return false;
+    }
+    FrameHeader header;
+    if (!unpackFrameHeader(conn.inbuf.data(), header) || header.opcode != (batchSize > 0 ? OP_BATCH_REPLY : OP_SCHEDULE_REPLY))
+    {
+        closeConnection(conn);
+        return false;
+    }
+    if (conn.inbuf.size() < FRAME_HEADER_SIZE + header.length)
+    {
+        return false;
+    }
+    // The fourth and fifth sections of the reply to every group name the usernames whose backend server did not answer and
+    // the ones whose result was too large to send
+    const char *p = conn.inbuf.data() + FRAME_HEADER_SIZE;
+    const char *end = p + header.length;
+    string section;
+    bool group_incomplete = false;
+    for (int i = 0; p < end && readSection(p, end, section); i++)
+    {
+        group_incomplete |= i % REPLY_SECTIONS >= 3 && !section.empty();
+        if (i % REPLY_SECTIONS == REPLY_SECTIONS - 1)
+        {
+            incomplete += group_incomplete;
+            group_incomplete = false;
+        }
+    }
+    conn.inbuf.erase(0, FRAME_HEADER_SIZE + header.length);
+    return true;
+}
+
+void armTimer(int timerFD, chrono::steady_clock::time_point when)
+{
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(when.time_since_epoch()).count();
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof spec);
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    {
+        spec.it_value.tv_nsec = 1; // zero would disarm the timer
+    }
+    timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+void printLatencies(const char *label, const LatencyHistogram &histogram)
+{
+    if (histogram.total == 0)
+    {
+        printf("%-24s none\n", label);
+        return;
+    }
+    printf("%-24s %9llu requests  mean %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  p99.9 %8.1f  max %8.1f us\n", label,
+           (unsigned long long)histogram.total, histogram.mean() / 1000, histogram.percentile(50) / 1000.0, histogram.percentile(90) / 1000.0,
+           histogram.percentile(99) / 1000.0, histogram.percentile(99.9) / 1000.0, histogram.max / 1000.0);
+}
+
+void usage(const char *program)
+{
+    cerr << "Usage: " << program << " [-f data file]... [-h host] [-p port] [-c connections] [-d seconds] [-w warmup seconds]" << endl
+         << "       [-r requests per second, 0 for closed loop] [-g max group size] [-z zipf exponent] [-x cross-file fraction]" << endl
+         << "       [-S seed] [-o histogram file] [-m min slot duration] [-l max slots] [-b groups per batch]" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    vector<string> files;
+    uint64_t seed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:h:p:c:d:w:r:g:z:x:S:o:m:l:b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'f':
+            files.push_back(optarg);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            connectionCount = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'w':
+            warmup = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'g':
+            maxGroup = atoi(optarg);
+            break;
+        case 'z':
+            zipfExponent = atof(optarg);
+            break;
+        case 'x':
+            crossFraction = atof(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'o':
+            histogramFile = optarg;
+            break;
+        case 'm':
+            slotFilter.minDuration = atoi(optarg);
+            break;
+        case 'l':
+            slotFilter.limit = strtoul(optarg, NULL, 10);
+            break;
+        case 'b':
+            batchSize = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (connectionCount < 1 || maxGroup < 1 || duration <= 0 || rate < 0 || batchSize < 0)
+    {
+        usage(argv[0]);
+    }
+    if (files.empty())
+    {
+        files = {"a.txt", "b.txt"};
+    }
+    rng.seed(seed);
+
+    size_t users = 0;
+    for (const string &file : files)
+    {
+        Population population;
+        if (!loadPopulation(file, population))
+        {
+            cerr << "Error: no users in " << file << endl;
+            return 1;
+        }
+        users += population.names.size();
+        populations.push_back(move(population));
+    }
+
+    epollFD = epoll_create1(0);
+    if (epollFD == FAIL)
+    {
+        perror("epoll_create1");
+        return 1;
+    }
+    connections.resize(connectionCount);
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+        connections[i].fd = connectToServer();
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = i;
+        epoll_ctl(epollFD, EPOLL_CTL_ADD, connections[i].fd, &event);
+    }
+    int timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event timer_event;
+    timer_event.events = EPOLLIN;
+    timer_event.data.u64 = UINT64_MAX;
+    epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &timer_event);
+
+    printf("%d connections, %s, %.0f s after %.0f s warmup; groups of 1-%d users, Zipf %.2f over %zu users in %zu files, %.0f%% cross-file\n",
+           connectionCount, rate > 0 ? ("open loop at " + to_string((long long)rate) + " requests/s").c_str() : "closed loop", duration, warmup,
+           maxGroup, zipfExponent, users, files.size(), crossFraction * 100);
+    fflush(stdout);
+
+    auto start = chrono::steady_clock::now();
+    auto measureFrom = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(warmup));
+    auto end = measureFrom + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(duration));
+    auto interval = rate > 0 ? chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(1.0 / rate)) : chrono::steady_clock::duration(0);
+    auto nextDue = start;
+    deque<chrono::steady_clock::time_point> backlog; // open loop: requests that are due but found no idle connection
+    vector<size_t> idle;
+
+    if (rate > 0)
+    {
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            idle.push_back(i);
+        }
+        armTimer(timerFD, nextDue);
+    }
+    else
+    {
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            sendRequest(i, start);
+        }
+        armTimer(timerFD, end);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true)
+    {
+        int ready = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if (ready == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            return 1;
+        }
+        auto now = chrono::steady_clock::now();
+        if (now >= end)
+        {
+            break;
+        }
+        for (int e = 0; e < ready; e++)
+        {
+            size_t index = events[e].data.u64;
+            if (index == UINT64_MAX)
+            {
+                uint64_t expirations;
+                while (read(timerFD, &expirations, sizeof expirations) > 0)
+                {
+                }
+                // Everything that has fallen due since the last tick
+                while (rate > 0 && nextDue <= now)
+                {
+                    backlog.push_back(nextDue);
+                    nextDue += interval;
+                }
+                continue;
+            }
+            Connection &conn = connections[index];
+            if (conn.fd == FAIL)
+            {
+                continue;
+            }
+            if (events[e].events & EPOLLOUT)
+            {
+                flushRequest(conn, index);
+                if (conn.fd != FAIL && conn.outbuf.empty())
+                {
+                    struct epoll_event event;
+                    event.events = EPOLLIN;
+                    event.data.u64 = index;
+                    epoll_ctl(epollFD, EPOLL_CTL_MOD, conn.fd, &event);
+                }
+            }
+            if (!(events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) || !readReply(conn))
+            {
+                continue;
+            }
+            conn.busy = false;
+            if (now >= measureFrom)
+            {
+                uint64_t latency = chrono::duration_cast<chrono::nanoseconds>(now - conn.due).count();
+                (conn.multi ? multiLatency : singleLatency).record(latency);
+            }
+            if (rate > 0)
+            {
+                idle.push_back(index);
+            }
+            else
+            {
+                sendRequest(index, now);
+            }
+        }
+        if (rate > 0)
+        {
+            maxBacklog = max(maxBacklog, backlog.size());
+            while (!backlog.empty() && !idle.empty())
+            {
+                size_t index = idle.back();
+                idle.pop_back();
+                if (connections[index].fd == FAIL)
+                {
+                    continue;
+                }
+                sendRequest(index, backlog.front());
+                backlog.pop_front();
+            }
+            armTimer(timerFD, min(nextDue, end));
+        }
+        bool any_open = false;
+        for (const Connection &conn : connections)
+        {
+            any_open = any_open || conn.fd != FAIL;
+        }
+        if (!any_open)
+        {
+            cerr << "Error: Main Server closed every connection" << endl;
+            break;
+        }
+    }
+
+    LatencyHistogram all;
+    all.merge(singleLatency);
+    all.merge(multiLatency);
+    printf("%llu requests in %.1f s: %.0f requests/s, %llu errors, %llu incomplete\n", (unsigned long long)all.total, duration,
+           all.total / duration, (unsigned long long)errors, (unsigned long long)incomplete);
+    if (batchSize > 0)
+    {
+        printf("%d groups per batch: %.0f groups/s\n", batchSize, all.total * batchSize / duration);
+    }
+    printLatencies("all", all);
+    printLatencies("single data file", singleLatency);
+    printLatencies("several data files", multiLatency);
+    if (rate > 0)
+    {
+        printf("largest backlog of due requests without an idle connection: %zu\n", maxBacklog);
+    }
+    if (!histogramFile.empty())
+    {
+        FILE *out = fopen(histogramFile.c_str(), "w");
+        if (out == NULL)
+        {
+            perror(histogramFile.c_str());
+            return 1;
+        }
+        all.printDistribution(out, 1000.0);
+        fclose(out);
+    }
+    return 0;
+}
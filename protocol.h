@@ -0,0 +1,345 @@
+/*
+Author: Rajnandini Thopte
+
+protocol.h
+
+Message formats shared by the client, the main server and the backend servers. Every UDP datagram starts with a small fixed
+header that carries a request ID, an opcode and the payload length. The backend servers echo the request ID of a query in
+their reply so that the main server can keep many queries in flight per backend server and match the replies in any order.
+On TCP every message between the client and the main server is a frame: a length header followed by the payload.
+*/
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "intervals.h"
+
+#define MAX_DATAGRAM_SIZE 65507 // largest UDP payload over IPv4
+
+// Opcodes
+#define OP_USERLIST 1     // backend -> main server: one chunk of the usernames stored in the backend, the request ID is the chunk number (Phase 1)
+#define OP_QUERY 2        // main server -> backend: usernames to intersect (Phase 2)
+#define OP_RESULT 3       // backend -> main server: intersection result (Phase 3)
+#define OP_USERLIST_ACK 4 // main server -> backend: the request ID is the number of username list chunks received in order (Phase 1)
+#define OP_DELTA 5        // backend -> main server: one chunk of the users that changed in a reload, the request ID is the chunk number
+#define OP_DELTA_ACK 6    // main server -> backend: the request ID is the number of chunks of the delta with this version received in order
+#define OP_PING 7         // main server -> backend: health probe of a replica
+#define OP_PONG 8         // backend -> main server: answer to a health probe, with its request ID
+#define OP_BATCH_QUERY 9  // main server -> backend: subgroups of usernames to intersect, each ended by BATCH_SEPARATOR
+#define OP_BATCH_RESULT 10 // backend -> main server: the binary results of some of the subgroups of a batch query, see answerBatch
+#define OP_FREE_QUERY 11  // main server -> backend: a free window followed by the candidate usernames, none for every user
+#define OP_FREE_RESULT 12 // backend -> main server: one chunk of the users free for the window, see answerFree
+
+// Flags
+#define FLAG_BINARY_INTERVALS 0x0001 // query: the main server accepts binary intervals; result: the payload is binary
+#define FLAG_LAST_CHUNK 0x0002       // username list, free users: this chunk completes the list
+#define FLAG_SLOT_FILTER 0x0004      // query: the payload starts with a slot filter, see encodeSlotFilter
+#define FLAG_TOO_LARGE 0x0008        // result: the intersection does not fit in a datagram, the payload is empty
+
+#define BATCH_SEPARATOR ';' // ends a group of usernames in a batch request and a subgroup in a batch query
+
+// All fields are sent in network byte order
+struct MessageHeader
+{
+    uint32_t request_id;
+    uint16_t opcode;
+    uint16_t flags;
+    uint32_t length;  // number of payload bytes that follow the header
+    uint32_t version; // backend -> main server: version of the backend's data, changes whenever its data changes
+};
+
+#define HEADER_SIZE sizeof(MessageHeader)
+
+// Writes a header announcing length payload bytes into out
+inline void packHeader(char *out, uint32_t request_id, uint16_t opcode, uint16_t flags, uint32_t length, uint32_t version = 0)
+{
+    MessageHeader header;
+    header.request_id = htonl(request_id);
+    header.opcode = htons(opcode);
+    header.flags = htons(flags);
+    header.length = htonl(length);
+    header.version = htonl(version);
+    memcpy(out, &header, HEADER_SIZE);
+}
+
+// Writes the header followed by the payload into out, which must hold HEADER_SIZE + length bytes.
+// Returns the number of bytes to send.
+inline size_t packMessage(char *out, uint32_t request_id, uint16_t opcode, uint16_t flags, const char *payload, uint32_t length, uint32_t version = 0)
+{
+    packHeader(out, request_id, opcode, flags, length, version);
+    if (length > 0)
+    {
+        memcpy(out + HEADER_SIZE, payload, length);
+    }
+    return HEADER_SIZE + length;
+}
+
+// Reads the header of a received datagram. Returns false if the datagram is too short for the length it announces.
+inline bool unpackHeader(const char *buffer, size_t received, MessageHeader &header)
+{
+    if (received < HEADER_SIZE)
+    {
+        return false;
+    }
+    memcpy(&header, buffer, HEADER_SIZE);
+    header.request_id = ntohl(header.request_id);
+    header.opcode = ntohs(header.opcode);
+    header.flags = ntohs(header.flags);
+    header.length = ntohl(header.length);
+    header.version = ntohl(header.version);
+    return header.length <= received - HEADER_SIZE;
+}
+
+/*
+Binary interval encoding. A result is a little-endian uint32 count followed by count (start, end) pairs of little-endian
+int32. The main server asks for it by setting FLAG_BINARY_INTERVALS on a query and a backend server that supports it
+sets the same flag on its result; otherwise the result is the "[start, end] " text format.
+*/
+inline void storeLE32(char *out, uint32_t value)
+{
+    unsigned char bytes[4] = {(unsigned char)value, (unsigned char)(value >> 8), (unsigned char)(value >> 16), (unsigned char)(value >> 24)};
+    memcpy(out, bytes, 4);
+}
+
+inline uint32_t loadLE32(const char *in)
+{
+    unsigned char bytes[4];
+    memcpy(bytes, in, 4);
+    return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// Count of a subgroup result in an OP_BATCH_RESULT that is too large for a datagram; no intervals follow it
+#define RESULT_TOO_LARGE 0xFFFFFFFFu
+
+inline size_t encodedIntervalsSize(size_t count)
+{
+    return 4 + count * 8;
+}
+
+// Writes the intervals into out, which must hold encodedIntervalsSize(intervals.size()) bytes. Returns the bytes written.
+inline size_t encodeIntervals(const std::vector<std::pair<int, int>> &intervals, char *out)
+{
+    storeLE32(out, (uint32_t)intervals.size());
+    char *p = out + 4;
+    for (const auto &interval : intervals)
+    {
+        storeLE32(p, (uint32_t)interval.first);
+        storeLE32(p + 4, (uint32_t)interval.second);
+        p += 8;
+    }
+    return p - out;
+}
+
+// Reads a binary interval payload straight out of the receive buffer. Returns false if the payload is truncated.
+inline bool decodeIntervals(const char *payload, size_t length, std::vector<std::pair<int, int>> &intervals)
+{
+    if (length < 4)
+    {
+        return false;
+    }
+    uint32_t count = loadLE32(payload);
+    if (count > (length - 4) / 8)
+    {
+        return false;
+    }
+    intervals.resize(count);
+    const char *p = payload + 4;
+    for (uint32_t i = 0; i < count; i++, p += 8)
+    {
+        intervals[i].first = (int32_t)loadLE32(p);
+        intervals[i].second = (int32_t)loadLE32(p + 4);
+    }
+    return true;
+}
+
+/*
+Slot filter of an earliest-slot query, SLOT_FILTER_SIZE bytes in front of its usernames: the minimum duration, the end of
+the window, the limit and the start of the window as little-endian 32-bit integers, in that order.
+*/
+#define SLOT_FILTER_SIZE 16
+
+inline void encodeSlotFilter(const SlotFilter &filter, char *out)
+{
+    storeLE32(out, (uint32_t)filter.minDuration);
+    storeLE32(out + 4, (uint32_t)filter.horizon);
+    storeLE32(out + 8, filter.limit);
+    storeLE32(out + 12, (uint32_t)filter.from);
+}
+
+// Returns false if the payload is too short to hold a slot filter
+inline bool decodeSlotFilter(const char *payload, size_t length, SlotFilter &filter)
+{
+    if (length < SLOT_FILTER_SIZE)
+    {
+        return false;
+    }
+    filter.minDuration = (int32_t)loadLE32(payload);
+    filter.horizon = (int32_t)loadLE32(payload + 4);
+    filter.limit = loadLE32(payload + 8);
+    filter.from = (int32_t)loadLE32(payload + 12);
+    return true;
+}
+
+/*
+Window of a reverse query, FREE_WINDOW_SIZE bytes in front of its candidate usernames: the users free for the whole of
+[start, end) are wanted, only the limit of them lowest in name order (0 for all). The start, the end and the limit are
+little-endian 32-bit integers, in that order.
+*/
+#define FREE_WINDOW_SIZE 12
+
+struct FreeWindow
+{
+    int start = 0;
+    int end = 0;
+    uint32_t limit = 0;
+};
+
+inline void encodeFreeWindow(const FreeWindow &window, char *out)
+{
+    storeLE32(out, (uint32_t)window.start);
+    storeLE32(out + 4, (uint32_t)window.end);
+    storeLE32(out + 8, window.limit);
+}
+
+// Returns false if the payload is too short to hold a window or the window is empty
+inline bool decodeFreeWindow(const char *payload, size_t length, FreeWindow &window)
+{
+    if (length < FREE_WINDOW_SIZE)
+    {
+        return false;
+    }
+    window.start = (int32_t)loadLE32(payload);
+    window.end = (int32_t)loadLE32(payload + 4);
+    window.limit = loadLE32(payload + 8);
+    return window.start < window.end;
+}
+
+// Text form used in log messages and by backend servers that do not speak the binary encoding
+inline std::string formatIntervals(const std::vector<std::pair<int, int>> &intervals)
+{
+    if (intervals.empty())
+    {
+        return "[]";
+    }
+    std::string str;
+    for (const auto &interval : intervals)
+    {
+        str += "[" + std::to_string(interval.first) + ", " + std::to_string(interval.second) + "] ";
+    }
+    return str;
+}
+
+/*
+In this function we parse an intersection result in the text format, as the Main Server receives it from a backend server.
+It is only used for backend servers that did not answer in the binary encoding. The receive buffer is left untouched.
+*/
+inline std::vector<std::pair<int, int>> ParseIntervals(const char *buffer, size_t length)
+{
+    std::vector<std::pair<int, int>> intervals;
+    const char *p = buffer;
+    const char *end = buffer + length;
+    while ((p = (const char *)memchr(p, '[', end - p)) != NULL)
+    {
+        char *after;
+        long start = strtol(p + 1, &after, 10);
+        if (after == p + 1)
+        {
+            p++; // "[]"
+            continue;
+        }
+        const char *comma = (const char *)memchr(after, ',', end - after);
+        if (comma == NULL)
+        {
+            break;
+        }
+        long stop = strtol(comma + 1, &after, 10);
+        intervals.emplace_back((int)start, (int)stop);
+        p = after;
+    }
+    return intervals;
+}
+
+/*
+TCP framing between the client and the main server. A frame is a header with the payload length and an opcode followed
+by the payload. A reply payload is a sequence of sections, each a uint32 length in network byte order followed by its bytes,
+so the whole reply can be read with one or two bulk reads and sent with a single writev.
+*/
+#define OP_SCHEDULE_REQUEST 16 // client -> main server: space separated usernames
+#define OP_SCHEDULE_REPLY 17   // main server -> client: the REPLY_SECTIONS sections of a reply to one group of usernames
+#define OP_STATS_REQUEST 18    // client -> main server: no payload
+#define OP_STATS_REPLY 19      // main server -> client: one section with the counters and phase latencies as text
+#define OP_SLOT_REQUEST 20     // client -> main server: a slot filter followed by space separated usernames, answered like a schedule request
+#define OP_BATCH_REQUEST 21    // client -> main server: a slot filter followed by groups of usernames, each ended by BATCH_SEPARATOR
+#define OP_BATCH_REPLY 22      // main server -> client: the REPLY_SECTIONS sections of a schedule reply for every group, in order
+#define OP_FREE_REQUEST 23     // client -> main server: a free window followed by space separated candidate usernames, none for everyone
+#define OP_FREE_REPLY 24       // main server -> client: users free, candidates that do not exist, servers that did not answer, number free
+
+#define MAX_FRAME_SIZE (16 * 1024 * 1024)
+
+// The reply to a group of usernames: the intervals, the usernames that do not exist, the usernames found, the usernames
+// whose backend server did not answer and the usernames whose intersection result was too large to send
+#define REPLY_SECTIONS 5
+
+struct FrameHeader
+{
+    uint32_t length; // number of payload bytes that follow the header
+    uint16_t opcode;
+    uint16_t flags;
+};
+
+#define FRAME_HEADER_SIZE sizeof(FrameHeader)
+
+inline void packFrameHeader(char *out, uint16_t opcode, uint32_t length)
+{
+    FrameHeader header;
+    header.length = htonl(length);
+    header.opcode = htons(opcode);
+    header.flags = 0;
+    memcpy(out, &header, FRAME_HEADER_SIZE);
+}
+
+// Returns false if the frame announces more than MAX_FRAME_SIZE bytes
+inline bool unpackFrameHeader(const char *buffer, FrameHeader &header)
+{
+    memcpy(&header, buffer, FRAME_HEADER_SIZE);
+    header.length = ntohl(header.length);
+    header.opcode = ntohs(header.opcode);
+    header.flags = ntohs(header.flags);
+    return header.length <= MAX_FRAME_SIZE;
+}
+
+inline void appendSection(std::string &payload, const std::string &section)
+{
+    uint32_t length = htonl((uint32_t)section.size());
+    payload.append((const char *)&length, 4);
+    payload += section;
+}
+
+// Reads the next section and advances p past it. Returns false if the payload ends early.
+inline bool readSection(const char *&p, const char *end, std::string &section)
+{
+    if (end - p < 4)
+    {
+        return false;
+    }
+    uint32_t length;
+    memcpy(&length, p, 4);
+    length = ntohl(length);
+    if ((size_t)(end - p - 4) < length)
+    {
+        return false;
+    }
+    section.assign(p + 4, length);
+    p += 4 + length;
+    return true;
+}
+
+#endif
@@ -0,0 +1,372 @@
+/*
+Author: Rajnandini Thopte
+
+query.h
+
+The query path of a backend server. answerQuery answers one OP_QUERY datagram from the shard's data and writes the reply
+straight into the buffer it is sent from; answerBatch does the same for the subgroups of an OP_BATCH_QUERY and answerFree
+for the reverse OP_FREE_QUERY, which asks which users are free for a window. Everything else a query needs lives in a QueryArena that a worker reuses for all
+of its queries: the usernames are string_views into the received datagram, the users' availability is referenced through
+spans into the user table and the text form of a result is written without building strings. Once the arena's vectors have
+grown to the largest query seen, answering a query does not touch the heap; bench.cpp checks that with its allocation counter.
+*/
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <string_view>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "protocol.h"
+#include "intervals.h"
+#include "bitmap.h"
+#include "usertable.h"
+#include "freeindex.h"
+
+// One version of the data of a backend server. Queries only read it, so every worker answers from the same one.
+struct ShardData
+{
+    UserTable database;
+    BitmapSet bitmaps;
+    std::vector<uint32_t> userBitmap; // with -b, the index in bitmaps of every user's bitmap
+    FreeIndex freeIndex;              // every user's intervals, for reverse queries over the whole shard
+    uint32_t version = 0;             // version of the availability data, sent with every message to Main Server
+    struct stat source;               // the data file as it was when loaded
+};
+
+// Gives every user whose availability fits in [0, domain) a bitmap. Returns the number of users that got one.
+inline size_t buildBitmaps(ShardData &data, int domain)
+{
+    data.bitmaps.init(domain);
+    data.userBitmap.resize(data.database.size());
+    size_t built = 0;
+    for (uint32_t user = 0; user < data.database.size(); user++)
+    {
+        data.userBitmap[user] = data.bitmaps.add(data.database.availability(user));
+        built += (data.userBitmap[user] != NO_BITMAP);
+    }
+    return built;
+}
+
+// Scratch space of one worker. Every query clears it, but its capacity is kept for the next one.
+struct QueryArena
+{
+    std::vector<std::string_view> names;           // usernames of the query, pointing into the datagram
+    std::vector<std::string_view> missing;         // the usernames that are not in the user table
+    std::vector<uint32_t> users;                   // the users that are
+    std::vector<IntervalSpan> spans;               // their availability, pointing into the user table
+    std::vector<const uint64_t *> bitmaps;         // their bitmaps, if every one of them has one
+    std::vector<uint64_t> common;                  // AND of the bitmaps
+    std::vector<size_t> positions;                 // sweep positions of groups of more than 16 users
+    std::vector<std::pair<int, int>> intersection; // common availability of the users
+};
+
+// Splits the space separated usernames of a query into views of the text, skipping empty ones
+inline void splitNames(const char *text, size_t length, std::vector<std::string_view> &names)
+{
+    names.clear();
+    const char *end = text + length;
+    while (text < end)
+    {
+        const char *space = static_cast<const char *>(memchr(text, ' ', end - text));
+        const char *name_end = space != NULL ? space : end;
+        if (name_end > text)
+        {
+            names.emplace_back(text, name_end - text);
+        }
+        text = name_end + 1;
+    }
+}
+
+// Writes the decimal digits of value at out and returns the position after them
+inline char *writeInt(char *out, int value)
+{
+    char digits[12];
+    int n = 0;
+    unsigned int magnitude = value < 0 ? -(unsigned int)value : (unsigned int)value;
+    do
+    {
+        digits[n++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+    {
+        *out++ = '-';
+    }
+    while (n > 0)
+    {
+        *out++ = digits[--n];
+    }
+    return out;
+}
+
+// Writes the text form of a result, "[1, 10] [11, 12] " or "[]" if it is empty. Returns the number of bytes written, or 0 if
+// they do not fit in capacity.
+inline size_t writeIntervalsText(const std::vector<std::pair<int, int>> &intervals, char *out, size_t capacity)
+{
+    if (intervals.empty())
+    {
+        if (capacity < 2)
+        {
+            return 0;
+        }
+        memcpy(out, "[]", 2);
+        return 2;
+    }
+    const size_t longest = 28; // "[-2147483648, -2147483648] "
+    char *p = out;
+    for (const auto &interval : intervals)
+    {
+        if ((size_t)(p - out) + longest > capacity)
+        {
+            return 0;
+        }
+        *p++ = '[';
+        p = writeInt(p, interval.first);
+        *p++ = ',';
+        *p++ = ' ';
+        p = writeInt(p, interval.second);
+        *p++ = ']';
+        *p++ = ' ';
+    }
+    return p - out;
+}
+
+/*
+Looks up the usernames in arena.names and intersects the availability of the users found with the bitmaps or the sweep,
+whichever is cheaper for them, keeping only the slots filter lets through. The users found, the usernames missing and the
+intersection are left in arena.
+*/
+inline void intersectNames(const ShardData &data, const SlotFilter &filter, QueryArena &arena)
+{
+    const UserTable &database = data.database;
+    arena.missing.clear();
+    arena.users.clear();
+    arena.spans.clear();
+    arena.bitmaps.clear();
+    size_t total_intervals = 0;
+    for (std::string_view name : arena.names)
+    {
+        uint32_t located = database.find(name.data(), name.size());
+        if (located == NOT_FOUND)
+        {
+            arena.missing.push_back(name);
+            continue;
+        }
+        arena.users.push_back(located);
+        arena.spans.push_back(database.availability(located));
+        total_intervals += arena.spans.back().size;
+        if (!data.userBitmap.empty() && data.userBitmap[located] != NO_BITMAP)
+        {
+            arena.bitmaps.push_back(data.bitmaps.row(data.userBitmap[located]));
+        }
+    }
+
+    // AND the bitmaps if every user has one and the interval lists are long compared to the domain, otherwise sweep. A window
+    // narrows both about equally, so the choice is made on the whole calendars: the sweep binary-searches the lists down to
+    // the window, and of the bitmaps only the blocks of words in it are ANDed and scanned.
+    size_t k = arena.spans.size();
+    const size_t block_bits = 64 * BITMAP_BLOCK_WORDS;
+    size_t words = data.bitmaps.words;
+    size_t first = 0;
+    if (filter.horizon != INT_MAX)
+    {
+        words = std::min(words, filter.horizon <= 0 ? 0 : ((size_t)filter.horizon + block_bits - 1) / block_bits * BITMAP_BLOCK_WORDS);
+    }
+    if (filter.from > 0)
+    {
+        first = std::min(words, (size_t)filter.from / block_bits * BITMAP_BLOCK_WORDS);
+    }
+    if (k > 1 && arena.bitmaps.size() == k && preferBitmap(k, data.bitmaps.words, total_intervals))
+    {
+        for (const uint64_t *&row : arena.bitmaps)
+        {
+            row += first;
+        }
+        arena.common.resize(words);
+        andBitmaps(arena.bitmaps.data(), k, words - first, arena.common.data() + first);
+        bitmapToIntervals(arena.common.data(), words, arena.intersection, filter, first);
+    }
+    else
+    {
+        intersectIntervals(arena.spans.data(), k, arena.intersection, &arena.positions, filter);
+    }
+}
+
+/*
+Answers the query whose header and payload are given from data and writes the OP_RESULT reply into out, which holds
+MAX_DATAGRAM_SIZE bytes. The reply is binary if the query asked for it. An earliest-slot query only gets the slots its
+filter lets through. The users found, the usernames missing and the intersection are left in arena. Returns the size of
+the reply, or 0 if the result does not fit in one datagram.
+*/
+inline size_t answerQuery(const ShardData &data, const MessageHeader &header, const char *payload, QueryArena &arena, char *out)
+{
+    SlotFilter filter;
+    size_t names_length = header.length;
+    if ((header.flags & FLAG_SLOT_FILTER) && decodeSlotFilter(payload, header.length, filter))
+    {
+        payload += SLOT_FILTER_SIZE;
+        names_length -= SLOT_FILTER_SIZE;
+    }
+    splitNames(payload, names_length, arena.names);
+    intersectNames(data, filter, arena);
+
+    size_t length;
+    uint16_t flags = 0;
+    if (header.flags & FLAG_BINARY_INTERVALS)
+    {
+        if (HEADER_SIZE + encodedIntervalsSize(arena.intersection.size()) > MAX_DATAGRAM_SIZE)
+        {
+            return 0;
+        }
+        length = encodeIntervals(arena.intersection, out + HEADER_SIZE);
+        flags = FLAG_BINARY_INTERVALS;
+    }
+    else
+    {
+        length = writeIntervalsText(arena.intersection, out + HEADER_SIZE, MAX_DATAGRAM_SIZE - HEADER_SIZE);
+        if (length == 0)
+        {
+            return 0;
+        }
+    }
+    packHeader(out, header.request_id, OP_RESULT, flags, length, data.version);
+    return HEADER_SIZE + length;
+}
+
+/*
+Answers an OP_BATCH_QUERY: every subgroup of usernames in it is intersected like the usernames of a query, and the results
+are written as OP_BATCH_RESULT datagrams, each holding the results of as many subgroups in a row as fit. out holds
+MAX_DATAGRAM_SIZE bytes; every datagram that is complete is handed to emit(size), which returns the buffer to write the next
+one into. A subgroup whose result does not fit in a datagram on its own gets the count RESULT_TOO_LARGE instead, so Main
+Server knows at once that it will not come, and is counted in oversized. Returns the number of subgroups in the batch.
+*/
+template <typename Emit>
+inline size_t answerBatch(const ShardData &data, const MessageHeader &header, const char *payload, QueryArena &arena, char *out,
+                          Emit &&emit, size_t &oversized)
+{
+    SlotFilter filter;
+    const char *end = payload + header.length;
+    if ((header.flags & FLAG_SLOT_FILTER) && decodeSlotFilter(payload, header.length, filter))
+    {
+        payload += SLOT_FILTER_SIZE;
+    }
+
+    uint32_t subgroup = 0;
+    size_t length = 0; // of the payload of the datagram being written, 0 before its first result
+    oversized = 0;
+    while (payload < end)
+    {
+        const char *separator = static_cast<const char *>(memchr(payload, BATCH_SEPARATOR, end - payload));
+        const char *names_end = separator != NULL ? separator : end;
+        splitNames(payload, names_end - payload, arena.names);
+        payload = names_end + 1;
+        intersectNames(data, filter, arena);
+
+        size_t size = encodedIntervalsSize(arena.intersection.size());
+        bool too_large = HEADER_SIZE + 4 + size > MAX_DATAGRAM_SIZE;
+        if (too_large)
+        {
+            size = 4;
+        }
+        if (length > 0 && HEADER_SIZE + length + size > MAX_DATAGRAM_SIZE)
+        {
+            packHeader(out, header.request_id, OP_BATCH_RESULT, FLAG_BINARY_INTERVALS, length, data.version);
+            out = emit(HEADER_SIZE + length);
+            length = 0;
+        }
+        if (length == 0)
+        {
+            storeLE32(out + HEADER_SIZE, subgroup);
+            length = 4;
+        }
+        if (too_large)
+        {
+            oversized++;
+            storeLE32(out + HEADER_SIZE + length, RESULT_TOO_LARGE);
+            length += 4;
+        }
+        else
+        {
+            length += encodeIntervals(arena.intersection, out + HEADER_SIZE + length);
+        }
+        subgroup++;
+    }
+    if (length > 0)
+    {
+        packHeader(out, header.request_id, OP_BATCH_RESULT, FLAG_BINARY_INTERVALS, length, data.version);
+        emit(HEADER_SIZE + length);
+    }
+    return subgroup;
+}
+
+/*
+Answers an OP_FREE_QUERY: the users free for the whole of its window, and with a limit only the limit of them lowest in name
+order, so that the union Main Server cuts to the limit again is the lowest of all shards. Without candidate usernames every
+user of the shard is considered, through data.freeIndex; with them, each candidate found is checked on its own with a
+binary search of its availability. Candidates that are not in the user table are skipped, Main Server knows them already.
+The usernames are written space separated as OP_FREE_RESULT datagrams, each starting with its chunk number as a little-endian
+32-bit integer; the last one, sent even if no user is free, carries FLAG_LAST_CHUNK. out and emit work as in answerBatch.
+The users free are left in arena.users. Returns their number.
+*/
+template <typename Emit>
+inline size_t answerFree(const ShardData &data, const MessageHeader &header, const char *payload, QueryArena &arena, char *out, Emit &&emit)
+{
+    FreeWindow window;
+    arena.users.clear();
+    if (decodeFreeWindow(payload, header.length, window))
+    {
+        splitNames(payload + FREE_WINDOW_SIZE, header.length - FREE_WINDOW_SIZE, arena.names);
+        if (arena.names.empty())
+        {
+            data.freeIndex.findFree(window.start, window.end, arena.users);
+        }
+        for (std::string_view name : arena.names)
+        {
+            uint32_t located = data.database.find(name.data(), name.size());
+            if (located != NOT_FOUND && coversWindow(data.database.availability(located), window.start, window.end))
+            {
+                arena.users.push_back(located);
+            }
+        }
+        if (window.limit > 0 && arena.users.size() > window.limit)
+        {
+            std::partial_sort(arena.users.begin(), arena.users.begin() + window.limit, arena.users.end(),
+                              [&](uint32_t a, uint32_t b) { return data.database.name(a) < data.database.name(b); });
+            arena.users.resize(window.limit);
+        }
+    }
+
+    uint32_t chunk = 0;
+    size_t length = 4; // of the payload of the datagram being written
+    storeLE32(out + HEADER_SIZE, chunk);
+    for (uint32_t user : arena.users)
+    {
+        std::string_view name = data.database.name(user);
+        if (length > 4 && HEADER_SIZE + length + 1 + name.size() > MAX_DATAGRAM_SIZE)
+        {
+            packHeader(out, header.request_id, OP_FREE_RESULT, 0, length, data.version);
+            out = emit(HEADER_SIZE + length);
+            storeLE32(out + HEADER_SIZE, ++chunk);
+            length = 4;
+        }
+        if (length > 4)
+        {
+            out[HEADER_SIZE + length++] = ' ';
+        }
+        memcpy(out + HEADER_SIZE + length, name.data(), name.size());
+        length += name.size();
+    }
+    packHeader(out, header.request_id, OP_FREE_RESULT, FLAG_LAST_CHUNK, length, data.version);
+    emit(HEADER_SIZE + length);
+    return arena.users.size();
+}
+
+#endif
@@ -3,12 +3,16 @@ Author: Rajnandini Thopte
 
 serverM.cpp
 
-This code is for the main server that handles requests from clients and also manages backend Servers A & B that store the users
-and their availabilities. It communicates with the client via TCP and with both backend servers via UDP. Once the main server
+This code is for the main server that handles requests from clients and also manages the backend servers that store the users
+and their availabilities. Each backend server holds one shard of the user base; by default there are two, Servers A & B.
+It communicates with the client via TCP and with the backend servers via UDP. Once the main server
 receives the request from client, it decides which backend server the participants’ availability is stored in and sends a request
-to the responsible backend server for the time intervals that works for all participants belonging to this backend server.
+to every responsible backend server for the time intervals that works for all participants belonging to this backend server.
 After the backend servers sends their respective intersection result back to the main server, it runs an algorithm
-to get the final time slots that works for all participants, and sends the result back to the client.
+to get the final time slots that works for all participants, and sends the result back to the client. A batch request
+carries many groups of participants; the usernames they need from each backend server go out in one query per server.
+A free request asks the other way round, which users are free for a whole window: every backend server involved answers it
+from an index of its users' intervals, and the main server merges the users they send back.
 */
 
 #include <iostream>
@@ -16,6 +20,14 @@ to get the final time slots that works for all participants, and sends the resul
 #include <string>
 #include <vector>
 #include <map>
+#include <list>
+#include <queue>
+#include <set>
+#include <unordered_set>
+#include <string_view>
+#include <chrono>
+#include <random>
+#include <unordered_map>
 #include <utility>
 #include <sstream>
 #include <stdio.h>
@@ -28,33 +40,281 @@ to get the final time slots that works for all participants, and sends the resul
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <signal.h>
 #include <cstring>
 #include <unistd.h>
 #include <algorithm>
 
+#include "protocol.h"
+#include "directory.h"
+#include "intervals.h"
+#include "histogram.h"
+#include "datagrams.h"
+
 #define SERVER_TCP_PORT 24463
 #define SERVERM_UDP 23463
-#define SERVER_A 21463
-#define SERVER_B 22463
-#define BUFFER_SIZE 10000
+#define DEFAULT_SHARD_A "A=127.0.0.1:21463"
+#define DEFAULT_SHARD_B "B=127.0.0.1:22463"
 #define LOCALHOST "127.0.0.1"
 #define FAIL -1
 #define MAX_USERNAME_LENGTH 20
-#define BACKLOG 10 // max number of incoming connections allowed
+#define BACKLOG SOMAXCONN // max number of pending connections allowed
+#define MAX_EVENTS 1024 // max number of epoll events handled per wakeup
+#define DEFAULT_CACHE_SIZE 1024 // max number of group results kept in the cache
+#define DEFAULT_CACHE_TTL 60    // seconds a cached group result stays valid
+#define UDP_RECEIVE_BUFFER (4 * 1024 * 1024) // room for the username list chunks of every backend server in flight
+#define DEFAULT_BACKEND_TIMEOUT_MS 100 // a query that is not answered within this is sent again
+#define DEFAULT_BACKEND_RETRIES 2      // times a query is sent again before its backend server counts as not answering
+#define HEDGE_PERCENTILE 95            // with -H, a query not answered within this percentile of its shard's round trips is sent twice
+#define HEDGE_REFRESH 256              // round trips of a shard the hedging delay is worked out from, before it is worked out again
+#define PROBE_INTERVAL_MS 200 // every replica of a shard with more than one is sent a health probe this often
+#define PROBE_MISSES 3        // health probes in a row a replica may leave unanswered before it is ejected
+#define LATENCY_WEIGHT 0.2    // weight of the latest round trip in the latency average of a replica
+#define MAX_FREE_CHUNKS 1024  // chunks of usernames a backend server may answer one free query with
+#define MAX_CLIENT_INPUT (2 * (FRAME_HEADER_SIZE + MAX_FRAME_SIZE)) // bytes a client may send ahead: the frame being answered and the next one
 
 int sockfd_UDP;
 int serverM_clientFD;// parent TCP socket
-int childSocketFD;// child TCP socket
+int epollFD;// epoll instance driving all client sockets
+int timerFD; // expires at the earliest deadline of the queries sent to the backend servers
 struct sockaddr_in serverM_client_addr; // serverM
 socklen_t len = 0;
 struct sockaddr_in destClient_addr; //parent listening socket
 struct sockaddr_in recvaddr;
-struct sockaddr_in sendaddrA;
-struct sockaddr_in recvaddrB;
-struct sockaddr_in sendaddrB;
 
 using namespace std;
 
+// One backend server process answering the queries of a shard. Every replica of a shard is loaded from the same data file.
+struct Replica
+{
+    string address; // host:port as given with -s
+    struct sockaddr_in addr;
+    bool healthy = true;    // answers its health probes; an ejected replica gets no queries while its shard has a healthy one
+    int missedProbes = 0;   // health probes in a row left unanswered
+    uint32_t probeId = 0;   // request ID of the latest health probe, 0 once it is answered
+    int outstanding = 0;    // queries sent to it that are neither answered nor given up
+    double latencyNs = 0;   // moving average of its round trips, a missed deadline counting as the timeout
+    uint64_t queries = 0;   // queries sent to it, retries and hedges included
+};
+
+// A shard of the user base, held by one or more backend servers
+struct Shard
+{
+    string id; // "A", "B", ...
+    vector<Replica> replicas;
+    bool registered = false;  // username list received in Phase 1
+    uint32_t chunksReceived = 0; // username list chunks received in order so far
+    uint32_t dataVersion = 0; // data version of the usernames in the directory
+    uint32_t deltaVersion = 0; // data version of the latest change list received from the backend server
+    uint32_t deltaChunks = 0;  // chunks of that change list received in order so far
+    uint32_t deltaUsers = 0;   // users changed by it so far
+    LatencyHistogram roundTrip; // nanoseconds from sending a query to receiving its result
+    LatencyHistogram recentFirstTries; // round trips of the latest queries answered without being sent again
+    uint64_t hedgeDelayNs = 0;  // HEDGE_PERCENTILE of the last HEDGE_REFRESH of those, 0 until there were that many
+};
+
+vector<Shard> shards;
+size_t registeredShards = 0;
+
+// Shard directory: the index in shards of the backend server each username received in Phase 1 is stored in
+NameDirectory directory;
+
+// Each client connection reads a request, waits for the backend servers and then writes back the reply
+enum ConnState
+{
+    CONN_READING,
+    CONN_WAITING_BACKEND,
+    CONN_WRITING
+};
+
+// The usernames in one shard that one or more groups of a batch request have in common, asked for only once
+struct Subgroup
+{
+    vector<string> usernames;
+    vector<pair<int, int>> result; // their intersection, as the backend server sent it
+    bool answered = false;
+    bool unanswered = false;       // the backend server did not answer within the deadlines and retries
+    bool tooLarge = false;         // the result did not fit in a datagram, so the backend server sent none
+};
+
+// A group of usernames of a batch request, which gets its own reply
+struct BatchGroup
+{
+    vector<int> subgroups;            // per shard, the index of the subgroup with the group's usernames there, FAIL if it has none
+    string missing;                   // usernames that do not exist
+    string cacheKey;                  // empty if the result is not to be cached
+    bool cached = false;              // answered from the cache, with intervals and found
+    vector<pair<int, int>> intervals;
+    string found;
+};
+
+// State of the request a client connection is currently being served for
+struct ClientRequest
+{
+    vector<vector<string>> sublists;          // usernames per shard, indexed like shards
+    vector<string> sublistC;                  // usernames that do not exist
+    vector<vector<pair<int, int>>> results;   // intersection result per shard
+    vector<bool> unanswered;                  // shards that did not answer within their deadlines and retries
+    vector<bool> tooLarge;                    // shards whose result did not fit in a datagram
+    SlotFilter filter;                        // of an earliest-slot request, which only wants the slots it lets through
+    bool batch = false;                       // a batch request, answered with groups and subgroups instead of the above
+    vector<BatchGroup> groups;                // of a batch request, in the order the client sent them
+    vector<vector<Subgroup>> subgroups;       // of a batch request, per shard
+    bool reverse = false;                     // a free request, answered with the users free for window from sublists and freeNames
+    FreeWindow window;                        // of a free request
+    vector<vector<string>> freeNames;         // of a free request, the users free per shard
+    int outstanding = 0;                      // shards that have not answered yet
+    string cacheKey;                   // empty if the result is not to be cached
+    uint64_t cacheGeneration = 0;      // cache generation when the request was sent to the backend servers
+    bool timed = false;                // a scheduling request, whose phases are timed
+    chrono::steady_clock::time_point received;     // the whole request frame was in
+    chrono::steady_clock::time_point replyStarted; // the reply was ready to be sent
+};
+
+struct ClientConnection
+{
+    int fd = FAIL;
+    uint64_t id = 0; // unique for the lifetime of serverM, file descriptors get reused
+    ConnState state = CONN_READING;
+    string inbuf;  // bytes received from the client that are not processed yet
+    char outhdr[FRAME_HEADER_SIZE]; // frame header of the reply
+    string outbuf;                  // payload of the reply that is being sent to the client
+    size_t outpos = 0;              // bytes of header and payload sent so far
+    bool inputClosed = false;       // the client shut down its side; the frames it sent are still answered
+    ClientRequest request;
+};
+
+// Child sockets keyed by file descriptor
+unordered_map<int, ClientConnection> connections;
+uint64_t nextConnectionId = 1;
+
+// One copy of a query sent to a replica: the first try, a retry or the hedge
+struct QuerySend
+{
+    int replica; // index in the shard's replicas
+    chrono::steady_clock::time_point sentAt;
+    bool released = false; // taken off the replica's outstanding queries because it missed its deadline
+};
+
+// A query sent to a backend server that is waiting for its reply, keyed by request ID. Retries and hedges send the same
+// datagram with the same request ID, so whichever copy is answered first completes it and the other replies are dropped.
+struct PendingQuery
+{
+    int clientFD;
+    uint64_t connectionId;
+    int shard; // index in shards
+    string datagram; // the query as it was sent
+    int attempts = 0; // times sent after a deadline passed, not counting the hedge
+    int firstSubgroup = FAIL; // of a batch query: the index of its first subgroup in the request's subgroups of the shard
+    int subgroupCount = 0;    // of a batch query: the subgroups it asks for, which follow the first one
+    int subgroupsLeft = 0;    // of a batch query: those whose result has not arrived yet
+    bool reverse = false;     // a free query, answered in chunks of usernames
+    vector<string> chunks;    // of a free query: the chunks received so far, by chunk number
+    vector<bool> chunkSeen;   // of a free query: which of them have arrived
+    uint32_t chunksReceived = 0;
+    uint32_t chunkCount = 0;  // of a free query: known once the last chunk has arrived
+    bool hedged = false;
+    vector<QuerySend> sends; // every copy sent, in order
+    size_t lastTry = 0;      // index in sends of the latest first try or retry, which the deadline is for
+    chrono::steady_clock::time_point deadline; // the query is sent again, or given up, when this passes
+};
+
+unordered_map<uint32_t, PendingQuery> pendingQueries;
+uint32_t nextRequestId = 1;
+int backendTimeoutMs = DEFAULT_BACKEND_TIMEOUT_MS;
+int backendRetries = DEFAULT_BACKEND_RETRIES;
+bool hedging = false;
+
+// Deadlines and hedging times of the pending queries, earliest first. A timer whose query has been answered, or whose
+// deadline has moved on, is skipped when it comes up.
+struct QueryTimer
+{
+    chrono::steady_clock::time_point due;
+    uint32_t requestId;
+    bool hedge; // send a second copy rather than retry
+
+    bool operator>(const QueryTimer &other) const
+    {
+        return due > other.due;
+    }
+};
+
+priority_queue<QueryTimer, vector<QueryTimer>, greater<QueryTimer>> queryTimers;
+chrono::steady_clock::time_point timerArmedFor; // due time timerFD is set to, or the epoch if it is not set
+chrono::steady_clock::time_point nextProbe;     // when the replicas are probed next, the epoch if no shard has more than one
+uint32_t nextProbeId = 1;
+mt19937 replicaChooser(random_device{}());
+
+// Queries Phase 2 sends during one event loop iteration, sent together at its end, and results received together in Phase 3
+DatagramBatch queryBatch;
+DatagramBatch resultBatch;
+
+// LRU cache of group results keyed by the sorted, deduplicated set of usernames of a request
+struct CacheEntry
+{
+    string key;
+    vector<pair<int, int>> intervals; // final intersection
+    string missing;                   // usernames that do not exist
+    string found;                     // usernames found in the backend servers
+    chrono::steady_clock::time_point expires;
+};
+
+list<CacheEntry> resultCache; // most recently used first
+unordered_map<string, list<CacheEntry>::iterator> resultCacheIndex;
+size_t cacheSize = DEFAULT_CACHE_SIZE;
+int cacheTTL = DEFAULT_CACHE_TTL;
+uint64_t cacheHits = 0;
+uint64_t cacheMisses = 0;
+uint64_t cacheGeneration = 0; // bumped whenever the data behind cached results may have changed
+
+// Phases of a scheduling request, timed with the monotonic clock. The backend round trips are timed per shard in Shard.
+enum RequestPhase
+{
+    PHASE_PARSE, // request frame in -> usernames split
+    PHASE_ROUTE, // directory and cache lookups, queries sent
+    PHASE_MERGE, // Phase 4 intersection of the shard results
+    PHASE_REPLY, // reply ready -> last byte written to the client
+    PHASE_TOTAL, // request frame in -> last byte of the reply written
+    PHASE_COUNT
+};
+const char *phaseNames[PHASE_COUNT] = {"parse", "route", "merge", "reply", "total"};
+
+/*
+Counters and phase latencies. All of Main Server runs on the thread of the event loop, which owns them and also answers
+the stats requests, so recording is a clock read and a few additions, without locks or atomics.
+*/
+struct ServerStats
+{
+    LatencyHistogram phases[PHASE_COUNT]; // nanoseconds
+    uint64_t requests = 0;      // scheduling requests received, a batch counting once
+    uint64_t batchGroups = 0;   // groups of usernames received in batch requests
+    uint64_t freeRequests = 0;  // free requests received
+    uint64_t statsRequests = 0;
+    uint64_t errors = 0;        // malformed frames and results, failed sends and receives
+    uint64_t bytesIn = 0;       // from clients
+    uint64_t bytesOut = 0;      // to clients
+    uint64_t datagramsIn = 0;   // from backend servers
+    uint64_t datagramsOut = 0;  // to backend servers
+    uint64_t retries = 0;       // queries sent again after their deadline
+    uint64_t hedges = 0;        // queries sent twice because they took longer than most
+    uint64_t timeouts = 0;      // queries given up after the last retry
+    uint64_t lateReplies = 0;   // replies to queries that were already answered or given up
+    uint64_t ejections = 0;     // replicas ejected for missing their health probes
+    uint64_t connectionsAccepted = 0;
+    chrono::steady_clock::time_point started = chrono::steady_clock::now();
+};
+
+ServerStats stats;
+
+uint64_t elapsedNs(chrono::steady_clock::time_point from, chrono::steady_clock::time_point to)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(to - from).count();
+}
+
 // Repurposed from Beej’s socket programming tutorial
 // To create the TCP socket for communication with client
 void createTCPSocket()
@@ -110,6 +370,10 @@ void createUDPSocket()
         exit(1);
     }
 
+    // Best effort, the kernel caps it at net.core.rmem_max
+    int rcvbuf = UDP_RECEIVE_BUFFER;
+    setsockopt(sockfd_UDP, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
     // Initialize IP address, port number
     memset(&recvaddr, 0, sizeof(recvaddr));
     recvaddr.sin_family = AF_INET;
@@ -117,456 +381,2271 @@ void createUDPSocket()
     recvaddr.sin_port = htons(SERVERM_UDP);
 }
 
-// Repurposed from Beej’s socket programming tutorial
-//Initialize to backend server A
-void initializeToServerA()
+int findShard(const string &id)
 {
-    memset(&sendaddrA, 0, sizeof(sendaddrA));
-    sendaddrA.sin_family = AF_INET;
-    sendaddrA.sin_addr.s_addr = inet_addr(LOCALHOST);
-    sendaddrA.sin_port = htons(SERVER_A);
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (shards[i].id == id)
+        {
+            return i;
+        }
+    }
+    return FAIL;
 }
 
 // Repurposed from Beej’s socket programming tutorial
-//Initialize to backend server B
-void initializeToServerB()
+//Initialize a backend server from its "ID=host:port" description. A shard ID given again adds a replica to that shard.
+void addShard(const string &spec)
 {
-    memset(&sendaddrB, 0, sizeof(sendaddrB));
-    sendaddrB.sin_family = AF_INET;
-    sendaddrB.sin_addr.s_addr = inet_addr(LOCALHOST);
-    sendaddrB.sin_port = htons(SERVER_B);
+    size_t eq = spec.find('=');
+    size_t colon = spec.rfind(':');
+    if (eq == string::npos || colon == string::npos || colon < eq)
+    {
+        cerr << "Error: shard must be given as ID=host:port, got " << spec << endl;
+        exit(1);
+    }
+    Replica replica;
+    replica.address = spec.substr(eq + 1);
+    memset(&replica.addr, 0, sizeof(replica.addr));
+    replica.addr.sin_family = AF_INET;
+    replica.addr.sin_addr.s_addr = inet_addr(spec.substr(eq + 1, colon - eq - 1).c_str());
+    replica.addr.sin_port = htons(atoi(spec.c_str() + colon + 1));
+    int shard = findShard(spec.substr(0, eq));
+    if (shard == FAIL)
+    {
+        shards.emplace_back();
+        shards.back().id = spec.substr(0, eq);
+        shard = shards.size() - 1;
+    }
+    shards[shard].replicas.push_back(replica);
 }
 
 /*
-This function receives the sublist of usernames that is to be parsed and processed. This is part of Phase 2 where we check which usernames
-belong to which backend server and send the usernames to that respective server for further processing.
+Picks the replica of a shard to send a query to, other than avoid if there is another healthy one: of two healthy replicas
+drawn at random, the one whose outstanding queries times its latency average is lower. Comparing two random replicas
+rather than all of them keeps a burst of queries from piling onto whichever looked best before any of them were answered.
+Only when every replica is ejected are the ejected ones tried, so a shard whose probes get lost still has its queries sent.
 */
-void Phase2_sendServer_A_B(vector<string> subListToProcess, struct sockaddr_in sendaddrA_B)
+int pickReplica(const Shard &shard, int avoid)
 {
-    string sublist_str;
-    for (const auto &username : subListToProcess)
+    int count = shard.replicas.size();
+    int healthy = 0;
+    for (int i = 0; i < count; i++)
     {
-        sublist_str += username + " ";
+        healthy += (i != avoid && shard.replicas[i].healthy);
     }
-
-    int bytes_sent = sendto(sockfd_UDP, sublist_str.c_str(), sublist_str.length(), 0, (struct sockaddr *)&sendaddrA_B, sizeof(sendaddrA_B));
-    if (bytes_sent < 0)
+    if (healthy == 0 && avoid != FAIL && shard.replicas[avoid].healthy)
     {
-        perror("Error sending data to backend server ");
+        return avoid;
+    }
+    int candidates = healthy > 0 ? healthy : count - (avoid != FAIL);
+    if (candidates == 0)
+    {
+        return avoid;
     }
 
-
-}
-
-/*
-In this function we parse the intersection result that the Main Server receives either from server A or B.
-*/
-vector<pair<int, int>> ParseIntervals(const char *buffer)
-{
-    vector<pair<int, int>> intervals;
-    char *avail = strtok((char *)buffer, "[]");
-    while (avail != NULL)
+    // The replicas that are candidates, numbered from 0 in the order of the shard
+    auto candidate = [&](int n)
     {
-        string str(avail);
-        if (str != "," && str != "" && str != " ")
+        for (int i = 0; i < count; i++)
         {
-            int comma_pos = str.find(",");
-            int start = stoi(str.substr(0, comma_pos));
-            int end = stoi(str.substr(comma_pos + 1));
-            intervals.emplace_back(start, end);
+            if (i != avoid && (healthy == 0 || shard.replicas[i].healthy) && n-- == 0)
+            {
+                return i;
+            }
         }
-        avail = strtok(NULL, "[]");
+        return FAIL;
+    };
+    auto cost = [&](int i)
+    {
+        return (shard.replicas[i].outstanding + 1) * max(shard.replicas[i].latencyNs, 1.0);
+    };
+    int first = uniform_int_distribution<int>(0, candidates - 1)(replicaChooser);
+    if (candidates == 1)
+    {
+        return candidate(first);
     }
-    return intervals;
+    int second = (first + 1 + uniform_int_distribution<int>(0, candidates - 2)(replicaChooser)) % candidates;
+    int a = candidate(first);
+    int b = candidate(second);
+    return cost(a) <= cost(b) ? a : b;
 }
 
-
-//This is the algorithm that calculates the common time availability among multiple users.
-
-vector<pair<int, int>> CommonTimeAvailability(vector<pair<int, int>> intervals1, vector<pair<int, int>> intervals2)
+// Folds a round trip of a replica into its latency average. Until a replica has answered, it is assumed to be as fast as
+// the first of its shard that did, so it is not sent every query in the meantime.
+void recordReplicaLatency(Shard &shard, int replica, uint64_t ns)
 {
-    vector<pair<int, int>> commonIntervals;
-    int i = 0, j = 0;
-    while (i < intervals1.size() && j < intervals2.size())
+    Replica &answered = shard.replicas[replica];
+    if (answered.latencyNs == 0)
     {
-        // Check if the intervals overlap
-        if (intervals1[i].second < intervals2[j].first)
-        {
-            i++;
-        }
-        else if (intervals2[j].second < intervals1[i].first)
-        {
-            j++;
-        }
-        else
+        for (Replica &other : shard.replicas)
         {
-            int start = max(intervals1[i].first, intervals2[j].first);
-            int end = min(intervals1[i].second, intervals2[j].second);
-            if (start < end) // check if it is a valid interval
-            {
-                commonIntervals.emplace_back(start, end);
-            }
-            if (intervals1[i].second < intervals2[j].second)
+            if (other.latencyNs == 0)
             {
-                i++;
-            }
-            else
-            {
-                j++;
+                other.latencyNs = ns;
             }
         }
+        return;
     }
-    return commonIntervals;
+    answered.latencyNs += LATENCY_WEIGHT * ((double)ns - answered.latencyNs);
 }
 
-int main()
+// Sends every query queued in Phase 2 with one sendmmsg
+void Phase2_flushQueries()
 {
-    char bufferA[BUFFER_SIZE];
-    char bufferB[BUFFER_SIZE];
+    size_t queued = queryBatch.count;
+    if (queued == 0)
+    {
+        return;
+    }
+    size_t failed = queryBatch.flush(sockfd_UDP);
+    stats.datagramsOut += queued - failed;
+    if (failed > 0)
+    {
+        stats.errors += failed;
+        perror("Error sending data to backend server ");
+    }
+}
 
-    //Creating TCP socket
-    createTCPSocket();
-    // Start listening to client requests
-    listenToClient();
-    // Getting socket name
-    socklen_t len = sizeof(serverM_client_addr);
-    if (getsockname(serverM_clientFD, (struct sockaddr *)&serverM_client_addr, &len) == -1)
+// Queues a datagram for a backend server; the queries of one event loop iteration go out together
+void Phase2_queueDatagram(const char *datagram, size_t length, const struct sockaddr_in &to)
+{
+    if (queryBatch.full())
     {
-        std::cerr << "Failed to get socket name" << std::endl;
-        close(serverM_clientFD);
-        return 1;
+        Phase2_flushQueries();
     }
+    memcpy(queryBatch.next(), datagram, length);
+    queryBatch.queue(length, to);
+}
 
-    //std::cout << "DEBUG:: Server is listening on port " << ntohs(serverM_client_addr.sin_port) << std::endl;
+// Queues a query for one replica of its shard, which counts it as outstanding until it is answered, misses its deadline or
+// is given up, and records the copy in the query's sends
+void Phase2_sendToReplica(PendingQuery &query, int replica)
+{
+    Replica &target = shards[query.shard].replicas[replica];
+    query.sends.push_back({replica, chrono::steady_clock::now()});
+    target.outstanding++;
+    target.queries++;
+    Phase2_queueDatagram(query.datagram.data(), query.datagram.size(), target.addr);
+}
 
-    createUDPSocket();
-    cout << "Main Server M is up and running." << endl;
-    //bind socket
-    if (::bind(sockfd_UDP, (sockaddr *)&recvaddr, sizeof(recvaddr)) < 0)
+// Takes a query that is answered or given up off the outstanding queries of the replicas its copies are still counted at
+void releaseReplicas(const PendingQuery &query)
+{
+    Shard &shard = shards[query.shard];
+    for (const QuerySend &send : query.sends)
     {
-        perror("bind error");
-        return 1;
+        if (!send.released)
+        {
+            shard.replicas[send.replica].outstanding--;
+        }
     }
+}
 
-    // PHASE 1
-    //-------Server A-------
-    //Initializing to server A
-    initializeToServerA();
-    memset(bufferA, 0, sizeof(bufferA));
-    socklen_t sendaddrA_len = sizeof(sendaddrA);
-    //Receive usernames only of a.txt from server A.
-    int phase1_recv_A = recvfrom(sockfd_UDP, bufferA, sizeof(bufferA), 0, (struct sockaddr *)&sendaddrA, &sendaddrA_len);
-    if (phase1_recv_A == FAIL)
-    {
-        perror("[ERROR] Server M failed to receive data from server A.");
-        exit(1);
-    }
-    //Terminate received data with \0
-    bufferA[phase1_recv_A] = '\0';
-
-    // To parse comma separated value
-    //Defining a Map to store usernames received from A
-    map<string, bool> serverAMap;
-    // Loop through each key and add it to the map with a value of true
-    string delimiter = ",";
-    size_t pos = 0;
-    string tokenA;
-    string keys(bufferA);
-    while ((pos = keys.find(delimiter)) != string::npos)
-    {
-        tokenA = keys.substr(0, pos);
-        serverAMap[tokenA] = true;
-        keys.erase(0, pos + delimiter.length());
-    }
-    cout << "Main Server received the username list from server A using UDP over port " << SERVERM_UDP <<"." << endl;
-
-    //-------Server B-------
-     //Initializing to server A
-    initializeToServerB();
-    socklen_t sendaddrB_len = sizeof(sendaddrB);
-    memset(bufferB, 0, sizeof(bufferB));
-    //Receive usernames only of b.txt from server B.
-    int phase1_recv_B = recvfrom(sockfd_UDP, bufferB, sizeof(bufferB), 0,(struct sockaddr *)&sendaddrB, &sendaddrB_len);
-    if (phase1_recv_B== FAIL)
-    {
-        perror("[ERROR] Server M failed to receive data from server B.");
-        return 1;
-    }
-    //Terminate received data with \0
-    bufferB[phase1_recv_B] = '\0';
+/*
+Queues the datagram of query, tagged with requestId, for the replica of its shard pickReplica chooses. The queries of one
+event loop iteration go out together, and the reply is matched to the query by its request ID in Phase 3, so any number of
+queries can be in flight. The query is kept so that it can be sent again when its deadline passes, or early with -H.
+*/
+void Phase2_sendQuery(PendingQuery &query, uint32_t requestId)
+{
+    const Shard &shard = shards[query.shard];
+    auto now = chrono::steady_clock::now();
+    query.lastTry = query.sends.size();
+    Phase2_sendToReplica(query, pickReplica(shard, FAIL));
 
-    // To parse comma separated value
-    //Defining a Map to store usernames received from B
-    map<string, bool> serverBMap;
-    // Loop through each key and add it to the map with a value of true
-    string comma = ",";
-    size_t loc = 0;
-    string tokenB;
-    string keysB(bufferB);
-    while ((loc = keysB.find(comma)) != string::npos)
+    query.deadline = now + chrono::milliseconds(backendTimeoutMs);
+    queryTimers.push({query.deadline, requestId, false});
+    if (hedging && shard.hedgeDelayNs > 0 && shard.hedgeDelayNs < (uint64_t)backendTimeoutMs * 1000000)
     {
-        tokenB = keysB.substr(0, loc);
-        serverBMap[tokenB] = true;
-        keysB.erase(0, loc + comma.length());
+        queryTimers.push({now + chrono::nanoseconds(shard.hedgeDelayNs), requestId, true});
     }
-    cout << "Main Server received the username list from server B using UDP over port " << SERVERM_UDP << "."<<endl;
-    cout << endl;
-    cout << endl;
+}
 
-    // Repurposed from Beej’s socket programming tutorial
-    // Accept connection from client using child socket
-    socklen_t clientAddrSize = sizeof(destClient_addr);
-    childSocketFD = ::accept(serverM_clientFD, (struct sockaddr *)&destClient_addr, &clientAddrSize);
-    if (childSocketFD == FAIL)
+/*
+This function receives the sublist of usernames that is to be parsed and processed. This is part of Phase 2 where we check which usernames
+belong to which backend server and send the usernames to that respective server for further processing.
+An earliest-slot query carries its filter, so the backend server only computes and sends the slots that can be part of the
+answer. Returns false if the usernames do not fit in one datagram.
+*/
+bool Phase2_sendToShard(const vector<string> &subListToProcess, uint32_t requestId, PendingQuery &query, const SlotFilter &filter)
+{
+    const Shard &shard = shards[query.shard];
+    string sublist_str;
+    for (const auto &username : subListToProcess)
     {
-        perror("[ERROR] Server M failed to accept connection with Client.");
-        exit(1);
+        sublist_str += username + " ";
+    }
+    if (filter.restricts())
+    {
+        char encoded[SLOT_FILTER_SIZE];
+        encodeSlotFilter(filter, encoded);
+        sublist_str.insert(0, encoded, SLOT_FILTER_SIZE);
+    }
+    if (HEADER_SIZE + sublist_str.length() > MAX_DATAGRAM_SIZE)
+    {
+        stats.errors++;
+        cerr << "Error: the usernames for server " << shard.id << " do not fit in one datagram" << endl;
+        return false;
     }
 
-//while loop to continuously receive requests from client
-while (true)
+    // Ask for the binary interval encoding so the result can be used without parsing text
+    uint16_t flags = FLAG_BINARY_INTERVALS | (filter.restricts() ? FLAG_SLOT_FILTER : 0);
+    query.datagram.resize(HEADER_SIZE + sublist_str.length());
+    packMessage(&query.datagram[0], requestId, OP_QUERY, flags, sublist_str.c_str(), sublist_str.length());
+    Phase2_sendQuery(query, requestId);
+    return true;
+}
+
+/*
+Sends the subgroups of a batch request that are in one shard to its backend server, as many of them in a row per
+OP_BATCH_QUERY as fit in a datagram, each ended by BATCH_SEPARATOR. The backend server answers every query with the results of
+all of its subgroups, in one or more OP_BATCH_RESULT datagrams. A subgroup that does not fit in a datagram on its own is
+counted as unanswered.
+*/
+void Phase2_sendBatchToShard(ClientConnection &conn, int shard, const SlotFilter &filter)
+{
+    ClientRequest &req = conn.request;
+    vector<Subgroup> &subgroups = req.subgroups[shard];
+    string prefix;
+    if (filter.restricts())
     {
-        //PHASE 2
-        string usernames = "";
-        // cout << "DEBUG:: accepting connections " << endl;
+        prefix.resize(SLOT_FILTER_SIZE);
+        encodeSlotFilter(filter, &prefix[0]);
+    }
+    uint16_t flags = FLAG_BINARY_INTERVALS | (filter.restricts() ? FLAG_SLOT_FILTER : 0);
 
-        // To receive input usernames from client over TCP
-        char buffer_client[MAX_USERNAME_LENGTH * 10]; // Max 10 usernames, each with a length of MAX_USERNAME_LENGTH
-        int bytes_received = recv(childSocketFD, buffer_client, sizeof(buffer_client), 0);
-        if (bytes_received == -1)
+    string payload = prefix;
+    size_t first = 0;
+    for (size_t j = 0; j <= subgroups.size(); j++)
+    {
+        string names;
+        if (j < subgroups.size())
         {
-            cerr << "Error receiving data from client" << endl;
-            return 1;
+            for (const auto &username : subgroups[j].usernames)
+            {
+                names += (names.empty() ? "" : " ") + username;
+            }
+            names += BATCH_SEPARATOR;
         }
-        buffer_client[bytes_received] = '\0';
-        cout << "Main Server received the request from client using TCP over port " << SERVER_TCP_PORT << "." << endl;
-
-        //Parsing usernames received from client
-        vector<string> usernamesFromClient;
-        char *client_recv_name = strtok(buffer_client, " ");
-        while (client_recv_name != NULL)
+        // Send the subgroups gathered so far once the batch is done or the next one does not fit with them
+        if (j > first && (j == subgroups.size() || HEADER_SIZE + payload.size() + names.size() > MAX_DATAGRAM_SIZE))
         {
-            usernamesFromClient.push_back(client_recv_name);
-            client_recv_name = strtok(NULL, " ");
+            uint32_t requestId = nextRequestId++;
+            PendingQuery &query = pendingQueries[requestId];
+            query.clientFD = conn.fd;
+            query.connectionId = conn.id;
+            query.shard = shard;
+            query.firstSubgroup = first;
+            query.subgroupCount = j - first;
+            query.subgroupsLeft = j - first;
+            query.datagram.resize(HEADER_SIZE + payload.size());
+            packMessage(&query.datagram[0], requestId, OP_BATCH_QUERY, flags, payload.data(), payload.size());
+            Phase2_sendQuery(query, requestId);
+            req.outstanding++;
+            payload = prefix;
+            first = j;
         }
-
-        // Iterating over usernames and adding to sublists depending on the backend server that they belong to
-        vector<string> sublistA, sublistB, sublistC;
-        for (const auto &username_entered : usernamesFromClient)
+        if (j == subgroups.size())
         {
-            if (serverAMap.find(username_entered) != serverAMap.end())
-            {
-                sublistA.push_back(username_entered);
-            }
-            else if (serverBMap.find(username_entered) != serverBMap.end())
-            {
-                sublistB.push_back(username_entered);
-            }
-            else
-            {
-                sublistC.push_back(username_entered);
-            }
+            break;
         }
+        if (HEADER_SIZE + prefix.size() + names.size() > MAX_DATAGRAM_SIZE)
+        {
+            stats.errors++;
+            cerr << "Error: the usernames of a group for server " << shards[shard].id << " do not fit in one datagram" << endl;
+            subgroups[j].unanswered = true;
+            first = j + 1;
+            continue;
+        }
+        payload += names;
+    }
+}
 
+/*
+Sends the window of a free request to the backend server of a shard, with the candidate usernames located there, or none to
+ask about all of its users. Candidates that do not fit in one datagram are spread over several OP_FREE_QUERY datagrams, each
+a query of its own.
+*/
+void Phase2_sendFreeToShard(ClientConnection &conn, int shard)
+{
+    ClientRequest &req = conn.request;
+    const vector<string> &candidates = req.sublists[shard];
+    string prefix(FREE_WINDOW_SIZE, '\0');
+    encodeFreeWindow(req.window, &prefix[0]);
 
-        //Initializing variables to pass into CommonTimeAvailability algoritm.
-        vector<pair<int, int>> intervals1;
-        vector<pair<int, int>> intervals2;
-
-        //Check if sublistA is empty and if not send those usernames to Server A for further processing.
-        if (sublistA.empty())
+    string payload = prefix;
+    for (size_t j = 0; j <= candidates.size(); j++)
+    {
+        // Send the candidates gathered so far once they are all in or the next one does not fit with them; a query without
+        // candidates goes out only if there were none to begin with
+        bool done = j == candidates.size();
+        if ((done && (payload.size() > prefix.size() || candidates.empty())) ||
+            (!done && payload.size() > prefix.size() && HEADER_SIZE + payload.size() + 1 + candidates[j].size() > MAX_DATAGRAM_SIZE))
         {
-            //do nothing
+            uint32_t requestId = nextRequestId++;
+            PendingQuery &query = pendingQueries[requestId];
+            query.clientFD = conn.fd;
+            query.connectionId = conn.id;
+            query.shard = shard;
+            query.reverse = true;
+            query.datagram.resize(HEADER_SIZE + payload.size());
+            packMessage(&query.datagram[0], requestId, OP_FREE_QUERY, 0, payload.data(), payload.size());
+            Phase2_sendQuery(query, requestId);
+            req.outstanding++;
+            payload = prefix;
         }
-        else
+        if (done)
         {
-            if (!sublistA.empty())
-            {
-            cout << "Found ";
-            // Loop over the elements of the sublist to print.
-            for (std::size_t i = 0; i < sublistA.size(); i++)
-            {
-                cout << sublistA[i];
-                // Print a comma if it's not the last element
-                if (i < sublistA.size() - 1)
-                {
-                    cout << ", ";
-                }
-            }
-            cout << " located at Server A. Send to Server A." << endl;
-            }
-
-            Phase2_sendServer_A_B(sublistA, sendaddrA);
-
-
-            // PHASE 3
-            // Server A
-            char buffer_phase3_A[BUFFER_SIZE];
+            break;
+        }
+        payload += (payload.size() > prefix.size() ? " " : "") + candidates[j];
+    }
+}
 
-            // Receive the intersection result from Server A
-            int num_bytes_received_A = recvfrom(sockfd_UDP, buffer_phase3_A, BUFFER_SIZE, 0, (struct sockaddr *)&sendaddrA, &sendaddrA_len);
-            if (num_bytes_received_A == -1)
-            {
-                //cout << "DEBUG:: if (num_bytes_received_A == -1) HIT" << endl;
-                perror("Error in receiving data");
-                exit(EXIT_FAILURE);
-            }
-            buffer_phase3_A[num_bytes_received_A] = '\0';
-            usernames = "user exists";
-            cout<< "Main Server received from server A the intersection result using UDP over port " << SERVERM_UDP<< ":" <<endl;
-            cout<< buffer_phase3_A << endl;
-            // Parsing buffer data from server A  using the ParseIntervals function
-            intervals1 = ParseIntervals(buffer_phase3_A);
-       }
+// Repurposed from Beej’s socket programming tutorial
+// Puts a socket in non-blocking mode so the event loop never stalls on a single client
+void setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == FAIL || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == FAIL)
+    {
+        perror("[ERROR] Server M failed to set socket non-blocking");
+        exit(1);
+    }
+}
 
-        //Check if sublistB is empty and if not send those usernames to Server B for further processing.
-        if (sublistB.empty())
+//Parsing the comma separated usernames of one chunk of the list a backend server sends in Phase 1, straight out of the receive buffer
+void Phase1_storeUsernames(const char *keys, const char *end, int shard)
+{
+    // Loop through each key and add it to the directory with the shard it belongs to
+    while (keys < end)
+    {
+        const char *comma = (const char *)memchr(keys, ',', end - keys);
+        if (comma == NULL)
         {
-            // do nothing
+            comma = end;
         }
-        else
+        if (comma > keys)
         {
-             // Print sublists
-            if (!sublistB.empty())
-            {
-            // Loop over the elements of the sublist to print
-            for (std::size_t i = 0; i < sublistB.size(); i++)
+            bool inserted;
+            uint32_t entry = directory.insertHashed(keys, comma - keys, hashName(keys, comma - keys), shard, inserted);
+            // A username removed from the directory keeps its entry, free to be taken again
+            if (!inserted && directory.values[entry] == NOT_FOUND)
             {
-                cout << sublistB[i];
-
-                // Print a comma if it's not the last element
-                if (i < sublistB.size() - 1)
-                {
-                    cout << ", ";
-                }
-            }
-            cout << " located at Server B. Send to Server B." << endl;
+                directory.values[entry] = shard;
             }
+        }
+        keys = comma + 1;
+    }
+}
 
-            Phase2_sendServer_A_B(sublistB, sendaddrB);
+// Every chunk starts with the ID of the shard it belongs to. Returns the shard and points names past the ID, or returns FAIL.
+int shardOfChunk(const MessageHeader &header, const char *payload, const char *&names)
+{
+    const char *colon = (const char *)memchr(payload, ':', header.length);
+    int shard = (colon == NULL) ? FAIL : findShard(string(payload, colon - payload));
+    if (shard == FAIL)
+    {
+        cerr << "Error: username list from an unknown shard" << endl;
+        return FAIL;
+    }
+    names = colon + 1;
+    return shard;
+}
 
-           // PHASE 3
-           // Server B
-            char buffer_phase3_B[BUFFER_SIZE];
-            // Receive the intersection result from Server B
-            int num_bytes_received_B = recvfrom(sockfd_UDP, buffer_phase3_B, BUFFER_SIZE, 0, (struct sockaddr *)&sendaddrB, &sendaddrB_len);
-            if (num_bytes_received_B == -1)
-            {
-                perror("Error in receiving data");
-                exit(EXIT_FAILURE);
-            }
-            buffer_phase3_B[num_bytes_received_B] = '\0';
-            usernames = "user exists";
-            cout << "Main Server received from server B the intersection result using UDP over port " << SERVERM_UDP <<": " << endl;
-            cout<<buffer_phase3_B <<"."<< endl;
-            intervals2 = ParseIntervals(buffer_phase3_B);
-        }
+void cacheClear();
+void cacheInvalidate(const unordered_set<string_view> &usernames);
 
-        //For usernames that are not present in both backend servers
-        if (sublistC.size() > 0)
+/*
+PHASE 1
+A backend server sends its username list in chunks that each fit in one datagram, numbered by their request ID, and marks the
+last one with FLAG_LAST_CHUNK. Chunks are only stored in order. Every chunk is acknowledged with the number of chunks received
+so far, so the backend server can keep a few chunks in flight and go back to the first one that was lost.
+Chunks that arrive again after the list is complete are acknowledged too, in case the last acknowledgement got lost.
+A backend server restarted on a changed data file sends its list again with another data version, which replaces the one
+it sent before. A replica, or a server restarted on the same file, sends the version Main Server has and is acknowledged.
+Versions are hashes of the data file's identity rather than counters, so they only tell whether two lists are the same.
+*/
+void Phase1_receiveChunk(const MessageHeader &header, const char *payload, const struct sockaddr_in &from)
+{
+    const char *names;
+    int shard = shardOfChunk(header, payload, names);
+    if (shard == FAIL)
+    {
+        return;
+    }
+    Shard &backend = shards[shard];
+    if (header.request_id == 0 && backend.chunksReceived > 0 && header.version != backend.dataVersion)
+    {
+        cout << "Server " << backend.id << " restarted. Main Server is receiving its username list again." << endl;
+        for (uint32_t &value : directory.values)
         {
-            string user_does_not_exist = "";
-            for (auto iter = sublistC.begin(); iter != sublistC.end(); ++iter)
+            if (value == (uint32_t)shard)
             {
-                if (iter != sublistC.begin())
-                {
-                    cout << ", ";
-                    user_does_not_exist += ", ";
-                }
-                cout << *iter;
-                user_does_not_exist += *iter;
+                value = NOT_FOUND;
             }
-            cout << " do not exist. Send a reply to the client." << endl;
-            //cout << "DEBUG:: sending from sublistC " << endl;
-            usernames = user_does_not_exist + " ";
-        }
-
-        //PHASE 4
-        //Running CommonTimeAvailability algorithm on resulting vectors
-        vector<pair<int, int>> common_intervals;
-        if (intervals1.empty() && !intervals2.empty())
-        {
-            common_intervals = intervals2;
         }
-        else if (!intervals1.empty() && intervals2.empty())
+        cacheClear();
+        if (backend.registered)
         {
-            common_intervals = intervals1;
+            backend.registered = false;
+            registeredShards--;
         }
-        else
+        backend.chunksReceived = 0;
+    }
+    // The first chunk sets the version the rest of the list has to carry
+    if (!backend.registered && header.request_id == backend.chunksReceived && (header.request_id == 0 || header.version == backend.dataVersion))
+    {
+        backend.dataVersion = header.version;
+        Phase1_storeUsernames(names, payload + header.length, shard);
+        backend.chunksReceived++;
+        if (header.flags & FLAG_LAST_CHUNK)
         {
-            common_intervals = CommonTimeAvailability(intervals1, intervals2);
+            backend.registered = true;
+            registeredShards++;
+            cout << "Main Server received the username list from server " << backend.id << " using UDP over port " << SERVERM_UDP << "." << endl;
         }
+    }
 
-        if (!common_intervals.empty())
-        {
-            cout << "Found the intersection between the results from server A and B: " << endl;
-                for (const auto &interval : common_intervals)
-                {
-                    cout << "[" << interval.first << "," << interval.second << "] ";
-                }
-                cout << endl;
-        }
+    char ack[HEADER_SIZE];
+    packHeader(ack, backend.chunksReceived, OP_USERLIST_ACK, 0, 0, backend.dataVersion);
+    if (sendto(sockfd_UDP, ack, HEADER_SIZE, 0, (struct sockaddr *)&from, sizeof(from)) == FAIL)
+    {
+        perror("Error acknowledging username list");
+    }
+}
 
-        // Formatting the final interval to the client
-        stringstream final_interval;
-        if (common_intervals.empty())
+// Applies one chunk of a change list to the directory: "+name" was added, "-name" removed and "~name" has new availability
+void applyChanges(const char *entries, const char *end, int shard, unordered_set<string_view> &changed)
+{
+    while (entries < end)
+    {
+        const char *comma = (const char *)memchr(entries, ',', end - entries);
+        if (comma == NULL)
         {
-            final_interval << "[] \n";
+            comma = end;
         }
-        else
+        if (comma - entries > 1)
         {
-            for (const auto &interval : common_intervals)
+            const char *name = entries + 1;
+            size_t length = comma - name;
+            if (*entries == '+' && directory.find(name, length) == NOT_FOUND)
             {
-                final_interval << "[" << interval.first << "," << interval.second << "] ";
+                directory.assign(name, length, shard);
             }
-            final_interval << "\n";
-        }
-
-        stringstream final_username_list;
-        for (const auto &username : sublistA)
-        {
-            final_username_list << username << " ";
+            else if (*entries == '-' && directory.find(name, length) == (uint32_t)shard)
+            {
+                directory.assign(name, length, NOT_FOUND);
+            }
+            changed.insert(string_view(name, length));
         }
+        entries = comma + 1;
+    }
+}
 
-        for (const auto &username : sublistB)
+/*
+A backend server that reloaded its data file sends the users that changed, in acknowledged chunks just like its username list.
+The directory follows the changes, and only the cached results that involve one of these users are dropped. Results that
+were being computed while the change list was on its way are not cached at all.
+*/
+void receiveChanges(const MessageHeader &header, const char *payload, const struct sockaddr_in &from)
+{
+    const char *names;
+    int shard = shardOfChunk(header, payload, names);
+    if (shard == FAIL)
+    {
+        return;
+    }
+    Shard &backend = shards[shard];
+    // Changes to a username list that is not complete yet are not acknowledged, so they are sent again later
+    if (!backend.registered)
+    {
+        return;
+    }
+    if (header.request_id == 0 && header.version != backend.deltaVersion && header.version != backend.dataVersion)
+    {
+        backend.deltaVersion = header.version;
+        backend.deltaChunks = 0;
+        backend.deltaUsers = 0;
+        cacheGeneration++;
+    }
+    if (header.version == backend.deltaVersion && header.request_id == backend.deltaChunks)
+    {
+        unordered_set<string_view> changed;
+        applyChanges(names, payload + header.length, shard, changed);
+        cacheInvalidate(changed);
+        backend.deltaChunks++;
+        backend.deltaUsers += changed.size();
+        if (header.flags & FLAG_LAST_CHUNK)
         {
-            final_username_list << username << " ";
+            backend.dataVersion = header.version;
+            cout << "Main Server received " << backend.deltaUsers << " changed users from server " << backend.id << " using UDP over port " << SERVERM_UDP << "." << endl;
         }
+    }
 
-        string fresult;
-        // adding not in databse usernames
-        if (usernames.empty() || usernames == "user exists")
+    char ack[HEADER_SIZE];
+    packHeader(ack, header.version == backend.deltaVersion ? backend.deltaChunks : 0, OP_DELTA_ACK, 0, 0, header.version);
+    if (sendto(sockfd_UDP, ack, HEADER_SIZE, 0, (struct sockaddr *)&from, sizeof(from)) == FAIL)
+    {
+        perror("Error acknowledging changes");
+    }
+}
+
+bool writeToClient(ClientConnection &conn);
+void serveClient(int fd);
+
+// Builds the cache key of a request: its usernames sorted and without duplicates, and the filter of an earliest-slot request.
+// The filter is not followed by a space, so cacheInvalidate never takes it for a username.
+string cacheKeyFor(const vector<string> &usernames, const SlotFilter &filter)
+{
+    set<string> unique_names(usernames.begin(), usernames.end());
+    string key;
+    for (const auto &name : unique_names)
+    {
+        key += name + " ";
+    }
+    if (filter.restricts())
+    {
+        key += "/" + to_string(filter.minDuration) + "," + to_string(filter.from) + "," + to_string(filter.horizon) + "," + to_string(filter.limit);
+    }
+    return key;
+}
+
+// Returns the cached result for key, or NULL if there is none or it has expired
+CacheEntry *cacheLookup(const string &key)
+{
+    auto it = resultCacheIndex.find(key);
+    if (it == resultCacheIndex.end())
+    {
+        return NULL;
+    }
+    if (chrono::steady_clock::now() >= it->second->expires)
+    {
+        resultCache.erase(it->second);
+        resultCacheIndex.erase(it);
+        return NULL;
+    }
+    resultCache.splice(resultCache.begin(), resultCache, it->second);
+    return &resultCache.front();
+}
+
+void cacheStore(const string &key, const vector<pair<int, int>> &intervals, const string &missing, const string &found)
+{
+    if (cacheSize == 0)
+    {
+        return;
+    }
+    auto it = resultCacheIndex.find(key);
+    if (it != resultCacheIndex.end())
+    {
+        resultCache.erase(it->second);
+        resultCacheIndex.erase(it);
+    }
+    while (resultCache.size() >= cacheSize)
+    {
+        resultCacheIndex.erase(resultCache.back().key);
+        resultCache.pop_back();
+    }
+    resultCache.push_front({key, intervals, missing, found, chrono::steady_clock::now() + chrono::seconds(cacheTTL)});
+    resultCacheIndex[key] = resultCache.begin();
+}
+
+void cacheClear()
+{
+    resultCache.clear();
+    resultCacheIndex.clear();
+    cacheGeneration++;
+}
+
+// Drops the cached results of every group that has one of the usernames in it
+void cacheInvalidate(const unordered_set<string_view> &usernames)
+{
+    for (auto it = resultCache.begin(); it != resultCache.end();)
+    {
+        // The key is the usernames of the group, each followed by a space
+        string_view key = it->key;
+        bool involved = false;
+        for (size_t start = 0, space; !involved && (space = key.find(' ', start)) != string_view::npos; start = space + 1)
+        {
+            involved = usernames.count(key.substr(start, space - start)) > 0;
+        }
+        if (involved)
+        {
+            resultCacheIndex.erase(it->key);
+            it = resultCache.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+// Appends the reply to one group to payload: the intersection, the usernames that do not exist, the usernames found, the
+// usernames whose backend server did not answer and the usernames whose result was too large to send go out as
+// REPLY_SECTIONS sections
+void appendReply(string &payload, const vector<pair<int, int>> &common_intervals, const string &usernames, const string &final_username_list,
+                 const string &unanswered_usernames, const string &too_large_usernames)
+{
+    // Formatting the final interval to the client
+    stringstream final_interval;
+    if (common_intervals.empty())
+    {
+        final_interval << "[] ";
+    }
+    else
+    {
+        for (const auto &interval : common_intervals)
+        {
+            final_interval << "[" << interval.first << "," << interval.second << "] ";
+        }
+    }
+
+    appendSection(payload, final_interval.str());
+    appendSection(payload, usernames);
+    appendSection(payload, final_username_list);
+    appendSection(payload, unanswered_usernames);
+    appendSection(payload, too_large_usernames);
+}
+
+// Formats the final intersection and the usernames into one reply frame and starts sending it to the client
+void sendReply(ClientConnection &conn, const vector<pair<int, int>> &common_intervals, const string &usernames, const string &final_username_list,
+               const string &unanswered_usernames = "", const string &too_large_usernames = "")
+{
+    conn.request.replyStarted = chrono::steady_clock::now();
+    conn.outbuf.clear();
+    appendReply(conn.outbuf, common_intervals, usernames, final_username_list, unanswered_usernames, too_large_usernames);
+    packFrameHeader(conn.outhdr, OP_SCHEDULE_REPLY, conn.outbuf.size());
+    conn.outpos = 0;
+    conn.state = CONN_WRITING;
+    writeToClient(conn);
+}
+
+/*
+PHASE 4
+Runs once the results of every backend server involved in the request are in. It computes the final intersection,
+formats the reply and starts sending it to the client.
+*/
+void Phase4_finishRequest(ClientConnection &conn)
+{
+    ClientRequest &req = conn.request;
+
+    //For usernames that are not present in both backend servers
+    string usernames = "";
+    if (req.sublistC.size() > 0)
+    {
+        string user_does_not_exist = "";
+        for (auto iter = req.sublistC.begin(); iter != req.sublistC.end(); ++iter)
+        {
+            if (iter != req.sublistC.begin())
+            {
+                cout << ", ";
+                user_does_not_exist += ", ";
+            }
+            cout << *iter;
+            user_does_not_exist += *iter;
+        }
+        cout << " do not exist. Send a reply to the client." << endl;
+        usernames = user_does_not_exist;
+    }
+
+    //Intersecting the results of every shard involved in one sweep once every part is in
+    //A backend that was asked and found no common slot makes the whole result empty
+    //A backend that did not answer is left out, and its usernames are reported to the client instead
+    //A backend whose result was too large to send leaves the request without intervals, and its usernames are reported
+    vector<IntervalSpan> shard_results;
+    string servers;
+    string final_username_list;
+    string unanswered_usernames;
+    string too_large_usernames;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (req.sublists[i].empty())
+        {
+            continue;
+        }
+        if (req.unanswered[i] || req.tooLarge[i])
+        {
+            string &names = req.unanswered[i] ? unanswered_usernames : too_large_usernames;
+            for (const auto &username : req.sublists[i])
+            {
+                names += (names.empty() ? "" : ", ") + username;
+            }
+            continue;
+        }
+        servers += (shard_results.empty() ? "" : " and ") + shards[i].id;
+        shard_results.push_back(spanOf(req.results[i]));
+        for (const auto &username : req.sublists[i])
+        {
+            final_username_list += (final_username_list.empty() ? "" : ", ") + username;
+        }
+    }
+    vector<pair<int, int>> common_intervals;
+    auto merge_start = chrono::steady_clock::now();
+    // An earliest-slot request stops merging as soon as it has its slots
+    if (too_large_usernames.empty())
+    {
+        intersectIntervals(shard_results.data(), shard_results.size(), common_intervals, nullptr, req.filter);
+    }
+    stats.phases[PHASE_MERGE].record(elapsedNs(merge_start, chrono::steady_clock::now()));
+
+    if (!common_intervals.empty())
+    {
+        cout << "Found the intersection between the results from server " << servers << ": " << endl;
+        for (const auto &interval : common_intervals)
+        {
+            cout << "[" << interval.first << "," << interval.second << "] ";
+        }
+        cout << endl;
+    }
+
+    // Only complete results computed entirely from the current data of the backend servers are cached
+    if (!req.cacheKey.empty() && req.cacheGeneration == cacheGeneration && unanswered_usernames.empty() && too_large_usernames.empty())
+    {
+        cacheStore(req.cacheKey, common_intervals, usernames, final_username_list);
+    }
+    sendReply(conn, common_intervals, usernames, final_username_list, unanswered_usernames, too_large_usernames);
+}
+
+/*
+PHASE 4 of a batch request
+Runs once the results of every subgroup are in. Every group that was not answered from the cache is intersected from the
+results of its subgroups like a single request, and the replies to all groups go out in one frame.
+*/
+void Phase4_finishBatch(ClientConnection &conn)
+{
+    ClientRequest &req = conn.request;
+    auto merge_start = chrono::steady_clock::now();
+    conn.outbuf.clear();
+    vector<IntervalSpan> shard_results;
+    vector<pair<int, int>> common_intervals;
+    for (const BatchGroup &group : req.groups)
+    {
+        if (group.cached)
+        {
+            appendReply(conn.outbuf, group.intervals, group.missing, group.found, "", "");
+            continue;
+        }
+        shard_results.clear();
+        string final_username_list;
+        string unanswered_usernames;
+        string too_large_usernames;
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            if (group.subgroups[i] == FAIL)
+            {
+                continue;
+            }
+            const Subgroup &subgroup = req.subgroups[i][group.subgroups[i]];
+            string &names = subgroup.unanswered ? unanswered_usernames : subgroup.tooLarge ? too_large_usernames : final_username_list;
+            for (const auto &username : subgroup.usernames)
+            {
+                names += (names.empty() ? "" : ", ") + username;
+            }
+            if (!subgroup.unanswered && !subgroup.tooLarge)
+            {
+                shard_results.push_back(spanOf(subgroup.result));
+            }
+        }
+        // A group that is missing part of its result gets no intervals rather than ones that leave those users out
+        common_intervals.clear();
+        if (too_large_usernames.empty())
+        {
+            intersectIntervals(shard_results.data(), shard_results.size(), common_intervals, nullptr, req.filter);
+        }
+        if (!group.cacheKey.empty() && req.cacheGeneration == cacheGeneration && unanswered_usernames.empty() && too_large_usernames.empty())
+        {
+            cacheStore(group.cacheKey, common_intervals, group.missing, final_username_list);
+        }
+        appendReply(conn.outbuf, common_intervals, group.missing, final_username_list, unanswered_usernames, too_large_usernames);
+    }
+    req.replyStarted = chrono::steady_clock::now();
+    stats.phases[PHASE_MERGE].record(elapsedNs(merge_start, req.replyStarted));
+    cout << "Found the intersections of the " << req.groups.size() << " groups of the batch." << endl;
+
+    packFrameHeader(conn.outhdr, OP_BATCH_REPLY, conn.outbuf.size());
+    conn.outpos = 0;
+    conn.state = CONN_WRITING;
+    writeToClient(conn);
+}
+
+/*
+PHASE 4 of a free request
+Runs once every backend server asked has sent the users free for the window. A user is stored in one shard only, so the
+union of their answers is their concatenation; it is sorted and cut to the limit of the request. Each backend server sent
+its lowest usernames up to the limit, so what is left are the lowest of all. The reply holds the users free, the candidates
+that do not exist, the servers that did not answer and the number of users free, which the usernames can fall short of if
+they do not fit in a frame. When it reaches the limit, more users may be free than were counted.
+*/
+void Phase4_finishFree(ClientConnection &conn)
+{
+    ClientRequest &req = conn.request;
+    auto merge_start = chrono::steady_clock::now();
+    vector<string> free_users;
+    string unanswered_servers;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (req.unanswered[i])
+        {
+            unanswered_servers += (unanswered_servers.empty() ? "" : ", ") + shards[i].id;
+        }
+        for (string &username : req.freeNames[i])
+        {
+            free_users.push_back(move(username));
+        }
+    }
+    sort(free_users.begin(), free_users.end());
+    if (req.window.limit > 0 && free_users.size() > req.window.limit)
+    {
+        free_users.resize(req.window.limit);
+    }
+    size_t found = free_users.size();
+
+    // The usernames are cut short rather than let the reply outgrow a frame
+    string free_list;
+    for (const auto &username : free_users)
+    {
+        if (free_list.size() + username.size() + 2 > MAX_FRAME_SIZE / 2)
+        {
+            break;
+        }
+        free_list += (free_list.empty() ? "" : ", ") + username;
+    }
+    string missing;
+    for (const auto &username : req.sublistC)
+    {
+        missing += (missing.empty() ? "" : ", ") + username;
+    }
+    req.replyStarted = chrono::steady_clock::now();
+    stats.phases[PHASE_MERGE].record(elapsedNs(merge_start, req.replyStarted));
+    cout << "Found " << (req.window.limit > 0 && found == req.window.limit ? "the first " : "") << found << " users free for [" << req.window.start << ", " << req.window.end << "). Send a reply to the client." << endl;
+
+    conn.outbuf.clear();
+    appendSection(conn.outbuf, free_list);
+    appendSection(conn.outbuf, missing);
+    appendSection(conn.outbuf, unanswered_servers);
+    appendSection(conn.outbuf, to_string(found));
+    packFrameHeader(conn.outhdr, OP_FREE_REPLY, conn.outbuf.size());
+    conn.outpos = 0;
+    conn.state = CONN_WRITING;
+    writeToClient(conn);
+}
+
+/*
+PHASE 2
+Parses the usernames of a client request, checks which backend server each of them belongs to and sends a query,
+tagged with a fresh request ID, to every backend server involved. The connection then waits for Phase 3.
+The filter of an earliest-slot request goes to the backend servers too, but its limit only when a single one is involved:
+the first slots of one shard need not overlap the first slots of another, so each of several shards has to send them all.
+*/
+void Phase2_dispatchRequest(ClientConnection &conn, string request, chrono::steady_clock::time_point received, const SlotFilter &filter = SlotFilter())
+{
+    conn.request = ClientRequest();
+    ClientRequest &req = conn.request;
+    req.timed = true;
+    req.received = received;
+    req.filter = filter;
+    stats.requests++;
+
+    //Parsing usernames received from client
+    vector<string> usernamesFromClient;
+    char *client_recv_name = strtok(&request[0], " ");
+    while (client_recv_name != NULL)
+    {
+        usernamesFromClient.push_back(client_recv_name);
+        client_recv_name = strtok(NULL, " ");
+    }
+    auto parsed = chrono::steady_clock::now();
+    stats.phases[PHASE_PARSE].record(elapsedNs(received, parsed));
+
+    // Iterating over usernames and adding to sublists depending on the backend server that they belong to
+    req.sublists.assign(shards.size(), vector<string>());
+    req.results.assign(shards.size(), vector<pair<int, int>>());
+    req.unanswered.assign(shards.size(), false);
+    req.tooLarge.assign(shards.size(), false);
+    bool found_any = false;
+    for (const auto &username_entered : usernamesFromClient)
+    {
+        uint32_t located = directory.find(username_entered);
+        if (located != NOT_FOUND)
+        {
+            req.sublists[located].push_back(username_entered);
+            found_any = true;
+        }
+        else
+        {
+            req.sublistC.push_back(username_entered);
+        }
+    }
+
+    // Answer repeated groups from the cache without asking the backend servers
+    if (cacheSize > 0 && found_any)
+    {
+        string key = cacheKeyFor(usernamesFromClient, filter);
+        CacheEntry *cached = cacheLookup(key);
+        if (cached != NULL)
+        {
+            cacheHits++;
+            cout << "Found the result for " << cached->found << " in the cache (hits: " << cacheHits << ", misses: " << cacheMisses << ")." << endl;
+            stats.phases[PHASE_ROUTE].record(elapsedNs(parsed, chrono::steady_clock::now()));
+            sendReply(conn, cached->intervals, cached->missing, cached->found);
+            return;
+        }
+        cacheMisses++;
+        req.cacheKey = key;
+        req.cacheGeneration = cacheGeneration;
+    }
+
+    //Send the usernames of every shard involved to its backend server for further processing, all at once.
+    SlotFilter shard_filter = filter;
+    if (count_if(req.sublists.begin(), req.sublists.end(), [](const vector<string> &sublist) { return !sublist.empty(); }) > 1)
+    {
+        shard_filter.limit = 0;
+    }
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        const vector<string> &sublist = req.sublists[i];
+        if (sublist.empty())
+        {
+            continue;
+        }
+        cout << "Found ";
+        // Loop over the elements of the sublist to print.
+        for (std::size_t j = 0; j < sublist.size(); j++)
+        {
+            cout << sublist[j];
+            // Print a comma if it's not the last element
+            if (j < sublist.size() - 1)
+            {
+                cout << ", ";
+            }
+        }
+        cout << " located at Server " << shards[i].id << ". Send to Server " << shards[i].id << "." << endl;
+
+        uint32_t requestId = nextRequestId++;
+        PendingQuery &query = pendingQueries[requestId];
+        query.clientFD = conn.fd;
+        query.connectionId = conn.id;
+        query.shard = i;
+        if (!Phase2_sendToShard(sublist, requestId, query, shard_filter))
+        {
+            pendingQueries.erase(requestId);
+            req.unanswered[i] = true;
+            continue;
+        }
+        req.outstanding++;
+    }
+    stats.phases[PHASE_ROUTE].record(elapsedNs(parsed, chrono::steady_clock::now()));
+
+    conn.state = CONN_WAITING_BACKEND;
+    if (req.outstanding == 0)
+    {
+        // None of the usernames exist, nothing to wait for
+        Phase4_finishRequest(conn);
+    }
+}
+
+/*
+PHASE 2 of a batch request
+Splits a batch request into its groups and each group into the usernames of every shard. A group's usernames in one shard
+form a subgroup, and groups with the same usernames in a shard share it, so every distinct subgroup is asked for once. The
+subgroups of a shard go to its backend server together, in as few datagrams as they fit in, which makes the backend traffic
+of a batch grow with the backend servers involved rather than with its groups. Groups with a cached result are not asked
+for at all. The limit of the filter is applied in Phase 4 only, since a subgroup can be shared by groups that span different
+shards.
+*/
+void Phase2_dispatchBatch(ClientConnection &conn, const string &request, chrono::steady_clock::time_point received, const SlotFilter &filter)
+{
+    conn.request = ClientRequest();
+    ClientRequest &req = conn.request;
+    req.timed = true;
+    req.batch = true;
+    req.received = received;
+    req.filter = filter;
+    stats.requests++;
+
+    // Parsing the groups of usernames; empty groups are skipped
+    vector<vector<string>> groups;
+    istringstream group_stream(request);
+    string group_text;
+    while (getline(group_stream, group_text, BATCH_SEPARATOR))
+    {
+        istringstream words(group_text);
+        vector<string> usernames;
+        string username;
+        while (words >> username)
+        {
+            usernames.push_back(username);
+        }
+        if (!usernames.empty())
+        {
+            groups.push_back(move(usernames));
+        }
+    }
+    stats.batchGroups += groups.size();
+    auto parsed = chrono::steady_clock::now();
+    stats.phases[PHASE_PARSE].record(elapsedNs(received, parsed));
+    cout << "Main Server received a batch of " << groups.size() << " groups of usernames." << endl;
+
+    // Sorting the usernames of every group into subgroups per shard, sharing identical ones
+    req.groups.resize(groups.size());
+    req.subgroups.assign(shards.size(), vector<Subgroup>());
+    req.cacheGeneration = cacheGeneration;
+    vector<unordered_map<string, int>> subgroup_index(shards.size());
+    vector<vector<string>> sublists(shards.size());
+    size_t cached = 0;
+    for (size_t g = 0; g < groups.size(); g++)
+    {
+        BatchGroup &group = req.groups[g];
+        group.subgroups.assign(shards.size(), FAIL);
+        for (auto &sublist : sublists)
+        {
+            sublist.clear();
+        }
+        bool found_any = false;
+        for (const auto &username : groups[g])
+        {
+            uint32_t located = directory.find(username);
+            if (located != NOT_FOUND)
+            {
+                sublists[located].push_back(username);
+                found_any = true;
+            }
+            else
+            {
+                group.missing += (group.missing.empty() ? "" : ", ") + username;
+            }
+        }
+
+        if (cacheSize > 0 && found_any)
+        {
+            string key = cacheKeyFor(groups[g], filter);
+            CacheEntry *entry = cacheLookup(key);
+            if (entry != NULL)
+            {
+                cacheHits++;
+                cached++;
+                group.cached = true;
+                group.intervals = entry->intervals;
+                group.missing = entry->missing;
+                group.found = entry->found;
+                continue;
+            }
+            cacheMisses++;
+            group.cacheKey = key;
+        }
+
+        for (size_t i = 0; i < shards.size(); i++)
+        {
+            if (sublists[i].empty())
+            {
+                continue;
+            }
+            auto inserted = subgroup_index[i].emplace(cacheKeyFor(sublists[i], SlotFilter()), (int)req.subgroups[i].size());
+            if (inserted.second)
+            {
+                Subgroup subgroup;
+                subgroup.usernames = sublists[i];
+                req.subgroups[i].push_back(move(subgroup));
+            }
+            group.subgroups[i] = inserted.first->second;
+        }
+    }
+    if (cached > 0)
+    {
+        cout << "Found the results for " << cached << " of the groups in the cache (hits: " << cacheHits << ", misses: " << cacheMisses << ")." << endl;
+    }
+
+    // Send the subgroups of every shard involved to its backend server, all at once
+    SlotFilter shard_filter = filter;
+    shard_filter.limit = 0;
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (req.subgroups[i].empty())
+        {
+            continue;
+        }
+        cout << "Found " << req.subgroups[i].size() << " groups of usernames located at Server " << shards[i].id << ". Send to Server "
+             << shards[i].id << "." << endl;
+        Phase2_sendBatchToShard(conn, i, shard_filter);
+    }
+    stats.phases[PHASE_ROUTE].record(elapsedNs(parsed, chrono::steady_clock::now()));
+
+    conn.state = CONN_WAITING_BACKEND;
+    if (req.outstanding == 0)
+    {
+        // Every group was cached or has no user that exists, nothing to wait for
+        Phase4_finishBatch(conn);
+    }
+}
+
+/*
+PHASE 2 of a free request
+Asks which users are free for the whole window of the request. Without candidate usernames the question goes to every
+backend server, which answers it from its free index; with them, each candidate goes to the backend server it is located at
+and candidates that do not exist are reported back. The limit goes to the backend servers too, which each send their
+lowest usernames, and Phase 4 cuts their union to it again.
+*/
+void Phase2_dispatchFree(ClientConnection &conn, const string &request, chrono::steady_clock::time_point received, const FreeWindow &window)
+{
+    conn.request = ClientRequest();
+    ClientRequest &req = conn.request;
+    req.timed = true;
+    req.reverse = true;
+    req.received = received;
+    req.window = window;
+    stats.freeRequests++;
+
+    istringstream words(request);
+    vector<string> candidates;
+    string username;
+    while (words >> username)
+    {
+        candidates.push_back(username);
+    }
+    // A candidate named twice is checked, listed and counted once
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+    auto parsed = chrono::steady_clock::now();
+    stats.phases[PHASE_PARSE].record(elapsedNs(received, parsed));
+    cout << "Main Server received a free request for [" << window.start << ", " << window.end << ") with " << candidates.size()
+         << " candidate usernames." << endl;
+
+    req.sublists.assign(shards.size(), vector<string>());
+    req.freeNames.assign(shards.size(), vector<string>());
+    req.unanswered.assign(shards.size(), false);
+    for (const auto &candidate : candidates)
+    {
+        uint32_t located = directory.find(candidate);
+        if (located != NOT_FOUND)
+        {
+            req.sublists[located].push_back(candidate);
+        }
+        else
+        {
+            req.sublistC.push_back(candidate);
+        }
+    }
+
+    for (size_t i = 0; i < shards.size(); i++)
+    {
+        if (candidates.empty() || !req.sublists[i].empty())
+        {
+            cout << "Send the free request to Server " << shards[i].id << "." << endl;
+            Phase2_sendFreeToShard(conn, i);
+        }
+    }
+    stats.phases[PHASE_ROUTE].record(elapsedNs(parsed, chrono::steady_clock::now()));
+
+    conn.state = CONN_WAITING_BACKEND;
+    if (req.outstanding == 0)
+    {
+        // None of the candidates exist, nothing to wait for
+        Phase4_finishFree(conn);
+    }
+}
+
+/*
+PHASE 3
+Stores the intersection result a backend server sent for the request of this connection. Once every backend server
+involved has answered, Phase 4 runs.
+*/
+void Phase3_recordRoundTrip(int shard, uint64_t round_trip, bool first_try);
+
+void Phase3_receiveResult(ClientConnection &conn, int shard, vector<pair<int, int>> &result, uint64_t round_trip, bool first_try)
+{
+    ClientRequest &req = conn.request;
+    Phase3_recordRoundTrip(shard, round_trip, first_try);
+    cout << "Main Server received from server " << shards[shard].id << " the intersection result using UDP over port " << SERVERM_UDP << ":" << endl;
+    cout << formatIntervals(result) << endl;
+    req.results[shard].swap(result);
+
+    if (--req.outstanding == 0)
+    {
+        Phase4_finishRequest(conn);
+    }
+}
+
+// Finishes the part of the request of this connection that shard answered with a result too large to send
+void Phase3_resultTooLarge(ClientConnection &conn, int shard)
+{
+    ClientRequest &req = conn.request;
+    cout << "Main Server received from server " << shards[shard].id << " an intersection result that is too large to send." << endl;
+    req.tooLarge[shard] = true;
+    if (--req.outstanding == 0)
+    {
+        Phase4_finishRequest(conn);
+    }
+}
+
+// Records the round trip of a query that shard has answered, timed from the copy that was answered rather than from the
+// request, so retries, hedges and the later datagrams of a batch are not charged the time before they were sent
+void Phase3_recordRoundTrip(int shard, uint64_t round_trip, bool first_try)
+{
+    Shard &answered = shards[shard];
+    answered.roundTrip.record(round_trip);
+    // The hedging delay follows the recent round trips of queries that were sent once; the ones that needed a retry
+    // would pull it up to the timeout as soon as a few percent of the datagrams are lost
+    if (first_try)
+    {
+        answered.recentFirstTries.record(round_trip);
+        if (answered.recentFirstTries.total == HEDGE_REFRESH)
+        {
+            answered.hedgeDelayNs = answered.recentFirstTries.percentile(HEDGE_PERCENTILE);
+            answered.recentFirstTries.clear();
+        }
+    }
+}
+
+// Finishes the request of this connection without the part a backend server did not answer: a shard of a single request or
+// of a free request, or the subgroups of a batch query whose results had not all arrived
+void Phase3_shardUnanswered(ClientConnection &conn, const PendingQuery &query)
+{
+    ClientRequest &req = conn.request;
+    cout << "Main Server did not receive the intersection result from server " << shards[query.shard].id << " in time." << endl;
+    if (query.firstSubgroup == FAIL)
+    {
+        req.unanswered[query.shard] = true;
+    }
+    for (int j = query.firstSubgroup; j != FAIL && j < query.firstSubgroup + query.subgroupCount; j++)
+    {
+        Subgroup &subgroup = req.subgroups[query.shard][j];
+        subgroup.unanswered = !subgroup.answered;
+    }
+    if (--req.outstanding == 0)
+    {
+        req.batch ? Phase4_finishBatch(conn) : req.reverse ? Phase4_finishFree(conn) : Phase4_finishRequest(conn);
+    }
+}
+
+/*
+Runs the query timers that are due. A query that is not answered by its deadline is sent again with the same request ID,
+up to backendRetries times, and then given up, so a lost datagram or a backend server that is down costs one request its
+deadlines rather than hanging it. With -H a query that takes longer than HEDGE_PERCENTILE of its shard's round trips is
+sent a second time right away, and whichever copy is answered first is used. Retries and hedges go to another replica of
+the shard if it has a healthy one, and a missed deadline counts against the latency average of the replica that missed it.
+*/
+void Phase3_expireQueries()
+{
+    auto now = chrono::steady_clock::now();
+    while (!queryTimers.empty() && queryTimers.top().due <= now)
+    {
+        QueryTimer timer = queryTimers.top();
+        queryTimers.pop();
+        auto pending = pendingQueries.find(timer.requestId);
+        if (pending == pendingQueries.end())
+        {
+            continue; // answered already
+        }
+        PendingQuery &query = pending->second;
+        Shard &shard = shards[query.shard];
+        // Nothing waits for the query of a client that has left, so it is dropped rather than sent again
+        auto it = connections.find(query.clientFD);
+        if (it == connections.end() || it->second.id != query.connectionId)
+        {
+            releaseReplicas(query);
+            pendingQueries.erase(pending);
+            continue;
+        }
+        if (timer.hedge)
+        {
+            if (!query.hedged)
+            {
+                query.hedged = true;
+                stats.hedges++;
+                Phase2_sendToReplica(query, pickReplica(shard, query.sends[query.lastTry].replica));
+            }
+            continue;
+        }
+        if (timer.due != query.deadline)
+        {
+            continue; // the deadline of an earlier attempt
+        }
+        // The replica that missed the deadline is charged the timeout once, and a late reply from it is not timed again
+        QuerySend &missed = query.sends[query.lastTry];
+        recordReplicaLatency(shard, missed.replica, (uint64_t)backendTimeoutMs * 1000000);
+        if (query.attempts < backendRetries)
+        {
+            query.attempts++;
+            stats.retries++;
+            query.deadline = now + chrono::milliseconds(backendTimeoutMs);
+            queryTimers.push({query.deadline, timer.requestId, false});
+            missed.released = true;
+            shard.replicas[missed.replica].outstanding--;
+            int next = pickReplica(shard, missed.replica);
+            query.lastTry = query.sends.size();
+            Phase2_sendToReplica(query, next);
+            continue;
+        }
+
+        stats.timeouts++;
+        cerr << "Error: Server " << shard.id << " did not answer a query in " << backendRetries + 1 << " attempts of " << backendTimeoutMs << " ms" << endl;
+        PendingQuery given_up = move(query);
+        releaseReplicas(given_up);
+        pendingQueries.erase(pending);
+        Phase3_shardUnanswered(it->second, given_up);
+        // The client may have sent its next request while this one was waiting for the backend servers
+        serveClient(given_up.clientFD);
+    }
+}
+
+/*
+Health probes. Every PROBE_INTERVAL_MS each replica of a shard that has more than one is sent an OP_PING, which its backend
+server answers with an OP_PONG carrying the same request ID. A replica that leaves PROBE_MISSES probes in a row unanswered
+is ejected and gets no queries while its shard has a healthy replica; the first probe it answers again readmits it.
+*/
+void Phase2_probeReplicas()
+{
+    auto now = chrono::steady_clock::now();
+    if (now < nextProbe)
+    {
+        return;
+    }
+    bool replicated = false;
+    for (Shard &shard : shards)
+    {
+        if (shard.replicas.size() < 2)
+        {
+            continue;
+        }
+        replicated = true;
+        for (Replica &replica : shard.replicas)
+        {
+            if (replica.probeId != 0 && ++replica.missedProbes == PROBE_MISSES && replica.healthy)
+            {
+                replica.healthy = false;
+                stats.ejections++;
+                cerr << "Error: Server " << shard.id << " at " << replica.address << " did not answer " << PROBE_MISSES
+                     << " health probes and gets no more queries" << endl;
+            }
+            replica.probeId = nextProbeId++;
+            char ping[HEADER_SIZE];
+            packHeader(ping, replica.probeId, OP_PING, 0, 0);
+            Phase2_queueDatagram(ping, HEADER_SIZE, replica.addr);
+        }
+    }
+    // Without a shard to choose a replica of, the probes stop for good
+    nextProbe = replicated ? now + chrono::milliseconds(PROBE_INTERVAL_MS) : chrono::steady_clock::time_point::max();
+}
+
+// Marks the replica whose latest health probe this answers as healthy, and readmits it if it was ejected
+void receivePong(const MessageHeader &header)
+{
+    for (Shard &shard : shards)
+    {
+        for (Replica &replica : shard.replicas)
+        {
+            if (replica.probeId == 0 || replica.probeId != header.request_id)
+            {
+                continue;
+            }
+            replica.probeId = 0;
+            replica.missedProbes = 0;
+            if (!replica.healthy)
+            {
+                // It starts out as fast as the fastest healthy replica rather than with the timeouts that got it ejected
+                double fastest = 0;
+                for (const Replica &other : shard.replicas)
+                {
+                    if (other.healthy && other.latencyNs > 0 && (fastest == 0 || other.latencyNs < fastest))
+                    {
+                        fastest = other.latencyNs;
+                    }
+                }
+                replica.latencyNs = fastest;
+                replica.healthy = true;
+                cout << "Server " << shard.id << " at " << replica.address << " answers its health probes again and gets queries." << endl;
+            }
+            return;
+        }
+    }
+}
+
+// Sets timerFD to go off at the earliest query timer or health probe, unless it is set to go off before that already
+void armQueryTimer()
+{
+    chrono::steady_clock::time_point due = nextProbe;
+    if (!queryTimers.empty() && queryTimers.top().due < due)
+    {
+        due = queryTimers.top().due;
+    }
+    if (due == chrono::steady_clock::time_point::max())
+    {
+        return;
+    }
+    if (timerArmedFor != chrono::steady_clock::time_point() && timerArmedFor <= due)
+    {
+        return;
+    }
+    timerArmedFor = due;
+    auto ns = chrono::duration_cast<chrono::nanoseconds>(due.time_since_epoch()).count();
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof spec);
+    spec.it_value.tv_sec = ns / 1000000000;
+    spec.it_value.tv_nsec = ns % 1000000000;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+    {
+        spec.it_value.tv_nsec = 1; // zero would disarm the timer
+    }
+    if (timerfd_settime(timerFD, TFD_TIMER_ABSTIME, &spec, NULL) == FAIL)
+    {
+        perror("[ERROR] Server M failed to set the query timer");
+    }
+}
+
+// The opcode of the results a backend server answers query with
+int resultOpcodeOf(const PendingQuery &query)
+{
+    return query.firstSubgroup != FAIL ? OP_BATCH_RESULT : query.reverse ? OP_FREE_RESULT : OP_RESULT;
+}
+
+/*
+Finds the pending query a result answers by its request ID. A result without one is a duplicate or belongs to a client that
+has left. A result of another kind than the query, which no backend server sends, would be stored in the wrong part of the
+request, so it is counted as an error and dropped. Returns pendingQueries.end() for both.
+*/
+unordered_map<uint32_t, PendingQuery>::iterator findPendingQuery(const MessageHeader &header)
+{
+    auto pending = pendingQueries.find(header.request_id);
+    if (pending == pendingQueries.end())
+    {
+        stats.lateReplies++;
+        return pending;
+    }
+    if (resultOpcodeOf(pending->second) != header.opcode)
+    {
+        stats.errors++;
+        cerr << "Error: a result of the wrong kind for query " << header.request_id << " from server " << shards[pending->second.shard].id << endl;
+        return pendingQueries.end();
+    }
+    return pending;
+}
+
+/*
+Records the round trip of the replica that answered a query and takes the query off the outstanding queries of its replicas.
+The copy answered is the latest one sent to the address the reply came from, so a late reply from a replica that missed its
+deadline is not credited to the replica of the retry. A copy that was charged the timeout already is not timed again, and a
+reply from an address the query was not sent to is not timed at all. Returns the round trip of the copy answered, or of the
+latest copy when the address matches none, for the round trips of the shard.
+*/
+uint64_t settleQuery(const PendingQuery &query, const struct sockaddr_in &from)
+{
+    Shard &shard = shards[query.shard];
+    auto now = chrono::steady_clock::now();
+    uint64_t round_trip = elapsedNs(query.sends.back().sentAt, now);
+    for (auto send = query.sends.rbegin(); send != query.sends.rend(); ++send)
+    {
+        const struct sockaddr_in &addr = shard.replicas[send->replica].addr;
+        if (from.sin_addr.s_addr == addr.sin_addr.s_addr && from.sin_port == addr.sin_port)
+        {
+            round_trip = elapsedNs(send->sentAt, now);
+            if (!send->released)
+            {
+                recordReplicaLatency(shard, send->replica, round_trip);
+            }
+            break;
+        }
+    }
+    releaseReplicas(query);
+    return round_trip;
+}
+
+/*
+Stores the subgroup results in one OP_BATCH_RESULT datagram: the index of its first subgroup among those of the query, a
+little-endian uint32, followed by the binary results of subgroups in a row. The result of a batch query can take several
+datagrams, which may arrive in any order, and a retry or hedge can send some of them twice; the query is answered once a
+result for each of its subgroups has arrived.
+*/
+void Phase3_receiveBatchResult(const MessageHeader &header, const char *payload, const struct sockaddr_in &from)
+{
+    auto pending = findPendingQuery(header);
+    if (pending == pendingQueries.end())
+    {
+        return;
+    }
+    PendingQuery &query = pending->second;
+    Shard &shard = shards[query.shard];
+    auto it = connections.find(query.clientFD);
+    if (it == connections.end() || it->second.id != query.connectionId)
+    {
+        releaseReplicas(query);
+        pendingQueries.erase(pending);
+        return;
+    }
+    ClientRequest &req = it->second.request;
+    if (header.version != shard.dataVersion)
+    {
+        for (BatchGroup &group : req.groups)
+        {
+            group.cacheKey.clear();
+        }
+    }
+
+    const char *end = payload + header.length;
+    if (!(header.flags & FLAG_BINARY_INTERVALS) || header.length < 4)
+    {
+        stats.errors++;
+        cerr << "Error: malformed batch result from server " << shard.id << endl;
+        return;
+    }
+    uint32_t index = loadLE32(payload);
+    vector<pair<int, int>> result;
+    for (const char *p = payload + 4; p < end; index++)
+    {
+        // A subgroup whose result is too large for a datagram is answered as such, so the batch need not wait for it
+        bool too_large = end - p >= 4 && loadLE32(p) == RESULT_TOO_LARGE;
+        if (index >= (uint32_t)query.subgroupCount || (!too_large && !decodeIntervals(p, end - p, result)))
+        {
+            stats.errors++;
+            cerr << "Error: truncated batch result from server " << shard.id << endl;
+            break;
+        }
+        p += too_large ? 4 : encodedIntervalsSize(result.size());
+        Subgroup &subgroup = req.subgroups[query.shard][query.firstSubgroup + index];
+        if (!subgroup.answered)
+        {
+            subgroup.answered = true;
+            subgroup.tooLarge = too_large;
+            subgroup.result.swap(result);
+            query.subgroupsLeft--;
+        }
+    }
+    if (query.subgroupsLeft > 0)
+    {
+        return;
+    }
+
+    bool first_try = query.attempts == 0 && !query.hedged;
+    int clientFD = query.clientFD;
+    int shard_index = query.shard;
+    int subgroups = query.subgroupCount;
+    uint64_t round_trip = settleQuery(query, from);
+    pendingQueries.erase(pending);
+    Phase3_recordRoundTrip(shard_index, round_trip, first_try);
+    cout << "Main Server received from server " << shard.id << " the intersection results of " << subgroups << " groups using UDP over port "
+         << SERVERM_UDP << "." << endl;
+    if (--req.outstanding == 0)
+    {
+        Phase4_finishBatch(it->second);
+    }
+    // The client may have sent its next request while this one was waiting for the backend servers
+    serveClient(clientFD);
+}
+
+/*
+Stores one chunk of the users a backend server found free for a free query: its chunk number, a little-endian uint32,
+followed by space separated usernames. The chunks may arrive in any order, and a retry or hedge can send some of them twice;
+the query is answered once every chunk up to the one with FLAG_LAST_CHUNK has arrived.
+*/
+void Phase3_receiveFreeResult(const MessageHeader &header, const char *payload, const struct sockaddr_in &from)
+{
+    auto pending = findPendingQuery(header);
+    if (pending == pendingQueries.end())
+    {
+        return;
+    }
+    PendingQuery &query = pending->second;
+    Shard &shard = shards[query.shard];
+    uint32_t chunk = header.length >= 4 ? loadLE32(payload) : MAX_FREE_CHUNKS;
+    if (chunk >= MAX_FREE_CHUNKS)
+    {
+        stats.errors++;
+        cerr << "Error: malformed free result from server " << shard.id << endl;
+        return;
+    }
+    if (chunk >= query.chunks.size())
+    {
+        query.chunks.resize(chunk + 1);
+        query.chunkSeen.resize(chunk + 1);
+    }
+    if (!query.chunkSeen[chunk])
+    {
+        query.chunkSeen[chunk] = true;
+        query.chunks[chunk].assign(payload + 4, header.length - 4);
+        query.chunksReceived++;
+    }
+    if (header.flags & FLAG_LAST_CHUNK)
+    {
+        query.chunkCount = chunk + 1;
+    }
+    if (query.chunkCount == 0 || query.chunksReceived < query.chunkCount)
+    {
+        return;
+    }
+
+    PendingQuery answered = move(query);
+    pendingQueries.erase(pending);
+    uint64_t round_trip = settleQuery(answered, from);
+    auto it = connections.find(answered.clientFD);
+    if (it == connections.end() || it->second.id != answered.connectionId)
+    {
+        return;
+    }
+    ClientRequest &req = it->second.request;
+    bool first_try = answered.attempts == 0 && !answered.hedged;
+    Phase3_recordRoundTrip(answered.shard, round_trip, first_try);
+    vector<string> &names = req.freeNames[answered.shard];
+    size_t before = names.size();
+    for (uint32_t i = 0; i < answered.chunkCount; i++)
+    {
+        istringstream words(answered.chunks[i]);
+        string username;
+        while (words >> username)
         {
-            fresult = "[]";
+            names.push_back(username);
         }
-        else
+    }
+    cout << "Main Server received from server " << shard.id << " " << names.size() - before << " users free using UDP over port " << SERVERM_UDP
+         << "." << endl;
+    if (--req.outstanding == 0)
+    {
+        Phase4_finishFree(it->second);
+    }
+    // The client may have sent its next request while this one was waiting for the backend servers
+    serveClient(answered.clientFD);
+}
+
+// Hands one datagram from a backend server to the phase it belongs to; a result goes to the client request it answers
+void Phase3_handleDatagram(const char *buffer, size_t received, const struct sockaddr_in &from)
+{
+    MessageHeader header;
+    if (!unpackHeader(buffer, received, header))
+    {
+        return;
+    }
+    if (header.opcode == OP_USERLIST)
+    {
+        // A backend server that missed the acknowledgement of its last chunk sends it again, or one that restarted sends its list
+        Phase1_receiveChunk(header, buffer + HEADER_SIZE, from);
+        return;
+    }
+    if (header.opcode == OP_DELTA)
+    {
+        receiveChanges(header, buffer + HEADER_SIZE, from);
+        return;
+    }
+    if (header.opcode == OP_PONG)
+    {
+        receivePong(header);
+        return;
+    }
+    if (header.opcode == OP_BATCH_RESULT)
+    {
+        Phase3_receiveBatchResult(header, buffer + HEADER_SIZE, from);
+        return;
+    }
+    if (header.opcode == OP_FREE_RESULT)
+    {
+        Phase3_receiveFreeResult(header, buffer + HEADER_SIZE, from);
+        return;
+    }
+    if (header.opcode != OP_RESULT)
+    {
+        return;
+    }
+
+    // Replies are matched by request ID, so they can arrive in any order.
+    auto pending = findPendingQuery(header);
+    if (pending == pendingQueries.end())
+    {
+        return;
+    }
+    Shard &shard = shards[pending->second.shard];
+    bool too_large = header.flags & FLAG_TOO_LARGE;
+
+    // A result that does not decode is dropped and the query stays pending, so it is sent again like a lost one rather
+    // than merged as a group with no time in common
+    const char *payload = buffer + HEADER_SIZE;
+    vector<pair<int, int>> result;
+    if (!too_large && (header.flags & FLAG_BINARY_INTERVALS))
+    {
+        if (!decodeIntervals(payload, header.length, result))
         {
-            std::stringstream ss;
-            ss << '[' << usernames << ']';
-            fresult += ss.str();
+            stats.errors++;
+            cerr << "Error: truncated intersection result from server " << shard.id << endl;
+            return;
         }
+    }
+    else if (!too_large)
+    {
+        // Parsing buffer data from the backend server using the ParseIntervals function
+        result = ParseIntervals(payload, header.length);
+    }
+    PendingQuery query = move(pending->second);
+    pendingQueries.erase(pending);
+    bool first_try = query.attempts == 0 && !query.hedged;
+
+    // A result too large for a datagram is final: the shard's part of the request fails at once, and it counts neither as a
+    // round trip nor towards the latency of the replica
+    uint64_t round_trip = 0;
+    if (too_large)
+    {
+        releaseReplicas(query);
+    }
+    else
+    {
+        round_trip = settleQuery(query, from);
+    }
+
+    auto it = connections.find(query.clientFD);
+    if (it == connections.end() || it->second.id != query.connectionId)
+    {
+        return;
+    }
+    if (too_large)
+    {
+        Phase3_resultTooLarge(it->second, query.shard);
+        serveClient(query.clientFD);
+        return;
+    }
+    // A result from data Main Server has not received the changes of yet cannot be invalidated correctly, so it is not cached
+    if (header.version != shard.dataVersion)
+    {
+        it->second.request.cacheKey.clear();
+    }
+    Phase3_receiveResult(it->second, query.shard, result, round_trip, first_try);
+    // The client may have sent its next request while this one was waiting for the backend servers
+    serveClient(query.clientFD);
+}
 
-        //Sending final intersection result to client
-        string send_intersection = final_interval.str() + fresult + '\n';
-        if (send(childSocketFD, send_intersection.c_str(), send_intersection.length(), 0) < 0)
+// Drains every datagram queued on the UDP socket, a batch per recvmmsg, and handles each of them
+void Phase3_receiveResults()
+{
+    while (true)
+    {
+        int received = resultBatch.receive(sockfd_UDP, 0);
+        if (received == FAIL)
         {
-            perror("send");
-            exit(EXIT_FAILURE);
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                stats.errors++;
+                perror("Error in receiving data");
+            }
+            return;
+        }
+        stats.datagramsIn += received;
+        for (int i = 0; i < received; i++)
+        {
+            Phase3_handleDatagram(resultBatch.buffer(i), resultBatch.length(i), resultBatch.address(i));
+        }
+        // A partial batch emptied the queue; a datagram that arrives later raises a new edge
+        if ((size_t)received < resultBatch.capacity())
+        {
+            return;
+        }
+    }
+}
+
+// Repurposed from Beej’s socket programming tutorial
+// Accepts every pending connection on the parent socket and registers each child socket with epoll
+void acceptClients()
+{
+    while (true)
+    {
+        socklen_t clientAddrSize = sizeof(destClient_addr);
+        int childSocketFD = ::accept(serverM_clientFD, (struct sockaddr *)&destClient_addr, &clientAddrSize);
+        if (childSocketFD == FAIL)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("[ERROR] Server M failed to accept connection with Client.");
+            }
+            return;
+        }
+        setNonBlocking(childSocketFD);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = childSocketFD;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, childSocketFD, &ev) == FAIL)
+        {
+            perror("[ERROR] Server M failed to register client with epoll");
+            close(childSocketFD);
+            continue;
         }
+        stats.connectionsAccepted++;
+        ClientConnection &conn = connections[childSocketFD];
+        conn.fd = childSocketFD;
+        conn.id = nextConnectionId++;
+        conn.state = CONN_READING;
+    }
+}
 
-        if (final_username_list.str().empty())
+void closeClient(ClientConnection &conn)
+{
+    epoll_ctl(epollFD, EPOLL_CTL_DEL, conn.fd, NULL);
+    close(conn.fd);
+    connections.erase(conn.fd);
+}
+
+// Sends as much of the pending reply frame as the socket accepts, header and payload together with one writev.
+// Returns false if the connection was closed.
+bool writeToClient(ClientConnection &conn)
+{
+    size_t total = FRAME_HEADER_SIZE + conn.outbuf.size();
+    while (conn.outpos < total)
+    {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (conn.outpos < FRAME_HEADER_SIZE)
+        {
+            iov[iovcnt].iov_base = conn.outhdr + conn.outpos;
+            iov[iovcnt].iov_len = FRAME_HEADER_SIZE - conn.outpos;
+            iovcnt++;
+            iov[iovcnt].iov_base = &conn.outbuf[0];
+            iov[iovcnt].iov_len = conn.outbuf.size();
+            iovcnt++;
+        }
+        else
         {
-            final_username_list << "[]";
+            iov[iovcnt].iov_base = &conn.outbuf[conn.outpos - FRAME_HEADER_SIZE];
+            iov[iovcnt].iov_len = total - conn.outpos;
+            iovcnt++;
         }
 
-        if (send(childSocketFD, final_username_list.str().c_str(), final_username_list.str().size(), 0) < 0)
+        ssize_t n = writev(conn.fd, iov, iovcnt);
+        if (n == FAIL)
         {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return true; // wait for the next EPOLLOUT
+            }
+            stats.errors++;
             perror("send");
-            exit(EXIT_FAILURE);
+            closeClient(conn);
+            return false;
         }
+        conn.outpos += n;
+        stats.bytesOut += n;
+    }
 
+    conn.outbuf.clear();
+    conn.outpos = 0;
+    conn.state = CONN_READING;
+    if (conn.request.timed)
+    {
+        auto now = chrono::steady_clock::now();
+        stats.phases[PHASE_REPLY].record(elapsedNs(conn.request.replyStarted, now));
+        stats.phases[PHASE_TOTAL].record(elapsedNs(conn.request.received, now));
+        conn.request.timed = false;
         cout << "Main Server sent the result to the client." << endl;
         cout << endl;
         cout << endl;
     }
+    return true;
+}
+
+// One line of the stats report: the count and percentiles of a latency histogram, in microseconds
+void appendLatencyLine(string &report, const string &name, const LatencyHistogram &histogram)
+{
+    char line[256];
+    snprintf(line, sizeof line, "%-12s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", name.c_str(), (unsigned long long)histogram.total,
+             histogram.mean() / 1000, histogram.percentile(50) / 1000.0, histogram.percentile(90) / 1000.0, histogram.percentile(99) / 1000.0,
+             histogram.percentile(99.9) / 1000.0, histogram.max / 1000.0);
+    report += line;
+}
+
+// Answers a stats request with a snapshot of the counters and phase latencies since Main Server started
+void sendStats(ClientConnection &conn)
+{
+    stats.statsRequests++;
+    double uptime = chrono::duration<double>(chrono::steady_clock::now() - stats.started).count();
+    string report;
+    char line[256];
+    snprintf(line, sizeof line, "uptime_s %.1f\nrequests %llu\nbatch_groups %llu\nfree_requests %llu\nstats_requests %llu\nerrors %llu\nbytes_in %llu\nbytes_out %llu\n"
+             "datagrams_in %llu\ndatagrams_out %llu\nconnections_accepted %llu\nconnections_open %zu\npending_queries %zu\n",
+             uptime, (unsigned long long)stats.requests, (unsigned long long)stats.batchGroups, (unsigned long long)stats.freeRequests,
+             (unsigned long long)stats.statsRequests, (unsigned long long)stats.errors,
+             (unsigned long long)stats.bytesIn, (unsigned long long)stats.bytesOut, (unsigned long long)stats.datagramsIn,
+             (unsigned long long)stats.datagramsOut, (unsigned long long)stats.connectionsAccepted, connections.size(), pendingQueries.size());
+    report += line;
+    snprintf(line, sizeof line, "retries %llu\nhedges %llu\ntimeouts %llu\nlate_replies %llu\nejections %llu\n", (unsigned long long)stats.retries,
+             (unsigned long long)stats.hedges, (unsigned long long)stats.timeouts, (unsigned long long)stats.lateReplies,
+             (unsigned long long)stats.ejections);
+    report += line;
+    for (const Shard &shard : shards)
+    {
+        for (const Replica &replica : shard.replicas)
+        {
+            snprintf(line, sizeof line, "replica %s %s %s queries %llu outstanding %d latency_us %.1f\n", shard.id.c_str(), replica.address.c_str(),
+                     replica.healthy ? "healthy" : "ejected", (unsigned long long)replica.queries, replica.outstanding, replica.latencyNs / 1000);
+            report += line;
+        }
+    }
+    snprintf(line, sizeof line, "cache_hits %llu\ncache_misses %llu\ncache_entries %zu\n\n", (unsigned long long)cacheHits,
+             (unsigned long long)cacheMisses, resultCache.size());
+    report += line;
+    snprintf(line, sizeof line, "%-12s %10s %10s %10s %10s %10s %10s %10s\n", "phase (us)", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    report += line;
+    appendLatencyLine(report, phaseNames[PHASE_PARSE], stats.phases[PHASE_PARSE]);
+    appendLatencyLine(report, phaseNames[PHASE_ROUTE], stats.phases[PHASE_ROUTE]);
+    for (const Shard &shard : shards)
+    {
+        appendLatencyLine(report, "backend " + shard.id, shard.roundTrip);
+    }
+    for (int phase = PHASE_MERGE; phase < PHASE_COUNT; phase++)
+    {
+        appendLatencyLine(report, phaseNames[phase], stats.phases[phase]);
+    }
+
+    conn.outbuf.clear();
+    appendSection(conn.outbuf, report);
+    packFrameHeader(conn.outhdr, OP_STATS_REPLY, conn.outbuf.size());
+    conn.outpos = 0;
+    conn.state = CONN_WRITING;
+    writeToClient(conn);
+}
+
+// Hands the requests a connection has received to Phase 2, one at a time.
+// The connection is looked up again on every round because sending a reply can close it.
+void serveClient(int fd)
+{
+    while (true)
+    {
+        auto it = connections.find(fd);
+        if (it == connections.end())
+        {
+            return;
+        }
+        ClientConnection &conn = it->second;
+        if (conn.state != CONN_READING)
+        {
+            return;
+        }
+
+        // Wait until a whole frame is in. A client that will send no more is closed once every whole frame is answered.
+        FrameHeader header;
+        if (conn.inbuf.size() < FRAME_HEADER_SIZE)
+        {
+            if (conn.inputClosed)
+            {
+                closeClient(conn);
+            }
+            return;
+        }
+        if (!unpackFrameHeader(conn.inbuf.data(), header) ||
+            (header.opcode != OP_SCHEDULE_REQUEST && header.opcode != OP_SLOT_REQUEST && header.opcode != OP_BATCH_REQUEST &&
+             header.opcode != OP_FREE_REQUEST && header.opcode != OP_STATS_REQUEST))
+        {
+            stats.errors++;
+            cerr << "Error: malformed request from client" << endl;
+            closeClient(conn);
+            return;
+        }
+        if (conn.inbuf.size() < FRAME_HEADER_SIZE + header.length)
+        {
+            if (conn.inputClosed)
+            {
+                closeClient(conn);
+            }
+            return;
+        }
+        auto received = chrono::steady_clock::now();
+        if (header.opcode == OP_STATS_REQUEST)
+        {
+            conn.inbuf.erase(0, FRAME_HEADER_SIZE + header.length);
+            sendStats(conn);
+            continue;
+        }
+        // An earliest-slot request and a batch request have a filter in front of the usernames, a free request a window
+        SlotFilter filter;
+        FreeWindow window;
+        size_t skip = 0;
+        if (header.opcode == OP_FREE_REQUEST)
+        {
+            if (!decodeFreeWindow(conn.inbuf.data() + FRAME_HEADER_SIZE, header.length, window))
+            {
+                stats.errors++;
+                cerr << "Error: malformed request from client" << endl;
+                closeClient(conn);
+                return;
+            }
+            skip = FREE_WINDOW_SIZE;
+        }
+        else if (header.opcode == OP_SLOT_REQUEST || header.opcode == OP_BATCH_REQUEST)
+        {
+            if (!decodeSlotFilter(conn.inbuf.data() + FRAME_HEADER_SIZE, header.length, filter))
+            {
+                stats.errors++;
+                cerr << "Error: malformed request from client" << endl;
+                closeClient(conn);
+                return;
+            }
+            skip = SLOT_FILTER_SIZE;
+        }
+        string request = conn.inbuf.substr(FRAME_HEADER_SIZE + skip, header.length - skip);
+        conn.inbuf.erase(0, FRAME_HEADER_SIZE + header.length);
+
+        cout << "Main Server received the request from client using TCP over port " << SERVER_TCP_PORT << "." << endl;
+        if (header.opcode == OP_BATCH_REQUEST)
+        {
+            Phase2_dispatchBatch(conn, request, received, filter);
+            continue;
+        }
+        if (header.opcode == OP_FREE_REQUEST)
+        {
+            Phase2_dispatchFree(conn, request, received, window);
+            continue;
+        }
+        Phase2_dispatchRequest(conn, request, received, filter);
+    }
+}
+
+// Drains the child socket (edge-triggered) into the connection's input buffer. Returns false if the connection was closed.
+// The end of the input only marks the connection, so serveClient still answers the whole frames before it.
+bool readFromClient(ClientConnection &conn)
+{
+    char buffer_client[16 * 1024];
+    while (!conn.inputClosed)
+    {
+        ssize_t bytes_received = recv(conn.fd, buffer_client, sizeof(buffer_client), 0);
+        if (bytes_received > 0)
+        {
+            conn.inbuf.append(buffer_client, bytes_received);
+            stats.bytesIn += bytes_received;
+            // Frames over MAX_FRAME_SIZE are refused when they come up, but one sent behind a request being answered
+            // would otherwise be buffered whole
+            if (conn.inbuf.size() > MAX_CLIENT_INPUT)
+            {
+                stats.errors++;
+                cerr << "Error: client sent more than " << MAX_CLIENT_INPUT << " bytes ahead" << endl;
+                closeClient(conn);
+                return false;
+            }
+            continue;
+        }
+        if (bytes_received == 0)
+        {
+            conn.inputClosed = true;
+            return true;
+        }
+        if (bytes_received == FAIL && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytes_received == FAIL && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        stats.errors++;
+        cerr << "Error receiving data from client" << endl;
+        closeClient(conn);
+        return false;
+    }
+    return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+    // Options: -c <max cached group results, 0 disables the cache> -t <seconds a cached result stays valid>
+    //          -s <ID=host:port of a backend server>, once per shard and again for every further replica of it;
+    //             Servers A and B on localhost by default
+    //          -T <ms a backend server has to answer a query before it is sent again> -R <times it is sent again>
+    //          -H to also send a query again once it takes longer than HEDGE_PERCENTILE of its shard's round trips
+    //          -q to print nothing but errors, e.g. under load
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:s:T:R:Hq")) != -1)
+    {
+        switch (opt)
+        {
+        case 'T':
+            backendTimeoutMs = atoi(optarg);
+            break;
+        case 'R':
+            backendRetries = atoi(optarg);
+            break;
+        case 'H':
+            hedging = true;
+            break;
+        case 's':
+            addShard(optarg);
+            break;
+        case 'c':
+            cacheSize = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            cacheTTL = atoi(optarg);
+            break;
+        case 'q':
+            // Without a buffer every log line is a no-op; errors still go to cerr
+            cout.rdbuf(NULL);
+            break;
+        default:
+            cerr << "Usage: " << argv[0] << " [-c cache_size] [-t cache_ttl_seconds] [-s ID=host:port ...] [-T backend_timeout_ms] [-R retries] [-H] [-q]" << endl;
+            return 1;
+        }
+    }
+    if (backendTimeoutMs <= 0 || backendRetries < 0)
+    {
+        cerr << "Error: the backend timeout must be positive and the retries not negative" << endl;
+        return 1;
+    }
+    if (shards.empty())
+    {
+        addShard(DEFAULT_SHARD_A);
+        addShard(DEFAULT_SHARD_B);
+    }
+
+    //Creating TCP socket
+    createTCPSocket();
+    // Start listening to client requests
+    listenToClient();
+    // Getting socket name
+    socklen_t len = sizeof(serverM_client_addr);
+    if (getsockname(serverM_clientFD, (struct sockaddr *)&serverM_client_addr, &len) == -1)
+    {
+        std::cerr << "Failed to get socket name" << std::endl;
+        close(serverM_clientFD);
+        return 1;
+    }
+
+    //std::cout << "DEBUG:: Server is listening on port " << ntohs(serverM_client_addr.sin_port) << std::endl;
+
+    createUDPSocket();
+    cout << "Main Server M is up and running." << endl;
+    //bind socket
+    if (::bind(sockfd_UDP, (sockaddr *)&recvaddr, sizeof(recvaddr)) < 0)
+    {
+        perror("bind error");
+        return 1;
+    }
+
+    // PHASE 1
+    //Receive the username list chunks of every shard from its backend server, in whichever order the shards come
+    char buffer_phase1[MAX_DATAGRAM_SIZE];
+    while (registeredShards < shards.size())
+    {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int phase1_recv = recvfrom(sockfd_UDP, buffer_phase1, MAX_DATAGRAM_SIZE, 0, (struct sockaddr *)&from, &from_len);
+        if (phase1_recv == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("[ERROR] Server M failed to receive data from backend server.");
+            exit(1);
+        }
+
+        MessageHeader header;
+        if (!unpackHeader(buffer_phase1, phase1_recv, header) || header.opcode != OP_USERLIST)
+        {
+            continue;
+        }
+        Phase1_receiveChunk(header, buffer_phase1 + HEADER_SIZE, from);
+    }
+    cout << endl;
+    cout << endl;
+
+    // Every client socket and the UDP socket are non-blocking and driven by one edge-triggered epoll loop,
+    // so any number of clients can be connected and a slow one never stalls the others.
+    setNonBlocking(serverM_clientFD);
+    setNonBlocking(sockfd_UDP);
+    // A client that went away while its reply was being sent is closed on the write error rather than killing the server
+    signal(SIGPIPE, SIG_IGN);
+    epollFD = epoll_create1(0);
+    if (epollFD == FAIL)
+    {
+        perror("[ERROR] Server M failed to create epoll instance");
+        exit(1);
+    }
+    // The query timers go off through a timerfd, so the loop sleeps in epoll_wait until the next deadline
+    timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (timerFD == FAIL)
+    {
+        perror("[ERROR] Server M failed to create the query timer");
+        exit(1);
+    }
+    int watched[] = {serverM_clientFD, sockfd_UDP, timerFD};
+    for (int fd : watched)
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(epollFD, EPOLL_CTL_ADD, fd, &ev) == FAIL)
+        {
+            perror("[ERROR] Server M failed to register socket with epoll");
+            exit(1);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+//while loop to continuously serve requests from all clients
+while (true)
+    {
+        int ready = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+        if (ready == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("[ERROR] Server M epoll_wait failed");
+            return 1;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == serverM_clientFD)
+            {
+                acceptClients();
+                continue;
+            }
+            if (fd == sockfd_UDP)
+            {
+                Phase3_receiveResults();
+                continue;
+            }
+            if (fd == timerFD)
+            {
+                uint64_t expirations;
+                while (read(timerFD, &expirations, sizeof expirations) > 0)
+                {
+                }
+                timerArmedFor = chrono::steady_clock::time_point();
+                continue;
+            }
+
+            auto it = connections.find(fd);
+            if (it == connections.end())
+            {
+                continue;
+            }
+            ClientConnection &conn = it->second;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                closeClient(conn);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && conn.state == CONN_WRITING && !writeToClient(conn))
+            {
+                continue;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && !readFromClient(conn))
+            {
+                continue;
+            }
+            serveClient(fd);
+        }
+        // Retries, hedges and health probes join the queries of every request dispatched in this iteration, which go out together
+        Phase3_expireQueries();
+        Phase2_probeReplicas();
+        Phase2_flushQueries();
+        armQueryTimer();
+    }
 }
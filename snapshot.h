@@ -0,0 +1,307 @@
+/*
+Author: Rajnandini Thopte
+
+snapshot.h
+
+Binary snapshot of a backend server's user table, so that a restart does not parse the text data file again. The file is
+
+    header | section table | name pool | name offsets | directory slots | user slices | intervals
+
+with every section aligned to 64 bytes and stored exactly as the UserTable arrays are laid out in memory. Opening a snapshot
+maps it read-only and points the table at the sections, so the cost of a restart does not depend on the size of the data.
+
+The header records the size and modification time of the text file it was built from. A snapshot whose source no longer
+matches, or whose format version or checksums are wrong, is stale and the caller goes back to the text file. The header
+and section table are always checksummed; the sections themselves are checked only on request, since that reads all of them.
+What queries index with is always bounds-checked, in one pass over the users and the directory slots, so a damaged snapshot
+whose section sizes still add up cannot send a lookup or a query out of its mapping.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+
+#include "usertable.h"
+
+#define SNAPSHOT_MAGIC "SCHDSNAP"
+#define SNAPSHOT_FORMAT_VERSION 1
+#define SNAPSHOT_ALIGNMENT 64
+
+// Sections, in file order
+enum SnapshotSectionId
+{
+    SECTION_NAME_POOL,
+    SECTION_NAME_OFFSETS,
+    SECTION_SLOTS,
+    SECTION_SLICES,
+    SECTION_INTERVALS,
+    SECTION_COUNT
+};
+
+struct SnapshotSection
+{
+    uint64_t offset; // from the start of the file
+    uint64_t size;   // bytes
+    uint64_t checksum;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t formatVersion;
+    uint32_t sectionCount;
+    uint64_t sourceSize;    // size of the text file the snapshot was built from
+    int64_t sourceMtimeSec; // and its modification time
+    int64_t sourceMtimeNsec;
+    uint64_t users;
+    uint64_t intervals;
+    uint32_t slotMask;
+    uint32_t reserved;
+    uint64_t checksum; // of the header with this field 0, followed by the section table
+};
+
+// 64-bit checksum, a word at a time
+inline uint64_t checksum64(const void *data, size_t length, uint64_t seed = 0x9E3779B97F4A7C15ull)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    uint64_t hash = seed ^ (length * 0xFF51AFD7ED558CCDull);
+    while (length >= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        hash = (hash ^ word) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+        p += 8;
+        length -= 8;
+    }
+    uint64_t tail = 0;
+    if (length > 0)
+    {
+        memcpy(&tail, p, length);
+    }
+    hash = (hash ^ tail) * 0x100000001B3ull;
+    return hash ^ (hash >> 32);
+}
+
+inline uint64_t headerChecksum(const SnapshotHeader &header, const SnapshotSection *sections)
+{
+    SnapshotHeader copy = header;
+    copy.checksum = 0;
+    return checksum64(sections, sizeof(SnapshotSection) * SECTION_COUNT, checksum64(&copy, sizeof(copy)));
+}
+
+inline bool writeAll(int fd, const void *data, size_t length)
+{
+    const char *p = (const char *)data;
+    while (length > 0)
+    {
+        ssize_t n = write(fd, p, length);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        length -= n;
+    }
+    return true;
+}
+
+/*
+Writes the table as a snapshot of the text file described by source. The snapshot is written to a temporary file of its
+own next to path and renamed over it once complete, so a crash never leaves a half written snapshot behind, and replicas
+that share a data file, and with it the snapshot path, never write into each other's temporary file. Returns false on any error.
+*/
+inline bool writeSnapshot(const UserTable &table, const std::string &path, const struct stat &source)
+{
+    const void *data[SECTION_COUNT] = {table.pool, table.nameOffsets, table.slots, table.slices, table.intervals};
+    uint64_t sizes[SECTION_COUNT] = {
+        table.users == 0 ? 0 : table.nameOffsets[table.users],
+        table.users == 0 ? 0 : (table.users + 1) * sizeof(uint32_t),
+        table.users == 0 ? 0 : ((uint64_t)table.slotMask + 1) * sizeof(DirectorySlot),
+        table.users * sizeof(UserSlice),
+        table.intervalCount * sizeof(std::pair<int, int>)};
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+    header.formatVersion = SNAPSHOT_FORMAT_VERSION;
+    header.sectionCount = SECTION_COUNT;
+    header.sourceSize = source.st_size;
+    header.sourceMtimeSec = source.st_mtim.tv_sec;
+    header.sourceMtimeNsec = source.st_mtim.tv_nsec;
+    header.users = table.users;
+    header.intervals = table.intervalCount;
+    header.slotMask = table.slotMask;
+
+    SnapshotSection sections[SECTION_COUNT];
+    uint64_t offset = sizeof(header) + sizeof(sections);
+    for (int i = 0; i < SECTION_COUNT; i++)
+    {
+        offset = (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+        sections[i].offset = offset;
+        sections[i].size = sizes[i];
+        sections[i].checksum = checksum64(data[i], sizes[i]);
+        offset += sizes[i];
+    }
+    header.checksum = headerChecksum(header, sections);
+
+    std::string temporary = path + ".XXXXXX";
+    int fd = mkstemp(&temporary[0]);
+    if (fd < 0)
+    {
+        return false;
+    }
+    fchmod(fd, 0644);
+    bool ok = writeAll(fd, &header, sizeof(header)) && writeAll(fd, sections, sizeof(sections));
+    uint64_t written = sizeof(header) + sizeof(sections);
+    static const char padding[SNAPSHOT_ALIGNMENT] = {0};
+    for (int i = 0; ok && i < SECTION_COUNT; i++)
+    {
+        ok = writeAll(fd, padding, sections[i].offset - written) && writeAll(fd, data[i], sizes[i]);
+        written = sections[i].offset + sizes[i];
+    }
+    ok = ok && fsync(fd) == 0;
+    if (close(fd) != 0 || !ok || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+// True if every user's slice lies within the intervals and every name within the pool, and every directory slot names a user
+inline bool snapshotIndexesInBounds(const SnapshotHeader &header, const UserSlice *slices, const uint32_t *name_offsets, uint64_t pool_size,
+                                    const DirectorySlot *slots)
+{
+    if (header.users == 0)
+    {
+        return true;
+    }
+    if (name_offsets[0] != 0)
+    {
+        return false;
+    }
+    for (uint64_t user = 0; user < header.users; user++)
+    {
+        if (slices[user].first > header.intervals || slices[user].count > header.intervals - slices[user].first ||
+            name_offsets[user + 1] < name_offsets[user] || name_offsets[user + 1] > pool_size)
+        {
+            return false;
+        }
+    }
+    for (uint64_t slot = 0; slot <= header.slotMask; slot++)
+    {
+        if (slots[slot].entry > header.users)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+Opens the snapshot at path into table, which must be empty, if it was built from the text file described by source.
+With verify, the checksum of every section is checked as well. Returns false, with the reason, if the snapshot is missing,
+stale or damaged.
+*/
+inline bool openSnapshot(const std::string &path, const struct stat &source, UserTable &table, bool verify, std::string &reason)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        reason = "no snapshot";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader) + sizeof(SnapshotSection) * SECTION_COUNT)
+    {
+        close(fd);
+        reason = "snapshot too short";
+        return false;
+    }
+    size_t size = st.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        reason = "cannot map snapshot";
+        return false;
+    }
+    const char *base = (const char *)mapping;
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+    const SnapshotSection *sections = (const SnapshotSection *)(base + sizeof(header));
+
+    reason.clear();
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, 8) != 0 || header.formatVersion != SNAPSHOT_FORMAT_VERSION || header.sectionCount != SECTION_COUNT)
+    {
+        reason = "unknown snapshot format";
+    }
+    else if (header.checksum != headerChecksum(header, sections))
+    {
+        reason = "snapshot header checksum mismatch";
+    }
+    else if (header.sourceSize != (uint64_t)source.st_size || header.sourceMtimeSec != source.st_mtim.tv_sec || header.sourceMtimeNsec != source.st_mtim.tv_nsec)
+    {
+        reason = "data file changed since the snapshot was written";
+    }
+    for (int i = 0; reason.empty() && i < SECTION_COUNT; i++)
+    {
+        if (sections[i].offset % SNAPSHOT_ALIGNMENT != 0 || sections[i].offset > size || sections[i].size > size - sections[i].offset)
+        {
+            reason = "snapshot section out of bounds";
+        }
+        else if (verify && checksum64(base + sections[i].offset, sections[i].size) != sections[i].checksum)
+        {
+            reason = "snapshot section checksum mismatch";
+        }
+    }
+    if (reason.empty() && header.users > 0 &&
+        (sections[SECTION_NAME_OFFSETS].size != (header.users + 1) * sizeof(uint32_t) ||
+         sections[SECTION_SLOTS].size != ((uint64_t)header.slotMask + 1) * sizeof(DirectorySlot) ||
+         sections[SECTION_SLICES].size != header.users * sizeof(UserSlice) ||
+         sections[SECTION_INTERVALS].size != header.intervals * sizeof(std::pair<int, int>)))
+    {
+        reason = "snapshot sections do not match its header";
+    }
+    if (reason.empty() &&
+        !snapshotIndexesInBounds(header, (const UserSlice *)(base + sections[SECTION_SLICES].offset),
+                                 (const uint32_t *)(base + sections[SECTION_NAME_OFFSETS].offset), sections[SECTION_NAME_POOL].size,
+                                 (const DirectorySlot *)(base + sections[SECTION_SLOTS].offset)))
+    {
+        reason = "snapshot indexes out of bounds";
+    }
+    if (!reason.empty())
+    {
+        munmap(mapping, size);
+        return false;
+    }
+
+    table.mapping = mapping;
+    table.mappingSize = size;
+    table.users = header.users;
+    table.intervalCount = header.intervals;
+    table.slotMask = header.slotMask;
+    table.pool = base + sections[SECTION_NAME_POOL].offset;
+    table.nameOffsets = (const uint32_t *)(base + sections[SECTION_NAME_OFFSETS].offset);
+    table.slots = (const DirectorySlot *)(base + sections[SECTION_SLOTS].offset);
+    table.slices = (const UserSlice *)(base + sections[SECTION_SLICES].offset);
+    table.intervals = (const std::pair<int, int> *)(base + sections[SECTION_INTERVALS].offset);
+    return true;
+}
+
+#endif
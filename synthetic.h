@@ -0,0 +1,68 @@
+/*
+Author: Rajnandini Thopte
+
+synthetic.h
+
+Random availability for generated data files (gen_data.cpp) and benchmarks (bench.cpp). A user's availability is a sorted
+list of intervals within [0, domain) that cover about the given fraction of it, with a gap of at least 1 between consecutive
+intervals, as the data files require. The lengths of the intervals and of the gaps are split at random, so the lists of
+two users overlap about as much as their coverage says.
+*/
+
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <random>
+#include <utility>
+#include <vector>
+
+// Splits total into parts that are each at least minimum, at random; total must be at least parts * minimum
+inline void randomParts(std::mt19937_64 &rng, long total, size_t parts, long minimum, std::vector<long> &out)
+{
+    out.assign(parts, minimum);
+    long rest = total - (long)parts * minimum;
+    if (parts == 0 || rest <= 0)
+    {
+        return;
+    }
+    std::exponential_distribution<double> weight(1.0);
+    std::vector<double> weights(parts);
+    double sum = 0;
+    for (double &w : weights)
+    {
+        w = weight(rng);
+        sum += w;
+    }
+    for (size_t i = 0; i < parts; i++)
+    {
+        out[i] += (long)(rest * (weights[i] / sum));
+    }
+}
+
+// Writes count intervals covering about coverage of [0, domain) into out. Fewer intervals are made if they do not fit.
+inline void randomAvailability(std::mt19937_64 &rng, int domain, size_t count, double coverage, std::vector<std::pair<int, int>> &out)
+{
+    out.clear();
+    long covered = std::max(1L, (long)(domain * coverage));
+    long free_time = domain - covered;
+    count = std::min<size_t>({count, (size_t)covered, (size_t)free_time + 1});
+    if (count == 0 || domain <= 0)
+    {
+        return;
+    }
+    std::vector<long> lengths, gaps;
+    randomParts(rng, covered, count, 1, lengths);
+    // The gaps before the first and after the last interval may be empty, the ones in between may not
+    randomParts(rng, free_time - (long)(count - 1), count + 1, 0, gaps);
+    long position = gaps[0];
+    for (size_t i = 0; i < count; i++)
+    {
+        out.emplace_back((int)position, (int)(position + lengths[i]));
+        position += lengths[i] + 1 + gaps[i + 1];
+    }
+}
+
+#endif
@@ -0,0 +1,226 @@
+/*
+Author: Rajnandini Thopte
+
+udp_proxy.cpp
+
+A lossy, slow UDP link for testing how Main Server copes with backend servers whose datagrams get lost or delayed. The proxy
+listens on one port and forwards every datagram it receives there to the target; what the target sends back goes to whoever
+last sent to the listening port. In both directions a datagram is dropped with probability -l percent and otherwise held
+back for -d milliseconds plus a uniformly random jitter of up to -j milliseconds, so datagrams also get reordered:
+
+    ./udp_proxy -p 31463 -t 127.0.0.1:21463 -l 2 -d 1 -j 4 &
+    ./udp_proxy -p 32463 -t 127.0.0.1:22463 -l 2 -d 1 -j 4 &
+    ./serverM -s A=127.0.0.1:31463 -s B=127.0.0.1:32463
+
+The backend servers still register with Main Server directly, so only the queries and their results cross the proxy.
+Every -i seconds (default 10) it prints how many datagrams it forwarded and dropped.
+*/
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define FAIL -1
+#define DEFAULT_REPORT_INTERVAL 10 // seconds between two reports
+
+using namespace std;
+
+// A datagram waiting out its delay
+struct DelayedDatagram
+{
+    chrono::steady_clock::time_point due;
+    uint64_t sequence; // datagrams due at the same time leave in the order they came in
+    bool toTarget;     // from the listening port to the target, or back
+    string data;
+
+    bool operator>(const DelayedDatagram &other) const
+    {
+        return due != other.due ? due > other.due : sequence > other.sequence;
+    }
+};
+
+// Parses host:port into address
+bool parseAddress(const string &spec, struct sockaddr_in &address)
+{
+    size_t colon = spec.rfind(':');
+    if (colon == string::npos)
+    {
+        return false;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(atoi(spec.c_str() + colon + 1));
+    return inet_pton(AF_INET, spec.substr(0, colon).c_str(), &address.sin_addr) == 1 && address.sin_port != 0;
+}
+
+void usage(const char *program)
+{
+    cerr << "Usage: " << program << " -p <listen port> -t <target host:port> [-l loss percent] [-d delay ms] [-j jitter ms]" << endl
+         << "       [-S seed] [-i report interval seconds]" << endl;
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int listen_port = 0;
+    struct sockaddr_in target;
+    bool have_target = false;
+    double loss = 0;
+    double delay_ms = 0;
+    double jitter_ms = 0;
+    uint64_t seed = random_device()();
+    int report_interval = DEFAULT_REPORT_INTERVAL;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:t:l:d:j:S:i:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            listen_port = atoi(optarg);
+            break;
+        case 't':
+            have_target = parseAddress(optarg, target);
+            break;
+        case 'l':
+            loss = atof(optarg) / 100;
+            break;
+        case 'd':
+            delay_ms = atof(optarg);
+            break;
+        case 'j':
+            jitter_ms = atof(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'i':
+            report_interval = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (listen_port <= 0 || !have_target || loss < 0 || loss > 1 || delay_ms < 0 || jitter_ms < 0 || report_interval <= 0)
+    {
+        usage(argv[0]);
+    }
+
+    // Repurposed from Beej’s socket programming tutorial
+    // The listening socket faces Main Server, the other one the target, which sees the proxy as the sender
+    int listen_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int target_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (listen_fd == FAIL || target_fd == FAIL)
+    {
+        perror("Error creating socket");
+        return 1;
+    }
+    struct sockaddr_in listen_addr;
+    memset(&listen_addr, 0, sizeof(listen_addr));
+    listen_addr.sin_family = AF_INET;
+    listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    listen_addr.sin_port = htons(listen_port);
+    if (::bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) == FAIL)
+    {
+        perror("bind error");
+        return 1;
+    }
+    cout << "UDP proxy forwarding port " << listen_port << " to " << inet_ntoa(target.sin_addr) << ":" << ntohs(target.sin_port)
+         << " with " << loss * 100 << "% loss and " << delay_ms << " + up to " << jitter_ms << " ms delay." << endl;
+
+    mt19937_64 rng(seed);
+    bernoulli_distribution dropped(loss);
+    uniform_real_distribution<double> jitter(0, jitter_ms);
+    priority_queue<DelayedDatagram, vector<DelayedDatagram>, greater<DelayedDatagram>> delayed;
+    uint64_t sequence = 0;
+    uint64_t forwarded[2] = {0, 0}; // back to the sender, to the target
+    uint64_t lost[2] = {0, 0};
+    struct sockaddr_in client;
+    bool have_client = false;
+    char buffer[MAX_DATAGRAM_SIZE];
+    auto next_report = chrono::steady_clock::now() + chrono::seconds(report_interval);
+
+    while (true)
+    {
+        // Send what is due, then sleep until the next datagram is due or one arrives
+        auto now = chrono::steady_clock::now();
+        while (!delayed.empty() && delayed.top().due <= now)
+        {
+            const DelayedDatagram &datagram = delayed.top();
+            if (datagram.toTarget)
+            {
+                sendto(target_fd, datagram.data.data(), datagram.data.size(), 0, (struct sockaddr *)&target, sizeof(target));
+            }
+            else if (have_client)
+            {
+                sendto(listen_fd, datagram.data.data(), datagram.data.size(), 0, (struct sockaddr *)&client, sizeof(client));
+            }
+            delayed.pop();
+        }
+        if (now >= next_report)
+        {
+            cout << "Forwarded " << forwarded[1] << " and dropped " << lost[1] << " datagrams to the target, forwarded " << forwarded[0]
+                 << " and dropped " << lost[0] << " back." << endl;
+            next_report = now + chrono::seconds(report_interval);
+        }
+        auto wake = next_report;
+        if (!delayed.empty() && delayed.top().due < wake)
+        {
+            wake = delayed.top().due;
+        }
+        int timeout_ms = (int)chrono::duration_cast<chrono::milliseconds>(wake - now + chrono::microseconds(999)).count();
+
+        struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {target_fd, POLLIN, 0}};
+        if (poll(fds, 2, timeout_ms) == FAIL)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            return 1;
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            // Take everything that is queued on the socket
+            while (fds[i].revents & POLLIN)
+            {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t received = recvfrom(fds[i].fd, buffer, sizeof buffer, MSG_DONTWAIT, (struct sockaddr *)&from, &from_len);
+                if (received < 0)
+                {
+                    break;
+                }
+                bool to_target = fds[i].fd == listen_fd;
+                if (to_target)
+                {
+                    client = from;
+                    have_client = true;
+                }
+                if (dropped(rng))
+                {
+                    lost[to_target]++;
+                    continue;
+                }
+                forwarded[to_target]++;
+                auto due = chrono::steady_clock::now() + chrono::microseconds((int64_t)((delay_ms + jitter(rng)) * 1000));
+                delayed.push({due, sequence++, to_target, string(buffer, received)});
+            }
+        }
+    }
+}
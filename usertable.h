@@ -0,0 +1,356 @@
+/*
+Author: Rajnandini Thopte
+
+usertable.h
+
+The availability data of one backend server, loaded from its data file. Every line of the file is one user:
+
+    alice;[[1,10],[11,12]]
+
+Instead of a map of per-user vectors the data is kept flat: the names in a NameDirectory, whose entry number is the user's
+index, and the intervals of all users back to back in one array, each user owning a slice of it. Queries only read these
+arrays through plain pointers, so a table can equally be served straight from a memory-mapped snapshot (snapshot.h).
+
+The file is memory mapped and split at line boundaries into one piece per thread. Each thread scans its piece with a
+hand-written parser that neither copies lines nor allocates per user, and hashes the names it finds. The pieces are then
+merged in file order, so a user that appears twice keeps its last line, like the map this replaces.
+*/
+
+#ifndef USERTABLE_H
+#define USERTABLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "directory.h"
+#include "intervals.h"
+
+// Where the intervals of one user are in the table's interval array
+struct UserSlice
+{
+    uint64_t first;
+    uint32_t count;
+    uint32_t reserved; // always 0, keeps the layout free of padding
+};
+
+struct UserTable
+{
+    // What lookups and queries read. They point into the storage below, or into a mapped snapshot.
+    const char *pool = NULL;
+    const uint32_t *nameOffsets = NULL; // users + 1 entries
+    const DirectorySlot *slots = NULL;
+    uint32_t slotMask = 0;
+    const UserSlice *slices = NULL;
+    const std::pair<int, int> *intervals = NULL;
+    size_t users = 0;
+    uint64_t intervalCount = 0;
+
+    // Storage of a table loaded from the text file
+    NameDirectory names; // name -> user index
+    std::vector<UserSlice> sliceStore;
+    std::vector<std::pair<int, int>> intervalStore;
+
+    // Storage of a table opened from a snapshot
+    void *mapping = NULL;
+    size_t mappingSize = 0;
+
+    UserTable() = default;
+    UserTable(const UserTable &) = delete;
+    UserTable &operator=(const UserTable &) = delete;
+
+    ~UserTable()
+    {
+        if (mapping != NULL)
+        {
+            munmap(mapping, mappingSize);
+        }
+    }
+
+    // Points the views at the storage once it is complete
+    void publish()
+    {
+        pool = names.pool.data();
+        nameOffsets = names.offsets.data();
+        slots = names.slots.data();
+        slotMask = names.mask;
+        slices = sliceStore.data();
+        intervals = intervalStore.data();
+        users = sliceStore.size();
+        intervalCount = intervalStore.size();
+    }
+
+    size_t size() const
+    {
+        return users;
+    }
+
+    // Returns the index of the user, or NOT_FOUND
+    uint32_t find(const char *name, size_t length) const
+    {
+        if (users == 0)
+        {
+            return NOT_FOUND;
+        }
+        return probeDirectory(slots, slotMask, pool, nameOffsets, name, length);
+    }
+
+    std::string_view name(uint32_t user) const
+    {
+        return std::string_view(pool + nameOffsets[user], nameOffsets[user + 1] - nameOffsets[user]);
+    }
+
+    IntervalSpan availability(uint32_t user) const
+    {
+        return IntervalSpan{intervals + slices[user].first, slices[user].count};
+    }
+};
+
+// A user found by a loader thread. The name points into the mapped file, or into the piece's own copy if it had spaces.
+struct ParsedUser
+{
+    const char *name;
+    uint32_t length;
+    uint32_t count;
+    uint64_t hash;
+    uint64_t first; // index of the user's first interval in the piece
+};
+
+struct ParsedPiece
+{
+    const char *begin;
+    const char *end;
+    std::vector<ParsedUser> users;
+    std::vector<std::pair<int, int>> intervals;
+    std::vector<char> spacedNames; // names that had spaces in them, with the spaces taken out
+};
+
+// Reads an optionally negative integer at p. Returns false if there is no digit.
+inline bool scanInt(const char *&p, const char *end, int &value)
+{
+    bool negative = false;
+    if (p < end && *p == '-')
+    {
+        negative = true;
+        p++;
+    }
+    if (p == end || *p < '0' || *p > '9')
+    {
+        return false;
+    }
+    int result = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        result = result * 10 + (*p - '0');
+        p++;
+    }
+    value = negative ? -result : result;
+    return true;
+}
+
+// Parses every line of a piece: the name up to ';' without its spaces, then every two integers make an interval
+inline void parsePiece(ParsedPiece &piece)
+{
+    const char *p = piece.begin;
+    const char *end = piece.end;
+    while (p < end)
+    {
+        const char *line_end = (const char *)memchr(p, '\n', end - p);
+        if (line_end == NULL)
+        {
+            line_end = end;
+        }
+        const char *semicolon = (const char *)memchr(p, ';', line_end - p);
+        if (semicolon == NULL)
+        {
+            p = line_end + 1; // blank or malformed line
+            continue;
+        }
+
+        // The name, without copying it unless it has spaces in it
+        const char *name = p;
+        size_t length = semicolon - p;
+        if (memchr(name, ' ', length) != NULL)
+        {
+            if (piece.spacedNames.capacity() == 0)
+            {
+                piece.spacedNames.reserve(end - piece.begin); // never reallocated, names keep pointing into it
+            }
+            const char *copy = piece.spacedNames.data() + piece.spacedNames.size();
+            for (const char *c = name; c < semicolon; c++)
+            {
+                if (*c != ' ')
+                {
+                    piece.spacedNames.push_back(*c);
+                }
+            }
+            name = copy;
+            length = piece.spacedNames.data() + piece.spacedNames.size() - copy;
+        }
+
+        ParsedUser user;
+        user.name = name;
+        user.length = (uint32_t)length;
+        user.hash = hashName(name, length);
+        user.first = piece.intervals.size();
+
+        const char *q = semicolon + 1;
+        int bound[2];
+        int have = 0;
+        while (q < line_end)
+        {
+            if ((*q >= '0' && *q <= '9') || *q == '-')
+            {
+                if (!scanInt(q, line_end, bound[have]))
+                {
+                    q++;
+                    continue;
+                }
+                if (++have == 2)
+                {
+                    piece.intervals.emplace_back(bound[0], bound[1]);
+                    have = 0;
+                }
+                continue;
+            }
+            q++;
+        }
+        user.count = (uint32_t)(piece.intervals.size() - user.first);
+        piece.users.push_back(user);
+        p = line_end + 1;
+    }
+}
+
+/*
+Loads the data file into table, which must be empty, with the given number of threads (all cores if 0).
+Returns false if the file cannot be read.
+*/
+inline bool loadUserTable(const std::string &path, UserTable &table, unsigned threads = 0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        table.publish();
+        return true;
+    }
+    const char *data = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+    madvise((void *)data, size, MADV_WILLNEED);
+
+    // One piece per thread, each ending at a line boundary; small files are not worth splitting
+    if (threads == 0)
+    {
+        threads = std::thread::hardware_concurrency();
+    }
+    size_t wanted = std::max<size_t>(1, std::min<size_t>(threads == 0 ? 1 : threads, size / (1 << 20) + 1));
+    std::vector<ParsedPiece> pieces;
+    const char *begin = data;
+    const char *end = data + size;
+    for (size_t i = 0; i < wanted && begin < end; i++)
+    {
+        const char *cut = (i + 1 == wanted) ? end : data + size / wanted * (i + 1);
+        if (cut < begin)
+        {
+            cut = begin;
+        }
+        const char *newline = (const char *)memchr(cut, '\n', end - cut);
+        cut = (newline == NULL) ? end : newline + 1;
+        ParsedPiece piece;
+        piece.begin = begin;
+        piece.end = cut;
+        pieces.push_back(std::move(piece));
+        begin = cut;
+    }
+
+    std::vector<std::thread> workers;
+    for (size_t i = 1; i < pieces.size(); i++)
+    {
+        workers.emplace_back(parsePiece, std::ref(pieces[i]));
+    }
+    parsePiece(pieces[0]);
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+    workers.clear();
+
+    // Copy the intervals of every piece into place in parallel
+    size_t total_users = 0;
+    size_t total_name_bytes = 0;
+    std::vector<uint64_t> piece_first(pieces.size());
+    uint64_t total_intervals = 0;
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        piece_first[i] = total_intervals;
+        total_intervals += pieces[i].intervals.size();
+        total_users += pieces[i].users.size();
+        total_name_bytes += pieces[i].end - pieces[i].begin; // upper bound, trimmed below
+    }
+    table.intervalStore.resize(total_intervals);
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        workers.emplace_back([&table, &pieces, &piece_first, i]() {
+            std::copy(pieces[i].intervals.begin(), pieces[i].intervals.end(), table.intervalStore.begin() + piece_first[i]);
+            std::vector<std::pair<int, int>>().swap(pieces[i].intervals);
+        });
+    }
+    for (auto &worker : workers)
+    {
+        worker.join();
+    }
+
+    // Insert the names in file order with the hashes the threads computed; a repeated name takes the later slice
+    table.names.reserve(total_users);
+    table.names.reservePool(std::min<size_t>(total_name_bytes, total_users * 16));
+    table.sliceStore.reserve(total_users);
+    for (size_t i = 0; i < pieces.size(); i++)
+    {
+        for (const ParsedUser &user : pieces[i].users)
+        {
+            bool inserted;
+            uint32_t index = table.names.insertHashed(user.name, user.length, user.hash, (uint32_t)table.sliceStore.size(), inserted);
+            UserSlice slice{piece_first[i] + user.first, user.count, 0};
+            if (inserted)
+            {
+                table.sliceStore.push_back(slice);
+            }
+            else
+            {
+                table.sliceStore[index] = slice;
+            }
+        }
+    }
+    munmap((void *)data, size);
+    table.publish();
+    return true;
+}
+
+#endif